@@ -79,11 +79,6 @@
 #include "../comm/shmData.h"
 #include "../comm/simUtil.h"
 
-/*
-#include "../comm/simCtlComm.h"
-simCtlComm comm(SYNC_PORT );
-*/
-
 
 #define SCAN_CONFIG "/simulator/rfid.xml"
 #define PARSE_STATE_NONE	0
@@ -97,6 +92,7 @@ struct shmData *shmData;
 struct rfidData *rfidData;
 
 int tagCheck(uint64_t newid);
+void clearSide(void );
 int tagParse(const char *elem,  const char *value, struct rfidTag *tag );
 static void startParseState(int lvl, char *name );
 static void saveData(const xmlChar *xmlName, const xmlChar *xmlValue );
@@ -205,7 +201,7 @@ int main(int argc, char *argv[])
 	{
 		catchFaults();
 	}
-	sts = initSHM(SHM_OPEN );
+	sts = initSHMRegions(SHM_OPEN, ( 1 << SHM_REGION_AUSCULTATION ) | ( 1 << SHM_REGION_CHANGE ) | ( 1 << SHM_REGION_METRICS ) );
 	
 	if ( sts )
 	{
@@ -217,6 +213,8 @@ int main(int argc, char *argv[])
 		log_message("", msgbuf );
 		exit ( -1 );
 	}
+	metricsInit(METRIC_RFID, LOOP_SLEEP_US );
+	rtMemoryInit();
 	rfidData = (struct rfidData *)calloc(sizeof(struct rfidData ), 1 );
 	if ( ! rfidData )
 	{
@@ -262,6 +260,7 @@ int main(int argc, char *argv[])
 		if (ttyfd < 0)
 		{
 			sprintf(msgbuf, "error %d opening %s: %s", errno, portname, strerror (errno));
+			metricsError(errno, "RFID port open failed" );
 			if ( debug )
 			{
 				printf("%s\n", msgbuf );
@@ -309,7 +308,7 @@ int main(int argc, char *argv[])
 	
 	state = 0;
 	rfidData->tagDetected = 0;
-	shmData->auscultation.side = 0;
+	clearSide();
 	lcount = 0;
 
 #ifdef USE_BBBGPIO
@@ -328,6 +327,7 @@ int main(int argc, char *argv[])
 	
 	while ( 1 )
 	{
+		metricsLoopStart();
 		if ( lcount++ >= LOOPS_PER_10SEC )
 		{
 			sts = stat(SCAN_CONFIG, &statCheck );
@@ -365,7 +365,7 @@ int main(int argc, char *argv[])
 				}
 				else
 				{
-					shmData->auscultation.side = 0;
+					clearSide();
 				}
 				break;
 
@@ -385,7 +385,7 @@ int main(int argc, char *argv[])
 						}
 						rfidData->tagDetected = 0;						
 					}
-					shmData->auscultation.side = 0;
+					clearSide();
 					if ( verbose )
 					{
 						sprintf(msgbuf, "Detect  0 State 2 to 0 Count %d", count );
@@ -404,6 +404,11 @@ int main(int argc, char *argv[])
 					else
 					{
 						sts = read(ttyfd, &tagBuffer[count], TAG_BUF_LEN - count );
+						metricsIo(1 );
+						if ( sts < 0 && errno != EAGAIN )
+						{
+							metricsError(errno, "RFID port read failed" );
+						}
 						if ( sts > 0 )
 						{
 							count += sts;
@@ -422,7 +427,6 @@ int main(int argc, char *argv[])
 									{
 										printf(" Tag %lld - %d\n", newid, tagIndex );
 									}
-									sprintf(shmData->auscultation.tag, "%lld", newid );
 									state = 3;
 									count = 0;
 								}
@@ -482,7 +486,6 @@ int main(int argc, char *argv[])
 									{
 										printf(" Tag %lld - %d\n", newid, tagIndex );
 									}
-									sprintf(shmData->auscultation.tag, "%lld", newid );
 									
 									state = 3;
 									count = 0;
@@ -510,7 +513,7 @@ int main(int argc, char *argv[])
 						}
 						rfidData->tagDetected = 0;						
 					}
-					shmData->auscultation.side = 0;
+					clearSide();
 					if ( verbose )
 					{
 						sprintf(msgbuf, "Detect 0 State 3 to 0" );
@@ -523,19 +526,39 @@ int main(int argc, char *argv[])
 				{
 					// Just to purge any extra characters
 					sts = read(ttyfd, &tagBuffer[0], TAG_BUF_LEN );
+					metricsIo(1 );
 				}
 		}
+		metricsLoopEnd();
 		usleep(LOOP_SLEEP_US); // 10 ms delay between checks.
 	}
 
 	return 0;
 }
 
+// Clear the auscultation side. The change is published only if it was set.
+void
+clearSide(void )
+{
+	if ( shmData->auscultation.side != 0 )
+	{
+		shmWriteBegin(SHM_SECTION_AUSCULTATION );
+		shmData->auscultation.side = 0;
+		shmWriteEnd(SHM_SECTION_AUSCULTATION );
+		shmChangePublish(SHM_SECTION_AUSCULTATION, CHG_AUSC_POSITION );
+	}
+}
+
+// Set the auscultation tag and position from the tag table, in one locked write.
+// Returns the tag index, or -1 if the tag is not known (the side is cleared).
 int
 tagCheck(uint64_t newid)
 {
 	unsigned int tagIndex;
+	int found = -1;
 	
+	shmWriteBegin(SHM_SECTION_AUSCULTATION );
+	sprintf(shmData->auscultation.tag, "%lld", (long long)newid );
 	for ( tagIndex = 0 ; tagIndex < rfidData->tagCount ; tagIndex++ )
 	{
 		if ( newid == rfidData->tags[tagIndex].tagId )
@@ -555,12 +578,18 @@ tagCheck(uint64_t newid)
 			shmData->auscultation.heartStrength = rfidData->tags[tagIndex].heartStrength;
 			shmData->auscultation.leftLungStrength = rfidData->tags[tagIndex].leftLungStrength;
 			shmData->auscultation.rightLungStrength = rfidData->tags[tagIndex].rightLungStrength;
-			return ( tagIndex );
+			found = tagIndex;
+			break;
 		}
 	}
-	// Tag not found
-	shmData->auscultation.side = 0;
-	return ( -1 );
+	if ( found < 0 )
+	{
+		// Tag not found
+		shmData->auscultation.side = 0;
+	}
+	shmWriteEnd(SHM_SECTION_AUSCULTATION );
+	shmChangePublish(SHM_SECTION_AUSCULTATION, ( found < 0 ) ? CHG_AUSC_POSITION : CHG_AUSC_POSITION | CHG_AUSC_STRENGTH );
+	return ( found );
 }
 
 /* 
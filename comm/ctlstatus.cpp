@@ -41,6 +41,7 @@ void makejson(ostream & output, string key, string content)
 
 struct shmData *shmData;
 void sendStatus(void );
+void sendMetrics(void );
 
 int debug = 0;
 
@@ -72,39 +73,47 @@ main( int argc, const char* argv[] )
 void
 sendStatus(void )
 {
+	struct auscultation auscultation;
+	struct pulse pulse;
+	struct cpr cpr;
+	
+	// Consistent copies, so a tag is not shown with the position of another
+	shmSnapshot(SHM_SECTION_AUSCULTATION, &auscultation );
+	shmSnapshot(SHM_SECTION_PULSE, &pulse );
+	shmSnapshot(SHM_SECTION_CPR, &cpr );
 	
 	cout << " \"auscultation\" : {\n";
-	makejson(cout, "side", itoa(shmData->auscultation.side ) );
+	makejson(cout, "side", itoa(auscultation.side ) );
 	cout << ",\n";
-	makejson(cout, "row", itoa(shmData->auscultation.row ) );
+	makejson(cout, "row", itoa(auscultation.row ) );
 	cout << ",\n";
-	makejson(cout, "col", itoa(shmData->auscultation.col ) );
+	makejson(cout, "col", itoa(auscultation.col ) );
 	cout << ",\n";
-	makejson(cout, "heartStrength", itoa(shmData->auscultation.heartStrength ) );
+	makejson(cout, "heartStrength", itoa(auscultation.heartStrength ) );
 	cout << ",\n";
-	makejson(cout, "leftLungStrength", itoa(shmData->auscultation.leftLungStrength ) );
+	makejson(cout, "leftLungStrength", itoa(auscultation.leftLungStrength ) );
 	cout << ",\n";
-	makejson(cout, "rightLungStrength", itoa(shmData->auscultation.rightLungStrength ) );
+	makejson(cout, "rightLungStrength", itoa(auscultation.rightLungStrength ) );
 	cout << ",\n";
-	makejson(cout, "tag", shmData->auscultation.tag );
+	makejson(cout, "tag", auscultation.tag );
 	cout << "\n},\n";
 
 	cout << " \"pulse\" : {\n";
-	makejson(cout, "right_dorsal", itoa(shmData->pulse.right_dorsal ) );
+	makejson(cout, "right_dorsal", itoa(pulse.right_dorsal ) );
 	cout << ",\n";
-	makejson(cout, "RD_AIN", itoa(shmData->pulse.ain[1] ) );
+	makejson(cout, "RD_AIN", itoa(pulse.ain[1] ) );
 	cout << ",\n";
-	makejson(cout, "left_dorsal", itoa(shmData->pulse.left_dorsal ) );
+	makejson(cout, "left_dorsal", itoa(pulse.left_dorsal ) );
 	cout << ",\n";
-	makejson(cout, "LD_AIN", itoa(shmData->pulse.ain[3] ) );
+	makejson(cout, "LD_AIN", itoa(pulse.ain[3] ) );
 	cout << ",\n";
-	makejson(cout, "right_femoral", itoa(shmData->pulse.right_femoral ) );
+	makejson(cout, "right_femoral", itoa(pulse.right_femoral ) );
 	cout << ",\n";
-	makejson(cout, "RF_AIN", itoa(shmData->pulse.ain[2] ) );
+	makejson(cout, "RF_AIN", itoa(pulse.ain[2] ) );
 	cout << ",\n";
-	makejson(cout, "left_femoral", itoa(shmData->pulse.left_femoral ) );
+	makejson(cout, "left_femoral", itoa(pulse.left_femoral ) );
 	cout << ",\n";
-	makejson(cout, "LF_AIN", itoa(shmData->pulse.ain[4] ) );
+	makejson(cout, "LF_AIN", itoa(pulse.ain[4] ) );
 	cout << "\n},\n";
 
 	cout << " \"respiration\" : {\n";
@@ -113,13 +122,116 @@ sendStatus(void )
 	cout << "\n},\n";
 	
 	cout << " \"cpr\" : {\n";
-	makejson(cout, "last", itoa(shmData->cpr.last ) );
+	makejson(cout, "last", itoa(cpr.last ) );
+	cout << ",\n";
+	makejson(cout, "x", itoa(cpr.x ) );
+	cout << ",\n";
+	makejson(cout, "y", itoa(cpr.y ) );
+	cout << ",\n";
+	makejson(cout, "z", itoa(cpr.z ) );
+	cout << "\n},\n";
+	
+	cout << " \"clock\" : {\n";
+	makejson(cout, "offset_ms", itoa((int)( shmData->timeSync.offset / 1000 ) ) );
+	cout << ",\n";
+	makejson(cout, "error_us", itoa(shmData->timeSync.error ) );
+	cout << ",\n";
+	makejson(cout, "rtt_us", itoa(shmData->timeSync.rtt ) );
+	cout << ",\n";
+	makejson(cout, "syncs", itoa(shmData->timeSync.syncs ) );
+	cout << ",\n";
+	makejson(cout, "last", itoa(shmData->timeSync.lastSync ) );
+	cout << "\n},\n";
+	
+	cout << " \"sync\" : {\n";
+	makejson(cout, "messages", itoa(shmData->sync.comm.messages ) );
+	cout << ",\n";
+	makejson(cout, "coalesced", itoa(shmData->sync.comm.coalesced ) );
+	cout << ",\n";
+	makejson(cout, "malformed", itoa(shmData->sync.comm.malformed ) );
+	cout << ",\n";
+	makejson(cout, "up", itoa(shmData->sync.comm.up ) );
+	cout << ",\n";
+	makejson(cout, "outages", itoa(shmData->sync.comm.outages ) );
 	cout << ",\n";
-	makejson(cout, "x", itoa(shmData->cpr.x ) );
+	makejson(cout, "reconnects", itoa(shmData->sync.comm.reconnects ) );
 	cout << ",\n";
-	makejson(cout, "y", itoa(shmData->cpr.y ) );
+	makejson(cout, "last_outage_ms", itoa(shmData->sync.comm.lastOutage ) );
 	cout << ",\n";
-	makejson(cout, "z", itoa(shmData->cpr.z ) );
+	makejson(cout, "max_outage_ms", itoa(shmData->sync.comm.maxOutage ) );
+	cout << ",\n";
+	makejson(cout, "binary", itoa(shmData->sync.comm.binary ) );
+	cout << ",\n";
+	makejson(cout, "lost", itoa(shmData->sync.comm.lost ) );
+	cout << ",\n";
+	makejson(cout, "latency_us", itoa(shmData->sync.comm.avgLatency ) );
+	cout << ",\n";
+	makejson(cout, "beat_p50_us", itoa(syncJitterPercentile(&shmData->sync.beat, 50 ) ) );
+	cout << ",\n";
+	makejson(cout, "beat_p99_us", itoa(syncJitterPercentile(&shmData->sync.beat, 99 ) ) );
+	cout << ",\n";
+	makejson(cout, "breath_p50_us", itoa(syncJitterPercentile(&shmData->sync.breath, 50 ) ) );
+	cout << ",\n";
+	makejson(cout, "breath_p99_us", itoa(syncJitterPercentile(&shmData->sync.breath, 99 ) ) );
+	cout << "\n},\n";
+	
+	sendMetrics();
+}
+
+void
+sendMetrics(void )
+{
+	struct daemonMetrics m;
+	unsigned int age;
+	int slot;
+	
+	cout << " \"metrics\" : {\n";
+	for ( slot = 0 ; slot < METRIC_SLOTS ; slot++ )
+	{
+		if ( slot > 0 )
+		{
+			cout << ",\n";
+		}
+		cout << " \"" << metricsName(slot ) << "\" : {\n";
+		if ( ! metricsRead(slot, &m, &age ) )
+		{
+			makejson(cout, "pid", "0" );
+			cout << "\n}";
+			continue;
+		}
+		makejson(cout, "pid", itoa(m.pid ) );
+		cout << ",\n";
+		makejson(cout, "age_s", itoa(age ) );
+		cout << ",\n";
+		makejson(cout, "loops", itoa(m.loops ) );
+		cout << ",\n";
+		makejson(cout, "target_us", itoa(m.target ) );
+		cout << ",\n";
+		makejson(cout, "period_us", itoa(m.period ) );
+		cout << ",\n";
+		makejson(cout, "max_period_us", itoa(m.maxPeriod ) );
+		cout << ",\n";
+		makejson(cout, "busy_us", itoa(m.busy ) );
+		cout << ",\n";
+		makejson(cout, "max_busy_us", itoa(m.maxBusy ) );
+		cout << ",\n";
+		makejson(cout, "overruns", itoa(m.overruns ) );
+		cout << ",\n";
+		makejson(cout, "io_ops", itoa(m.ioOps ) );
+		cout << ",\n";
+		makejson(cout, "io_per_s", itoa(m.ioRate ) );
+		cout << ",\n";
+		makejson(cout, "errors", itoa(m.errors ) );
+		cout << ",\n";
+		makejson(cout, "last_error", itoa(m.lastError ) );
+		cout << ",\n";
+		makejson(cout, "last_error_text", m.lastErrorText );
+		cout << ",\n";
+		makejson(cout, "major_faults", itoa(m.majorFaults ) );
+		cout << ",\n";
+		makejson(cout, "rt_memory", itoa(m.rtMemory ) );
+		cout << "\n}";
+	}
 	cout << "\n}\n";
 }
 
@@ -22,6 +22,7 @@
 #define SIMDATA_H_
 
 #include <semaphore.h>
+#include <stddef.h>
 
 #define SHM_NAME	"shmData"
 #define SHM_CREATE	1
@@ -31,6 +32,11 @@
 #define STR_SIZE			64
 #define COMMENT_SIZE		1024
 
+// Data written by different daemons is kept in separate cache lines, so a sensor
+// write does not evict the lines soundSense is reading (see struct shmData)
+#define SHM_LINE			64
+#define SHM_ALIGNED			__attribute__((aligned(SHM_LINE)))
+
 #define LUB_DELAY (120*1000*1000) // Delay 120ms (in ns)
 #define DUB_DELAY (200*1000*1000) // Delay 200ms (in ns)
 #define PULSE_DELAY (120*1000*1000) // Delay 120ms (in ns)
@@ -141,25 +147,458 @@ struct defibrillation
 	int energy;			// Energy in Joules of last shock
 };
 
+// Statistics for the sim-mgr HTTP link, maintained by simController
+struct httpStats
+{
+	unsigned int requests;		// Requests issued
+	unsigned int failures;		// Requests that failed (transport or HTTP error)
+	unsigned int connects;		// New TCP connections opened
+	unsigned int reused;		// Requests sent on an already open connection
+	unsigned int lastLatency;	// usec, most recent request
+	unsigned int maxLatency;	// usec
+	unsigned int avgLatency;	// usec, running average
+};
+
+// Poll scheduler state and counters, maintained by simController
+struct schedStats
+{
+	unsigned int readInterval;	// msec, current status read interval
+	unsigned int backoff;		// msec, current failure backoff, 0 when the link is healthy
+	unsigned int failures;		// Consecutive failed requests
+	unsigned int reads;			// Status reads issued
+	unsigned int readsChanged;	// Status reads that found a changed value
+	unsigned int readsSkipped;	// Read slots passed up (subscription active or backing off)
+	unsigned int writes;		// Sensor writes issued
+	unsigned int urgentWrites;	// Writes sent at once for a manual breath or CPR compression
+	unsigned int writesSkipped;	// Write slots with nothing to send
+	unsigned int backoffs;		// Failures that started or extended a backoff
+};
+
+// Clock synchronization with the sim-mgr, maintained by simController
+struct timeSync
+{
+	long long offset;			// usec, sim-mgr clock minus local clock, before correction
+	unsigned int error;			// usec, uncertainty (+/-) of the offset
+	unsigned int rtt;			// usec, shortest round trip in the last sync
+	unsigned int syncs;			// Completed syncs
+	unsigned int steps;			// Clock steps
+	unsigned int slews;			// Clock slews
+	unsigned int failures;		// Syncs abandoned
+	int lastSync;				// time() of the last completed sync
+};
+
+// Sync port counters, kept by simCtlComm
+struct syncCommStats
+{
+	unsigned int reads;			// Reads that returned data
+	unsigned int messages;		// Sync messages received
+	unsigned int coalesced;		// Messages that arrived in the same read as the one before
+	unsigned int malformed;		// Frames that were not a sync message
+	unsigned int reconnects;	// Times the connection was reopened after an outage
+	
+	int up;						// The sync connection is open
+	unsigned int outages;		// Times the connection was lost
+	unsigned int timeouts;		// Of those, lost to a keepalive or user timeout
+	unsigned int attempts;		// Reconnect attempts
+	unsigned int lastOutage;	// msec, the latest outage (or the current one so far)
+	unsigned int maxOutage;		// msec, the longest outage
+	unsigned int totalOutage;	// msec, all completed outages
+	
+	int binary;					// The sim-mgr sends binary frames (see struct syncFrame)
+	unsigned int lost;			// Frames missing from the sequence
+	int latency;				// usec, one way latency of the latest frame (sender clock to read)
+	int avgLatency;				// usec, running average
+	int maxLatency;				// usec
+};
+
+/*
+ * Sync message timing
+ *
+ * simCtlComm stamps each sync message with CLOCK_MONOTONIC when it is read and logs it
+ * in a ring of recent arrivals. The interval from the previous beat (or breath) is
+ * compared with the period set by cardiac.rate (respiration.rate) and the difference,
+ * the jitter, is counted in a histogram. Bin 0 counts jitter under SYNC_JITTER_BIN0
+ * usec, bin n counts SYNC_JITTER_BIN0 << (n-1) up to SYNC_JITTER_BIN0 << n, and the
+ * last bin counts everything larger.
+ *
+ * The log has one writer. An entry's seq is cleared while the entry is written and
+ * then set to its arrival number + 1, so a reader can detect an entry that changed
+ * under it (see syncLogRead() in simUtil.c).
+ *
+ * simController holds the only sync connection to the sim-mgr, and the log doubles
+ * as the event queue for the other daemons: syncEventWait() blocks on a futex on
+ * arrivals and returns each new arrival in turn.
+*/
+#define SYNC_LOG_SIZE		64			// Arrivals kept. Must be a power of 2
+#define SYNC_JITTER_BINS	14
+#define SYNC_JITTER_BIN0	250			// usec, width of the first bin
+#define SYNC_JITTER_NONE	0x7fffffff	// No jitter measured for this arrival
+
+struct syncArrival
+{
+	unsigned int seq;
+	int type;				// SYNC_PULSE, SYNC_PULSE_VPC or SYNC_BREATH
+	long long when;			// usec, CLOCK_MONOTONIC
+	int jitter;				// usec, interval less the expected period, or SYNC_JITTER_NONE
+};
+
+struct syncJitter
+{
+	unsigned int count;						// Intervals measured
+	unsigned int skipped;					// Intervals not measured (rate 0, or next to a VPC)
+	unsigned int hist[SYNC_JITTER_BINS];
+	int maxJitter;							// usec, largest absolute jitter
+	long long last;							// usec, previous arrival
+	int lastType;
+};
+
+// Per process state for syncEventWait(). Start zeroed.
+struct syncEventReader
+{
+	int primed;
+	unsigned int next;		// Arrival number of the next event to return
+	unsigned int lost;		// Events overwritten before they were read
+};
+
+struct syncTiming
+{
+	unsigned int arrivals;					// Arrivals logged. The newest is log[(arrivals - 1) % SYNC_LOG_SIZE]
+	struct syncArrival log[SYNC_LOG_SIZE];
+	struct syncJitter beat;					// Pulse to pulse intervals
+	struct syncJitter breath;
+	struct syncCommStats comm;
+	
+	// Changed by the waiting daemons around every event, so kept off the lines
+	// simController writes on each arrival
+	unsigned int waiters SHM_ALIGNED;		// Processes blocked in syncEventWait()
+};
+
+/*
+ * Change tracking
+ *
+ * Each writer of a section publishes a mask of the fields it changed with
+ * shmChangePublish() (simUtil.c). Readers keep a struct shmChangeReader and call
+ * shmChangeCheck() to find which sections and fields changed since their last check,
+ * so they need not compare every field on every pass. A reader with nothing else to do
+ * can block in shmChangeWait() until a section it wants changes. The generation is the
+ * futex it waits on; a publish wakes the waiters only if there are any.
+ *
+ * A section's publish count and mask are kept in its seqlock (below), on the line
+ * its writer dirties anyway, so writers of different sections do not share a line.
+ * waiters has a line of its own, as it changes whenever a reader blocks. That leaves
+ * generation as the one line every publish writes: a single futex word is what lets
+ * shmChangeWait() wait on several sections at once.
+*/
+#define SHM_SECTION_CARDIAC			0	// Written by simController, from the sim-mgr
+#define SHM_SECTION_RESPIRATION		1	// Written by simController, from the sim-mgr
+#define SHM_SECTION_AUSCULTATION	2	// Written by rfidScan
+#define SHM_SECTION_PULSE			3	// Written by pulse
+#define SHM_SECTION_CPR				4	// Written by cprScan
+#define SHM_SECTION_BREATH			5	// Written by breathSense (respiration.manual_breath)
+#define SHM_SECTIONS				6
+
+#define CHG_ALL						0xffffffff
+
+// Change bits, SHM_SECTION_CARDIAC
+#define CHG_CARDIAC_RHYTHM			(1 << 0)
+#define CHG_CARDIAC_VPC				(1 << 1)	// vpc, vpc_freq
+#define CHG_CARDIAC_VFIB_AMPLITUDE	(1 << 2)
+#define CHG_CARDIAC_PEA				(1 << 3)
+#define CHG_CARDIAC_RATE			(1 << 4)
+#define CHG_CARDIAC_PWAVE			(1 << 5)
+#define CHG_CARDIAC_INTERVALS		(1 << 6)	// pr_interval, qrs_interval
+#define CHG_CARDIAC_BPS				(1 << 7)	// bps_sys, bps_dia
+#define CHG_CARDIAC_NIBP			(1 << 8)	// nibp_rate, nibp_read, nibp_freq
+#define CHG_CARDIAC_PULSE_STRENGTH	(1 << 9)	// Any of the four pulse strengths
+#define CHG_CARDIAC_HEART_SOUND		(1 << 10)
+#define CHG_CARDIAC_HEART_VOLUME	(1 << 11)	// heart_sound_volume, heart_sound_mute
+
+// Change bits, SHM_SECTION_RESPIRATION
+#define CHG_RESP_LEFT_SOUND			(1 << 0)
+#define CHG_RESP_LEFT_VOLUME		(1 << 1)	// left_lung_sound_volume, left_lung_sound_mute
+#define CHG_RESP_RIGHT_SOUND		(1 << 2)
+#define CHG_RESP_RIGHT_VOLUME		(1 << 3)	// right_lung_sound_volume, right_lung_sound_mute
+#define CHG_RESP_DURATION			(1 << 4)	// inhalation_duration, exhalation_duration
+#define CHG_RESP_RATE				(1 << 5)
+#define CHG_RESP_AWRR				(1 << 6)
+#define CHG_RESP_CHEST_MOVEMENT		(1 << 7)
+
+// Change bits, SHM_SECTION_AUSCULTATION
+#define CHG_AUSC_POSITION			(1 << 0)	// side, row, col, tag
+#define CHG_AUSC_STRENGTH			(1 << 1)	// heartStrength, leftLungStrength, rightLungStrength
+
+// Change bits, SHM_SECTION_PULSE
+#define CHG_PULSE_PRESSURE			(1 << 0)	// right_dorsal, left_dorsal, right_femoral, left_femoral
+
+// Change bits, SHM_SECTION_CPR
+#define CHG_CPR_COMPRESSION			(1 << 0)	// compression, release. (x, y and z are sampled continuously and not tracked)
+
+// Change bits, SHM_SECTION_BREATH
+#define CHG_BREATH_MANUAL			(1 << 0)
+
+struct shmChange
+{
+	unsigned int generation;				// Advanced by every publish, any section
+	unsigned int waiters SHM_ALIGNED;		// Processes blocked in shmChangeWait()
+};
+
+// Reader state. Zero it before the first check; the first check reports everything as changed.
+struct shmChangeReader
+{
+	int primed;
+	unsigned int generation;
+	unsigned int count[SHM_SECTIONS];
+};
+
+/*
+ * Section seqlocks
+ *
+ * A writer brackets each update of a section with shmWriteBegin() and shmWriteEnd()
+ * (simUtil.c). Each section has a single writer process, so these are plain stores
+ * and never wait: the section's count is odd while it is being written. Readers copy
+ * a section with shmSnapshot(), or check their reads with shmReadBegin() and
+ * shmReadRetry(). Either way, a read that overlapped a write is repeated, so nothing
+ * half written is seen: not a sound name in mid copy, nor the side of one tag with
+ * the row of another.
+ *
+ * A write is a few stores, so waits are short. The writer records its pid. A write
+ * still in progress after SHM_WRITER_STALE_MS whose writer no longer exists was
+ * abandoned, as when a daemon is killed to be replaced. Its count is recorded in the
+ * section's seqlockReaders.stale, it is counted in abandoned and logged, readers go
+ * ahead without waiting, and the writer's next instance carries on from it. Readers
+ * stop waiting on a writer that still exists after SHM_WRITER_HUNG_MS (one stopped in
+ * a debugger, say) the same way. The counts readers keep are on lines of their own,
+ * so that a read never dirties the writer's line.
+ *
+ * SHM_SECTION_BREATH is only respiration.manual_breath, which is set by breathSense and
+ * cleared by simController. A single int needs no lock, so its writers do not take one
+ * and it is read directly, not with shmSnapshot(). manual_breath must stay the last
+ * member of struct respiration, as simController writes the rest of it in one piece.
+ * Likewise pulse.volume[] is set by soundSense without the pulse lock; each entry is a
+ * single int, and taking the lock would make the pulse daemon wait on soundSense.
+*/
+#define SHM_WRITER_STALE_MS		50
+#define SHM_WRITER_HUNG_MS		1000
+
+struct shmSeqlock
+{
+	unsigned int seq;
+	int writer;					// pid of the latest writer
+	unsigned int count;			// Change publishes (shmChangePublish())
+	unsigned int mask;			// Fields changed by the latest publish
+} SHM_ALIGNED;					// One line per section, written by its writer only
+
+// Kept by the readers of a section, on a line apart from the writer's
+struct shmSeqlockReaders
+{
+	unsigned int retries;		// Reads repeated because of a write
+	unsigned int stale;			// An odd seq whose writer is taken to be gone, else 0
+	unsigned int abandoned;		// Writes found abandoned
+} SHM_ALIGNED;
+
+/*
+ * Sensor sample rings
+ *
+ * The sensor daemons keep the last value in the fields above, and also log each
+ * reading with its time in a ring: pulse the four touch sensor AINs (every 200 ms),
+ * breathSense the manual breath AIN (10 ms) and cprScan x, y and z (about 25 ms).
+ * A reader that samples slower than the sensor can catch up, or look over the whole
+ * window the ring holds.
+ *
+ * Each ring has one writer, sensorRingPut() in simUtil.c, which never waits for the
+ * readers. Like the sync log, a sample's seq is cleared while it is written and then
+ * set to its sample number + 1, so a reader can tell a sample that was overwritten
+ * under it. Readers keep a struct sensorRingReader and call sensorRingRead().
+*/
+#define SENSOR_RING_SIZE	256		// Samples kept. Must be a power of 2
+#define SENSOR_VALUES		4
+
+struct sensorSample
+{
+	unsigned int seq;
+	int values[SENSOR_VALUES];
+	long long when;					// usec, CLOCK_MONOTONIC
+};
+
+struct sensorRing
+{
+	unsigned int count;				// Samples written. The newest is ring[(count - 1) % SENSOR_RING_SIZE]
+	int values;						// Values used in each sample
+	struct sensorSample ring[SENSOR_RING_SIZE];
+} SHM_ALIGNED;
+
+// Per process state for sensorRingRead(). Start zeroed.
+struct sensorRingReader
+{
+	int primed;
+	unsigned int next;		// Sample number of the next sample to return
+	unsigned int lost;		// Samples overwritten before they were read
+};
+
+struct sensorRings
+{
+	struct sensorRing pulse;		// ain[PULSE_RIGHT_DORSAL] to ain[PULSE_LEFT_FEMORAL]
+	struct sensorRing breath;		// manual_breath_ain
+	struct sensorRing cpr;			// x, y, z
+};
+
+/*
+ * Daemon metrics
+ *
+ * Each daemon owns one slot and is its only writer: the loop timing from
+ * metricsLoopStart() and metricsLoopEnd(), the I/O count from metricsIo() and the
+ * last error from metricsError(), all in simUtil.c. The counters are plain stores,
+ * so a reader sees each one whole but may take two from different loops. The error
+ * text is written before errors is counted; a reader copies the slot again if errors
+ * changed under it (see metricsRead()).
+*/
+#define METRIC_PULSE		0
+#define METRIC_BREATH		1
+#define METRIC_CPR			2
+#define METRIC_RFID			3
+#define METRIC_SOUND		4
+#define METRIC_CONTROLLER	5
+#define METRIC_SLOTS		6
+#define METRIC_ERROR_LEN	48
+
+struct daemonMetrics
+{
+	int pid;						// 0 until the daemon calls metricsInit()
+	unsigned int started;			// sec, CLOCK_MONOTONIC
+	unsigned int updated;			// sec, CLOCK_MONOTONIC, last loop
+	unsigned int target;			// usec, intended loop period. 0 for a loop that waits on events
+	unsigned int loops;
+	unsigned int period;			// usec, loop start to start, running average
+	unsigned int maxPeriod;			// usec
+	unsigned int busy;				// usec, loop start to end, running average
+	unsigned int maxBusy;			// usec
+	unsigned int overruns;			// Loops that started more than half a target period late
+	unsigned int ioOps;				// AIN and GPIO reads, serial commands, HTTP requests
+	unsigned int ioRate;			// Per second, over the last full second
+	unsigned int errors;
+	int lastError;					// errno, or the daemon's own status code
+	unsigned int lastErrorAt;		// sec, CLOCK_MONOTONIC
+	char lastErrorText[METRIC_ERROR_LEN];
+	unsigned int majorFaults;		// Page faults that read from disk, since init
+	int rtMemory;					// 1 if the daemon's memory is locked (see rtMemoryInit())
+} SHM_ALIGNED;						// Slots do not share lines
+
+/*
+ * Shared memory header
+ *
+ * shmData starts with a header giving the offset and size of each region, so a
+ * daemon built against a different shmData can tell whether the data it uses is
+ * where it expects. initSHM() checks the regions the daemon uses (all, unless it
+ * calls initSHMRegions()) against its own layout, and fails with a message naming
+ * the first region that differs, rather than reading garbage. A daemon whose regions
+ * are unchanged can be restarted with a new build while the others keep running.
+ *
+ * simController creates the segment. When restarted, it keeps the existing segment
+ * and its data if the whole layout matches. Otherwise it replaces the segment; the
+ * daemons still attached to the old one must then be restarted.
+ *
+ * Regions may be added, at the end only. The offset of a region already released
+ * must not change, nor its size, nor may its id be reused.
+*/
+#define SHM_MAGIC			0x53696d43	// "SimC"
+#define SHM_VERSION			1			// Of the header itself
+
+#define SHM_REGION_CONFIG			0	// i2c_sema, simMgrIPAddr
+#define SHM_REGION_CARDIAC			1
+#define SHM_REGION_RESPIRATION		2
+#define SHM_REGION_AUSCULTATION		3
+#define SHM_REGION_PULSE			4
+#define SHM_REGION_CPR				5
+#define SHM_REGION_DEFIBRILLATION	6
+#define SHM_REGION_BREATH			7	// manual_breath_ain, manual_breath_baseline
+#define SHM_REGION_STATS			8	// http, sched, timeSync, sync
+#define SHM_REGION_CHANGE			9	// change, seqlock, seqlockReaders. Used by every daemon that writes a section
+#define SHM_REGION_SENSORS			10
+#define SHM_REGION_METRICS			11
+#define SHM_REGIONS					12
+#define SHM_REGIONS_MAX				32
+#define SHM_REGIONS_ALL				( ( 1 << SHM_REGIONS ) - 1 )
+
+struct shmRegion
+{
+	unsigned int offset;
+	unsigned int size;
+};
+
+struct shmHeader
+{
+	unsigned int magic;						// Set last, when the rest is valid
+	unsigned int version;					// SHM_VERSION
+	unsigned int size;						// sizeof(struct shmData) of the creator
+	unsigned int regionCount;
+	struct shmRegion regions[SHM_REGIONS_MAX];
+	unsigned int creates;					// Times simController has created or attached to this segment
+};
+
+/*
+ * Each writer's data starts a new cache line (SHM_ALIGNED), so the sensor daemons
+ * writing tens of times a second do not invalidate the cardiac and respiration lines
+ * soundSense reads on every pass. The exceptions are single ints written on an event:
+ * respiration.manual_breath (breathSense) and pulse.volume[] (soundSense, on a beat).
+ * The static_asserts below keep the layout from being undone by an edit.
+*/
 struct shmData 
 {
-	sem_t	i2c_sema;	// Mutex lock - Lock for I2C bus access
+	struct shmHeader header;	// Must stay first
+	
+	sem_t	i2c_sema SHM_ALIGNED;	// Mutex lock - Lock for I2C bus access
 	char simMgrIPAddr[32];
 	
-	// This data is from the sim-mgr, it controls our outputs
-	struct cardiac cardiac;
-	struct respiration respiration;
+	// This data is from the sim-mgr, it controls our outputs. Written by simController.
+	struct cardiac cardiac SHM_ALIGNED;
+	struct respiration respiration SHM_ALIGNED;
 	
 	// This data is internal to the sim-ctl and is sent to the sim-mgr
-	struct auscultation auscultation;
-	struct pulse pulse;
-	struct cpr cpr;
-	struct defibrillation defibrillation;
-	int manual_breath_ain;
+	struct auscultation auscultation SHM_ALIGNED;	// rfidScan
+	struct pulse pulse SHM_ALIGNED;					// pulse
+	struct cpr cpr SHM_ALIGNED;						// cprScan
+	struct defibrillation defibrillation SHM_ALIGNED;
+	int manual_breath_ain SHM_ALIGNED;				// breathSense
 	int manual_breath_baseline;
+	
+	// Statistics, written by simController
+	struct httpStats http SHM_ALIGNED;
+	struct schedStats sched;
+	struct timeSync timeSync;
+	struct syncTiming sync;
+	
+	// Written by every section writer, when it publishes
+	struct shmChange change SHM_ALIGNED;
+	struct shmSeqlock seqlock[SHM_SECTIONS];
+	struct shmSeqlockReaders seqlockReaders[SHM_SECTIONS];
+	struct sensorRings sensors;
+	
+	// Each slot written by its own daemon
+	struct daemonMetrics metrics[METRIC_SLOTS];
 };
 
+static_assert(offsetof(struct shmData, header ) == 0, "the header must be first" );
+static_assert(sizeof(struct shmSeqlock ) == SHM_LINE, "a section seqlock must fill one cache line" );
+static_assert(sizeof(struct shmSeqlockReaders ) == SHM_LINE, "a section's reader counts must fill one cache line" );
+static_assert(offsetof(struct shmData, cardiac ) % SHM_LINE == 0, "cardiac must start a cache line" );
+static_assert(offsetof(struct shmData, respiration ) % SHM_LINE == 0, "respiration must start a cache line" );
+static_assert(offsetof(struct shmData, auscultation ) % SHM_LINE == 0, "auscultation must start a cache line" );
+static_assert(offsetof(struct shmData, pulse ) % SHM_LINE == 0, "pulse must start a cache line" );
+static_assert(offsetof(struct shmData, cpr ) % SHM_LINE == 0, "cpr must start a cache line" );
+static_assert(offsetof(struct shmData, manual_breath_ain ) % SHM_LINE == 0, "manual_breath_ain must start a cache line" );
+static_assert(offsetof(struct shmData, http ) % SHM_LINE == 0, "http must start a cache line" );
+static_assert(offsetof(struct shmData, change ) % SHM_LINE == 0, "change must start a cache line" );
+static_assert(offsetof(struct shmChange, waiters ) == SHM_LINE, "waiters must not share the generation's line" );
+static_assert(offsetof(struct shmData, sync.waiters ) % SHM_LINE == 0 &&
+			  offsetof(struct shmData, sync.waiters ) - offsetof(struct shmData, sync.comm ) >= sizeof(struct syncCommStats ),
+			  "sync waiters must have a line of their own" );
+static_assert(offsetof(struct shmData, seqlock ) % SHM_LINE == 0, "seqlock must start a cache line" );
+static_assert(offsetof(struct shmData, sensors.breath ) % SHM_LINE == 0, "each sensor ring must start a cache line" );
+static_assert(offsetof(struct shmData, sensors.cpr ) % SHM_LINE == 0, "each sensor ring must start a cache line" );
+static_assert(offsetof(struct shmData, metrics[1] ) % SHM_LINE == 0, "each metrics slot must start a cache line" );
+
 int cardiac_parse(const char *elem,  const char *value, struct cardiac *card );
 int respiration_parse(const char *elem,  const char *value, struct respiration *resp );
+unsigned int parse_changes(int section );
 
 #endif /* SIMDATA_H_ */
\ No newline at end of file
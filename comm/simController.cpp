@@ -32,6 +32,7 @@
 #include <sys/ipc.h>
 #include <sys/msg.h>
 #include <time.h>
+#include <sys/time.h>
 #include <errno.h>
 #include <sys/mman.h>
 #include <semaphore.h>
@@ -40,6 +41,8 @@
 #include <signal.h>
 #include <string.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
 
 /*
 #include <libxml/xmlreader.h>
@@ -50,33 +53,86 @@
 */
 	
 #include "simCtlComm.h"
+#include "simHttp.h"
+#include "simJson.h"
 #include "simUtil.h"
 #include "shmData.h"
 
 simCtlComm comm(SYNC_PORT );
+simHttp http;
+simHttp httpSub;		// Second connection, held open for the status subscription
+simHttp httpTime;		// Connection for the clock sync thread
 
 using namespace std;
 
-#define SEC_NONE		0
-#define SEC_CARDIAC		1
-#define SEC_RESPIRATION	2
-#define SEC_GENERAL		3
-
 struct shmData *shmData;
 #define BUF_LEN_MAX	4096
 char msgbuf[BUF_LEN_MAX+4];
-char simctlrReadCmd[BUF_LEN_MAX+4];
 char simctlrWriteCmd[BUF_LEN_MAX+4];
 
-char name[128];
-char value[128];
+#define STATUS_BUF_MAX	16384
+char statusBuf[STATUS_BUF_MAX+4];
+
+/*
+ * Poll scheduler
+ *
+ * The main loop runs on a short tick. Status reads start at the minimum interval and
+ * slow down toward the maximum while nothing changes, dropping back to the minimum as
+ * soon as a read finds a change. Sensor changes are batched for up to SCHED_WRITE_MS,
+ * except for a manual breath or CPR compression, which is sent on the next tick. After
+ * a failed request both reads and writes wait out an exponential backoff.
+*/
+#define SCHED_TICK_MS			20		// Main loop period
+#define SCHED_READ_MIN_MS		100		// Default fastest status read interval (-r)
+#define SCHED_READ_MAX_MS		200		// Default slowest status read interval (-R), so the longest a change waits
+#define SCHED_WRITE_MS			100		// Longest a non-urgent sensor change waits
+#define SCHED_BACKOFF_MAX_MS	8000	// Longest wait after repeated failures
+#define SCHED_REPORT_MS			300000	// Log the HTTP and scheduler statistics every 5 minutes
+
+#define SUBSCRIBE_MAX_FAILURES	3		// Failed subscription attempts in a row before falling back to polling
+#define SUBSCRIBE_RETRY_DELAY	2		// Seconds between subscription attempts
+#define SUBSCRIBE_MIN_OPEN_SEC	10		// A stream that ends sooner is a one-shot reply, not a subscription
 
-void simMgrSyncTime(void);
-void simMgrRead(void );
-void simMgrWrite(void );
+#define SYNC_SAMPLES			12			// Most date exchanges in one clock sync round
+#define SYNC_INTERVAL			600			// Seconds between clock sync rounds
+#define SYNC_RETRY_DELAY		30			// Seconds before retrying a failed round
+#define SYNC_STEP_USEC			128000		// Offsets this large are stepped rather than slewed
+#define SYNC_COARSE_USEC		2000000		// Offsets this large are stepped as soon as they are seen
+#define SYNC_RESOLUTION_USEC	1000		// A round ends when the estimate is this close to the round trip
+#define SYNC_GUARD_USEC			20000		// Least time to wait before a timed exchange
+
+int timeSyncRound(int samples );
+void *time_sync_thread(void *ptr );
+int simMgrRead(void );
+int simMgrWrite(void );
 void initializeSensorData(void );
+void httpReport(void );
+void statusValue(const char *section, const char *key, const char *value, void *ctx );
+size_t statusWrite(const char *data, size_t len, void *ctx );
+int publishStatusChanges(void );
+void schedLoop(void );
+void *subscribe_thread(void *ptr );
+void *sync_thread(void *ptr );
 
 int debug = 0;
+int httpPort = 0;				// 0: the port announced by the sim-mgr, or 80
+int subscribe = 0;				// Subscription mode requested (-s)
+volatile int subscribed = 0;	// Subscription stream is active; polled reads are not needed
+pthread_t subscribeThreadInfo;
+pthread_t timeSyncThreadInfo;
+pthread_t syncThreadInfo;
+const char *recordPath = NULL;	// Sync recording file (-o)
+
+// Status values are parsed into these, and copied to shmData in one locked write
+// when the response has been parsed (see publishStatusChanges()). A polled read and
+// the subscription stream can overlap when the stream starts or drops, so both
+// parse and publish under statusMutex: there is one shmData writer at a time.
+struct cardiac cardiacStage;
+struct respiration respirationStage;
+pthread_mutex_t statusMutex = PTHREAD_MUTEX_INITIALIZER;
+int readMin = SCHED_READ_MIN_MS;
+int readMax = SCHED_READ_MAX_MS;
+struct schedStats sched;
 
 #ifdef DO_DEAMON_STARTS
 	// This section is as yet untested. I need to create a "clean up" function
@@ -110,7 +166,64 @@ startProcess(const char *cmd, const char *arg )
 int main(int argc, char *argv[])
 {
 	int sts;
-	int loop_count;
+	int c;
+	char hostName[SIM_IP_ADDR_SIZE+8];
+	
+	while (( c = getopt(argc, argv, "dsao:p:r:R:h" ) ) != -1 )
+	{
+		switch ( c )
+		{
+			case 'd':
+				debug++;
+				break;
+			case 'a':
+				comm.binaryWanted = 0;
+				break;
+			case 'o':
+				recordPath = optarg;
+				break;
+			case 's':
+				subscribe = 1;
+				break;
+			case 'p':
+				httpPort = atoi(optarg );
+				break;
+			case 'r':
+				readMin = atoi(optarg );
+				break;
+			case 'R':
+				readMax = atoi(optarg );
+				break;
+			case 'h':
+			default:
+				printf("Usage: %s [-d] [-s] [-a] [-o file] [-p port] [-r min_ms] [-R max_ms]\n", argv[0] );
+				printf("\t-d : Enable debug (do not run as daemon)\n" );
+				printf("\t-s : Subscribe to status updates from the sim-mgr instead of polling\n" );
+				printf("\t-a : ASCII sync messages only; do not offer binary frames\n" );
+				printf("\t-o : Record the sync messages to <file>, for playback with syncReplay\n" );
+				printf("\t-p : sim-mgr HTTP port (default: as announced by the sim-mgr, or 80)\n" );
+				printf("\t-r : Fastest status read interval, msec (default %d)\n", SCHED_READ_MIN_MS );
+				printf("\t-R : Slowest status read interval when idle, msec (default %d). Also the longest\n", SCHED_READ_MAX_MS );
+				printf("\t     a sim-mgr change can take to arrive when polling\n" );
+				exit ( 0 );
+				break;
+		}
+	}
+	if ( readMin < SCHED_TICK_MS )
+	{
+		readMin = SCHED_TICK_MS;
+	}
+	if ( readMax < readMin )
+	{
+		readMax = readMin;
+	}
+	
+	// Opened before daemonize(), so a relative path is from the current directory
+	if ( recordPath && comm.record(recordPath ) < 0 )
+	{
+		printf("Cannot record to %s\n", recordPath );
+		exit ( -1 );
+	}
 	
 	// Do GPIO Pin configurations
 	system("config-pin P9.24 uart" );	// UART1 - For rfidScan
@@ -143,6 +256,14 @@ int main(int argc, char *argv[])
 	shmData->cpr.release = 0;
 	shmData->cpr.duration = 0;
 	sem_init(&shmData->i2c_sema, 1, 1 ); // pshared =1, value =1
+	cardiacStage = shmData->cardiac;
+	respirationStage = shmData->respiration;
+	
+	// Readers that were running before a restart must re-read everything
+	shmChangePublish(SHM_SECTION_CARDIAC, CHG_ALL );
+	shmChangePublish(SHM_SECTION_RESPIRATION, CHG_ALL );
+	shmChangePublish(SHM_SECTION_CPR, CHG_ALL );
+	shmChangePublish(SHM_SECTION_BREATH, CHG_ALL );
 	
 	sts = getI2CLock();
 	if ( sts )
@@ -153,16 +274,48 @@ int main(int argc, char *argv[])
 	
 	initializeSensorData();
 	
-	// Find the sim-mgr
-	sts = comm.openListen(LISTEN_INACTIVE );
+	// Find the sim-mgr. The sync connection is kept open; this is the only one to the
+	// sim-mgr, and sync_thread passes its messages on to the other daemons.
+	sts = comm.openListen(LISTEN_ACTIVE );
 	if ( sts < 0 )
 	{
 		exit ( 0 );
 	}
 	memcpy(shmData->simMgrIPAddr, comm.simMgrIPAddr, SIM_IP_ADDR_SIZE );
-	sprintf(simctlrReadCmd, "simCurl  %s/cgi-bin/simstatus.cgi?simctrldata=1", comm.simMgrIPAddr );
+	
+	if ( httpPort == 0 )
+	{
+		httpPort = comm.simMgrHttpPort ? comm.simMgrHttpPort : 80;
+	}
+	if ( httpPort != 80 )
+	{
+		sprintf(hostName, "%s:%d", comm.simMgrIPAddr, httpPort );
+	}
+	else
+	{
+		sprintf(hostName, "%s", comm.simMgrIPAddr );
+	}
+	curl_global_init(CURL_GLOBAL_ALL );
+	sts = http.open(hostName );
+	if ( sts == 0 && subscribe )
+	{
+		sts = httpSub.open(hostName );
+	}
+	if ( sts == 0 )
+	{
+		sts = httpTime.open(hostName );
+	}
+	if ( sts )
+	{
+		log_message("", "HTTP client init failed - Exiting" );
+		exit ( -1 );
+	}
 
-	simMgrSyncTime();
+	// One exchange to get within a second before anything is timestamped, then
+	// refine and keep in step from the sync thread
+	timeSyncRound(1 );
+	pthread_create(&timeSyncThreadInfo, NULL, &time_sync_thread, (void *)NULL );
+	pthread_create(&syncThreadInfo, NULL, &sync_thread, (void *)NULL );
 	
 #ifdef DO_DEAMON_STARTS
 	// Start the other deamons
@@ -173,19 +326,207 @@ int main(int argc, char *argv[])
 	cprPid = startProcess("/usr/local/bin/cprScan" );
 #endif // DO_DEAMON_STARTS
 
-	loop_count = 0;
+	if ( subscribe )
+	{
+		pthread_create(&subscribeThreadInfo, NULL, &subscribe_thread, (void *)NULL );
+	}
+	
+	schedLoop();
+}
+
+/*
+ * Receive the sync messages. Each one is logged in shmData->sync by simCtlComm::wait(),
+ * which wakes the daemons blocked in syncEventWait().
+*/
+void *
+sync_thread(void *ptr )
+{
 	while ( 1 )
 	{
-		if ( ( loop_count & 1 ) == 0 )
+		comm.wait("" );
+	}
+	return ( NULL );
+}
+
+void
+httpReport(void )
+{
+	sprintf(msgbuf, "HTTP: %u requests, %u failed, %u connects, %u reused, latency avg %u max %u usec",
+		http.stats.requests, http.stats.failures, http.stats.connects, http.stats.reused,
+		http.stats.avgLatency, http.stats.maxLatency );
+	log_message("", msgbuf );
+	sprintf(msgbuf, "Sched: read every %u ms, %u reads (%u changed, %u skipped), %u writes (%u urgent, %u idle), %u backoffs",
+		sched.readInterval, sched.reads, sched.readsChanged, sched.readsSkipped,
+		sched.writes, sched.urgentWrites, sched.writesSkipped, sched.backoffs );
+	log_message("", msgbuf );
+}
+
+/*
+ * Scheduler
+*/
+static long long
+monoMsec(void )
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts );
+	return ( (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000 );
+}
+
+// A request failed: double the backoff, starting from the minimum read interval
+static long long
+schedFailure(long long now, int sts )
+{
+	int shift = ( sched.failures < 8 ) ? sched.failures : 8;
+	
+	metricsError(sts, "sim-mgr request failed" );
+	sched.failures++;
+	sched.backoffs++;
+	sched.backoff = readMin << shift;
+	if ( sched.backoff > SCHED_BACKOFF_MAX_MS )
+	{
+		sched.backoff = SCHED_BACKOFF_MAX_MS;
+	}
+	if ( sched.failures == 1 || debug )
+	{
+		sprintf(msgbuf, "sim-mgr request failed, retry in %u ms", sched.backoff );
+		log_message("", msgbuf );
+	}
+	return ( now + sched.backoff );
+}
+
+static void
+schedSuccess(void )
+{
+	if ( sched.failures > 1 )
+	{
+		sprintf(msgbuf, "sim-mgr reachable after %u failed requests", sched.failures );
+		log_message("", msgbuf );
+	}
+	sched.failures = 0;
+	sched.backoff = 0;
+}
+
+// Sections written by the sensor daemons and sent to the sim-mgr
+#define SENSOR_SECTIONS	( ( 1 << SHM_SECTION_AUSCULTATION ) | ( 1 << SHM_SECTION_PULSE ) | \
+						  ( 1 << SHM_SECTION_CPR ) | ( 1 << SHM_SECTION_BREATH ) )
+struct shmChangeReader sensorChanges;
+int writePending = 0;	// Sensor changes not yet delivered to the sim-mgr
+
+void
+schedLoop(void )
+{
+	long long now;
+	long long nextRead;
+	long long nextWrite;
+	long long nextReport;
+	unsigned int masks[SHM_SECTIONS];
+	unsigned int requests = 0;
+	int urgent;
+	int sts;
+	
+	now = monoMsec();
+	nextRead = now;
+	nextWrite = now;
+	nextReport = now + SCHED_REPORT_MS;
+	sched.readInterval = readMin;
+	metricsInit(METRIC_CONTROLLER, SCHED_TICK_MS * 1000 );
+	
+	while ( 1 )
+	{
+		metricsLoopStart();
+		now = monoMsec();
+		
+		if ( shmChangeCheck(&sensorChanges, masks ) & SENSOR_SECTIONS )
 		{
-			simMgrRead();
+			writePending = 1;
 		}
-		else
+		// Clearing manual_breath after a write also publishes CHG_BREATH_MANUAL; only a set flag is urgent
+		urgent = ( ( masks[SHM_SECTION_BREATH] & CHG_BREATH_MANUAL ) && shmData->respiration.manual_breath ) ||
+				 ( masks[SHM_SECTION_CPR] & CHG_CPR_COMPRESSION );
+		
+		if ( now >= nextWrite || ( urgent && sched.backoff == 0 ) )
+		{
+			if ( writePending )
+			{
+				sts = simMgrWrite();
+				if ( sts < 0 )
+				{
+					nextWrite = nextRead = schedFailure(now, sts );
+				}
+				else
+				{
+					if ( sts > 0 )
+					{
+						sched.writes++;
+						if ( urgent )
+						{
+							sched.urgentWrites++;
+						}
+					}
+					schedSuccess();
+					nextWrite = now + SCHED_WRITE_MS;
+				}
+			}
+			else
+			{
+				sched.writesSkipped++;
+				nextWrite = now + SCHED_WRITE_MS;
+			}
+		}
+		
+		if ( now >= nextRead )
+		{
+			if ( subscribed )
+			{
+				// Status arrives on the subscription stream
+				sched.readsSkipped++;
+				sched.readInterval = readMax;
+				nextRead = now + readMax;
+			}
+			else
+			{
+				sts = simMgrRead();
+				sched.reads++;
+				if ( sts < 0 )
+				{
+					nextWrite = nextRead = schedFailure(now, sts );
+				}
+				else
+				{
+					schedSuccess();
+					if ( sts > 0 )
+					{
+						sched.readsChanged++;
+						sched.readInterval = readMin;
+					}
+					else
+					{
+						sched.readInterval += sched.readInterval / 4 + 1;
+						if ( sched.readInterval > (unsigned int)readMax )
+						{
+							sched.readInterval = readMax;
+						}
+					}
+					nextRead = now + sched.readInterval;
+				}
+			}
+		}
+		else if ( sched.backoff && ! subscribed )
 		{
-			simMgrWrite();
+			sched.readsSkipped++;
 		}
-		loop_count++;
-		usleep(100000 );
+		
+		shmData->sched = sched;
+		if ( now >= nextReport )
+		{
+			httpReport();
+			nextReport = now + SCHED_REPORT_MS;
+		}
+		metricsIo(http.stats.requests - requests );
+		requests = http.stats.requests;
+		metricsLoopEnd();
+		usleep(SCHED_TICK_MS * 1000 );
 	}
 }
 /*
@@ -217,266 +558,539 @@ initializeSensorData(void )
 	def.energy = 0;
 	
 }
-char ampChar[] = "%26";
+/*
+ * Append one "set:" parameter to the batched write command. All fields changed
+ * since the last write are sent in a single request, in the order they are added.
+*/
+int
+addSetCmd(int len, const char *field, int val )
+{
+	return ( len + snprintf(&simctlrWriteCmd[len], BUF_LEN_MAX - len, "%sset:%s=%d",
+		( len > 0 ) ? "&" : "", field, val ) );
+}
 
-void
+/*
+ * Send the sensor fields that differ from what was last delivered.
+ * Returns 1 if a write was sent, 0 if there was nothing to send, -1 on failure.
+*/
+int
 simMgrWrite(void )
 {
-	FILE *pipe;
-	int do_send;
-	while ( 1 ) 
+	struct auscultation newAus = aus;
+	struct pulse newPul = pul;
+	struct cpr newCpr = cpr;
+	struct auscultation nowAus;
+	struct pulse nowPul;
+	struct cpr nowCpr;
+	int manual_breath;
+	int len = 0;
+	int sts;
+	
+	// Consistent copies, so side, row and col are all from the same tag
+	shmSnapshot(SHM_SECTION_AUSCULTATION, &nowAus );
+	shmSnapshot(SHM_SECTION_PULSE, &nowPul );
+	shmSnapshot(SHM_SECTION_CPR, &nowCpr );
+	if ( aus.side != nowAus.side )
 	{
-		do_send = 0;
-		if ( aus.side != shmData->auscultation.side )
-		{
-			aus.side = shmData->auscultation.side;
-			sprintf(simctlrWriteCmd, "simCurl  %s/cgi-bin/simstatus.cgi?set:auscultation:side=%d", 
-				comm.simMgrIPAddr,
-				aus.side );
-			do_send++;
-		}
-		else if ( aus.row != shmData->auscultation.row ) 
+		newAus.side = nowAus.side;
+		len = addSetCmd(len, "auscultation:side", newAus.side );
+	}
+	if ( aus.row != nowAus.row ) 
+	{
+		newAus.row = nowAus.row;
+		len = addSetCmd(len, "auscultation:row", newAus.row );
+	}
+	if ( aus.col != nowAus.col )
+	{
+		newAus.col = nowAus.col;
+		len = addSetCmd(len, "auscultation:col", newAus.col );
+	}
+	if ( pul.right_dorsal != nowPul.right_dorsal ) 
+	{
+		newPul.right_dorsal = nowPul.right_dorsal;
+		len = addSetCmd(len, "pulse:right_dorsal", newPul.right_dorsal );
+	}
+	if ( pul.left_dorsal != nowPul.left_dorsal ) 
+	{
+		newPul.left_dorsal = nowPul.left_dorsal;
+		len = addSetCmd(len, "pulse:left_dorsal", newPul.left_dorsal );
+	}
+	if ( pul.right_femoral != nowPul.right_femoral ) 
+	{
+		newPul.right_femoral = nowPul.right_femoral;
+		len = addSetCmd(len, "pulse:right_femoral", newPul.right_femoral );
+	}
+	if ( pul.left_femoral != nowPul.left_femoral ) 
+	{
+		newPul.left_femoral = nowPul.left_femoral;
+		len = addSetCmd(len, "pulse:left_femoral", newPul.left_femoral );
+	}
+	// Taken and cleared in one step, so a breath set by breathSense during the write
+	// below is sent with the next one rather than lost
+	manual_breath = __sync_fetch_and_and(&shmData->respiration.manual_breath, 0 );
+	if ( manual_breath )
+	{
+		len = addSetCmd(len, "respiration:manual_breath", 1 );
+	}
+	if ( cpr.compression != nowCpr.compression )
+	{
+		newCpr.compression = nowCpr.compression;
+		len = addSetCmd(len, "cpr:compression", newCpr.compression );
+	}
+	if ( cpr.release != nowCpr.release )
+	{
+		newCpr.release = nowCpr.release;
+		len = addSetCmd(len, "cpr:release", newCpr.release );
+	}
+#if 0
+	if ( ( def.last != shmData->defibrillation.last ) ||
+		 ( def.energy != shmData->defibrillation.energy ) )
+	{
+	}
+#endif
+	if ( len == 0 )
+	{
+		writePending = 0;
+		return ( 0 );
+	}
+	//log_message("", simctlrWriteCmd );
+	// Could parse the return, but not really needed.
+	sts = http.get(simctlrWriteCmd, statusBuf, STATUS_BUF_MAX );
+	shmData->http = http.stats;
+	if ( sts < 0 )
+	{
+		// Not delivered. Keep the old copies so the same changes are sent on the next write.
+		if ( manual_breath )
 		{
-			aus.row = shmData->auscultation.row;
-			sprintf(simctlrWriteCmd, "simCurl  %s/cgi-bin/simstatus.cgi?set:auscultation:row=%d", 
-				comm.simMgrIPAddr,
-				aus.row );
-			do_send++;
+			__sync_fetch_and_or(&shmData->respiration.manual_breath, manual_breath );
 		}
-		else if ( aus.col != shmData->auscultation.col )
+		writePending = 1;
+		return ( -1 );
+	}
+	writePending = 0;
+	aus = newAus;
+	pul = newPul;
+	cpr = newCpr;
+	if ( manual_breath )
+	{
+		shmChangePublish(SHM_SECTION_BREATH, CHG_BREATH_MANUAL );
+	}
+	return ( 1 );
+}
+
+/*
+ * Clock synchronization
+ *
+ * The sim-mgr reports its time with one second resolution ("MMDDhhmmYYYY.ss", as taken
+ * by the date command). Each exchange bounds the offset (sim-mgr clock minus local
+ * clock): the sim-mgr read its clock at some local time between sending the request
+ * (t0) and receiving the reply (t3), and its clock then read between S and S+1, so
+ * the offset is between S - t3 and S + 1 - t0. A round intersects these bounds over
+ * several exchanges, each timed so that the sim-mgr is predicted to read its clock on
+ * a second boundary. Each one halves the uncertainty, down to about the round trip.
+ *
+ * Offsets of SYNC_STEP_USEC or more are stepped with clock_settime(), smaller ones are
+ * slewed with adjtime(). Offsets within the uncertainty of the estimate are left alone.
+*/
+struct dateValue
+{
+	time_t date;
+	int found;
+};
+
+void
+dateField(const char *section, const char *key, const char *value, void *ctx )
+{
+	struct dateValue *dv = (struct dateValue *)ctx;
+	struct tm tm;
+	
+	if ( strcmp(key, "date" ) != 0 )
+	{
+		return;
+	}
+	memset(&tm, 0, sizeof(tm) );
+	if ( sscanf(value, "%2d%2d%2d%2d%4d.%2d", &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min,
+				&tm.tm_year, &tm.tm_sec ) != 6 )
+	{
+		return;
+	}
+	tm.tm_mon -= 1;
+	tm.tm_year -= 1900;
+	tm.tm_isdst = -1;
+	dv->date = mktime(&tm );
+	dv->found = ( dv->date != (time_t)-1 );
+}
+
+static long long
+realUsec(void )
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_REALTIME, &ts );
+	return ( (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 );
+}
+
+// One date exchange. Returns 0 with the sim-mgr second and the local send and receive times.
+static int
+timeSample(long long *server, long long *t0, long long *t3 )
+{
+	struct simJson js;
+	struct dateValue dv;
+	int sts;
+	
+	dv.found = 0;
+	simJsonInit(&js, dateField, &dv );
+	*t0 = realUsec();
+	sts = httpTime.get("date=1", statusWrite, &js );
+	*t3 = realUsec();
+	metricsIo(1 );
+	if ( sts < 0 || ! dv.found )
+	{
+		return ( -1 );
+	}
+	*server = (long long)dv.date * 1000000;
+	return ( 0 );
+}
+
+static int
+clockStep(long long delta )
+{
+	struct timespec ts;
+	long long t;
+	
+	t = realUsec() + delta;
+	ts.tv_sec = t / 1000000;
+	ts.tv_nsec = ( t % 1000000 ) * 1000;
+	return ( clock_settime(CLOCK_REALTIME, &ts ) );
+}
+
+/*
+ * Function: timeSyncRound
+ *
+ * Estimate the offset to the sim-mgr clock and correct the local clock.
+ *
+ * Parameters: samples - most date exchanges to use
+ *
+ * Returns: 0 on success, -1 if the sim-mgr could not be read or gave inconsistent times
+*/
+int
+timeSyncRound(int samples )
+{
+	char buf[256];
+	long long server;
+	long long t0;
+	long long t3;
+	long long lo = 0;
+	long long hi = 0;
+	long long mid;
+	long long rtt;
+	long long minRtt = 0;
+	long long next;
+	long long wait;
+	long long offset;
+	long long error;
+	int i;
+	
+	for ( i = 0 ; i < samples ; i++ )
+	{
+		if ( i > 0 )
 		{
-			aus.col = shmData->auscultation.col;
-			sprintf(simctlrWriteCmd, "simCurl  %s/cgi-bin/simstatus.cgi?set:auscultation:col=%d", 
-				comm.simMgrIPAddr,
-				aus.col );
-			do_send++;
+			// Send so the sim-mgr reads its clock where the estimate puts a second boundary
+			mid = ( lo + hi ) / 2;
+			next = ( ( realUsec() + mid + minRtt / 2 + SYNC_GUARD_USEC ) / 1000000 + 1 ) * 1000000;
+			wait = next - mid - minRtt / 2 - realUsec();
+			if ( wait > 0 )
+			{
+				usleep(wait );
+			}
 		}
-		else if ( pul.right_dorsal != shmData->pulse.right_dorsal ) 
+		if ( timeSample(&server, &t0, &t3 ) < 0 )
 		{
-			pul.right_dorsal = shmData->pulse.right_dorsal;
-			sprintf(simctlrWriteCmd, "simCurl  %s/cgi-bin/simstatus.cgi?set:pulse:right_dorsal=%d",
-				comm.simMgrIPAddr,
-				pul.right_dorsal );
-			do_send++;
+			shmData->timeSync.failures++;
+			return ( -1 );
 		}
-		else if ( pul.left_dorsal != shmData->pulse.left_dorsal ) 
+		rtt = t3 - t0;
+		if ( i == 0 || rtt < minRtt )
 		{
-			pul.left_dorsal = shmData->pulse.left_dorsal;
-			sprintf(simctlrWriteCmd, "simCurl  %s/cgi-bin/simstatus.cgi?set:pulse:left_dorsal=%d",
-				comm.simMgrIPAddr,
-				pul.left_dorsal );
-			do_send++;
+			minRtt = rtt;
 		}
-		else if ( pul.right_femoral != shmData->pulse.right_femoral ) 
+		if ( i == 0 || server - t3 > lo )
 		{
-			pul.right_femoral = shmData->pulse.right_femoral;
-			sprintf(simctlrWriteCmd, "simCurl  %s/cgi-bin/simstatus.cgi?set:pulse:right_femoral=%d",
-				comm.simMgrIPAddr,
-				pul.right_femoral );
-			do_send++;
+			lo = server - t3;
 		}
-		else if ( pul.left_femoral != shmData->pulse.left_femoral ) 
+		if ( i == 0 || server + 1000000 - t0 < hi )
 		{
-			pul.left_femoral = shmData->pulse.left_femoral;
-			sprintf(simctlrWriteCmd, "simCurl  %s/cgi-bin/simstatus.cgi?set:pulse:left_femoral=%d",
-				comm.simMgrIPAddr,
-				pul.left_femoral );
-			do_send++;
+			hi = server + 1000000 - t0;
 		}
-
-		else if ( shmData->respiration.manual_breath )
+		if ( lo > hi )
 		{
-			sprintf(simctlrWriteCmd, "simCurl  %s/cgi-bin/simstatus.cgi?set:respiration:manual_breath=1",
-				comm.simMgrIPAddr );
-			shmData->respiration.manual_breath = 0;
-			do_send++;
+			// The sim-mgr clock moved under us
+			shmData->timeSync.failures++;
+			return ( -1 );
 		}
-		else if ( cpr.compression != shmData->cpr.compression )
+		mid = ( lo + hi ) / 2;
+		if ( i == 0 && samples > 1 && ( mid > SYNC_COARSE_USEC || mid < -SYNC_COARSE_USEC ) )
 		{
-			sprintf(simctlrWriteCmd, "simCurl  %s/cgi-bin/simstatus.cgi?set:cpr:compression=%d",
-				comm.simMgrIPAddr, shmData->cpr.compression );
-			cpr.compression = shmData->cpr.compression;
-			do_send++;
+			// Far off (e.g. no RTC at boot). Step now so the rest of the round is not
+			// spent at a wildly wrong time, then refine.
+			if ( clockStep(mid ) == 0 )
+			{
+				shmData->timeSync.steps++;
+				lo -= mid;
+				hi -= mid;
+			}
 		}
-		else if ( cpr.release != shmData->cpr.release )
+		if ( hi - lo <= minRtt + SYNC_RESOLUTION_USEC )
 		{
-			sprintf(simctlrWriteCmd, "simCurl  %s/cgi-bin/simstatus.cgi?set:cpr:release=%d",
-				comm.simMgrIPAddr, shmData->cpr.release );
-			cpr.release = shmData->cpr.release;
-			do_send++;
+			break;
 		}
-#if 0
-		else if ( ( def.last != shmData->defibrillation.last ) ||
-			 ( def.energy != shmData->defibrillation.energy ) )
+	}
+	offset = ( lo + hi ) / 2;
+	error = ( hi - lo ) / 2;
+	
+	shmData->timeSync.offset = offset;
+	shmData->timeSync.error = error;
+	shmData->timeSync.rtt = minRtt;
+	
+	if ( offset > error || offset < -error )
+	{
+		if ( offset >= SYNC_STEP_USEC || offset <= -SYNC_STEP_USEC )
 		{
-			do_send++;
+			if ( clockStep(offset ) == 0 )
+			{
+				shmData->timeSync.steps++;
+				sprintf(buf, "Clock stepped %lld ms (+/- %lld ms)", offset / 1000, error / 1000 );
+			}
+			else
+			{
+				sprintf(buf, "Clock step of %lld ms fails: %s", offset / 1000, strerror(errno ) );
+			}
+			log_message("", buf );
 		}
-#endif
-		if ( do_send )
+		else
 		{
-			//log_message("", simctlrWriteCmd );
-			pipe = popen(simctlrWriteCmd, "r" );
-			if ( !pipe )
+			struct timeval tv;
+			
+			tv.tv_sec = offset / 1000000;
+			tv.tv_usec = offset % 1000000;
+			if ( adjtime(&tv, NULL ) == 0 )
 			{
-				perror("popen" );
-				exit ( 1 );
+				shmData->timeSync.slews++;
 			}
 			else
 			{
-				while (fgets(msgbuf, BUF_LEN_MAX, pipe) != NULL)
-				{
-					// Could parse the return, but not really needed.
-					//log_message("", msgbuf );
-				}
-				pclose(pipe );
+				sprintf(buf, "Clock slew of %lld usec fails: %s", offset, strerror(errno ) );
+				log_message("", buf );
 			}
 		}
+	}
+	shmData->timeSync.syncs++;
+	shmData->timeSync.lastSync = time(NULL );
+	if ( debug )
+	{
+		sprintf(buf, "Clock sync: offset %lld usec +/- %lld, rtt %lld usec, %d samples",
+			offset, error, minRtt, ( i < samples ) ? i + 1 : samples );
+		log_message("", buf );
+	}
+	return ( 0 );
+}
+
+void *
+time_sync_thread(void *ptr )
+{
+	while ( 1 )
+	{
+		if ( timeSyncRound(SYNC_SAMPLES ) == 0 )
+		{
+			sleep(SYNC_INTERVAL );
+		}
 		else
 		{
-			break;
+			sleep(SYNC_RETRY_DELAY );
 		}
 	}
+	return ( NULL );
 }
 
-void
-simMgrSyncTime(void)
+/*
+ * Copy the status just parsed to shmData, and publish the fields changed so the other
+ * daemons need only look at what changed. Returns non-zero if anything changed.
+ * Called with statusMutex held.
+*/
+int
+publishStatusChanges(void )
 {
-	FILE *pipe1;
-	FILE *pipe2;
-	char buff[128];
-	char dbuff[64];
-	int i;
-	int sts;
+	unsigned int cardiac = parse_changes(SHM_SECTION_CARDIAC );
+	unsigned int respiration = parse_changes(SHM_SECTION_RESPIRATION );
 	
-	sprintf(buff, "simCurl  %s/cgi-bin/simstatus.cgi?date=1", comm.simMgrIPAddr );
-	pipe1 = popen(buff, "r" );
-	if ( !pipe1 )
+	if ( cardiac )
 	{
-		sprintf(buff, "Get Date fails: %s", strerror(errno ) );
-		syslog (LOG_DAEMON | LOG_NOTICE, buff );
+		shmWriteBegin(SHM_SECTION_CARDIAC );
+		shmData->cardiac = cardiacStage;
+		shmWriteEnd(SHM_SECTION_CARDIAC );
 	}
-	else
+	if ( respiration )
+	{
+		// Up to manual_breath, which is SHM_SECTION_BREATH
+		shmWriteBegin(SHM_SECTION_RESPIRATION );
+		memcpy(&shmData->respiration, &respirationStage, offsetof(struct respiration, manual_breath ) );
+		shmWriteEnd(SHM_SECTION_RESPIRATION );
+	}
+	shmChangePublish(SHM_SECTION_CARDIAC, cardiac );
+	shmChangePublish(SHM_SECTION_RESPIRATION, respiration );
+	return ( ( cardiac | respiration ) != 0 );
+}
+
+/*
+ * Called by the JSON parser for each value in a status response
+*/
+void
+statusValue(const char *section, const char *key, const char *value, void *ctx )
+{
+	if ( strcmp(section, "cardiac" ) == 0 )
 	{
-// Super-simple parse routine
-		while (fgets(dbuff, 64, pipe1) != NULL)
+		if ( debug > 1 )
 		{
-			for ( i = 0 ; dbuff[i] != 0 ; i++ )
-			{
-				switch ( dbuff[i] )
-				{
-					case ':':
-					case '"':
-					case '}':
-					case '{':
-					case ',':
-						dbuff[i] = ' ';
-						break;
-				}
-			}
-			// Check for a data line
-			sts = sscanf(dbuff, "%s %s", name, value );
-			
-			if ( sts == 2 )
-			{
-				sprintf(buff, "date %s", value );
-				pipe2 = popen(buff, "r" );
-				if ( !pipe2 )
-				{
-					sprintf(buff, "set Date fails: %s", strerror(errno ) );
-					syslog (LOG_DAEMON | LOG_NOTICE, buff );
-				}
-				else
-				{
-					pclose(pipe2 );
-					syslog (LOG_DAEMON | LOG_NOTICE, buff );
-				}
-			}
+			printf("cardiac: '%s', Value '%s'\n", key, value );
+		}
+		cardiac_parse(key, value, &cardiacStage );
+	}
+	else if ( strcmp(section, "respiration" ) == 0 )
+	{
+		if ( debug > 1 )
+		{
+			printf("respiration: '%s', Value '%s'\n", key, value );
 		}
-		pclose(pipe1 );
+		respiration_parse(key, value, &respirationStage );
+	}
+	else if ( debug > 1 )
+	{
+		printf("%s: '%s', Value '%s'\n", section[0] ? section : "none", key, value );
 	}
 }
-void
+
+size_t
+statusWrite(const char *data, size_t len, void *ctx )
+{
+	struct simJson *js = (struct simJson *)ctx;
+	
+	if ( simJsonFeed(js, data, len ) < 0 )
+	{
+		// Malformed response. Abort the transfer.
+		return ( 0 );
+	}
+	return ( len );
+}
+
+/*
+ * Read the full status. Returns 1 if a value changed, 0 if not, -1 on failure.
+*/
+int
 simMgrRead(void )
 {
-	FILE *pipe;
-	int section;
-	int i;
+	struct simJson js;
 	int sts;
+	int changed = 0;
 	
-	pipe = popen(simctlrReadCmd, "r" );
-	if ( !pipe )
+	// Values are parsed into the staging copies as they arrive. If the transfer fails
+	// part way, the error is logged by simHttp and nothing is published: the values
+	// parsed so far, and their change bits, wait in the staging copies for the next
+	// complete read, so the daemons never see a status mixed from two reads.
+	simJsonInit(&js, statusValue, NULL );
+	pthread_mutex_lock(&statusMutex );
+	sts = http.get("simctrldata=1", statusWrite, &js );
+	shmData->http = http.stats;
+	if ( sts == 0 )
 	{
-		perror("popen" );
-		exit ( 1 );
+		changed = publishStatusChanges();
 	}
-	else
+	pthread_mutex_unlock(&statusMutex );
+	if ( sts < 0 )
+	{
+		return ( -1 );
+	}
+	return ( changed );
+}
+
+/*
+ * Status subscription
+ *
+ * The sim-mgr holds the simctrlsubscribe request open and writes a complete status
+ * document (same format as simctrldata) each time a value changes, plus whitespace
+ * every few seconds when idle. The body is fed to the same parser as the polled read
+ * as it arrives.
+ *
+ * A sim-mgr without subscriptions may answer with an error page, or with one status
+ * and close. Neither counts: an attempt fails unless it delivered a status document
+ * and stayed open SUBSCRIBE_MIN_OPEN_SEC. After SUBSCRIBE_MAX_FAILURES failures in a
+ * row, simController stays on polling.
+*/
+struct subscribeStream
+{
+	struct simJson js;
+	int error;					// The response is an HTTP error; its body is ignored
+};
+
+size_t
+subscribeWrite(const char *data, size_t len, void *ctx )
+{
+	struct subscribeStream *ss = (struct subscribeStream *)ctx;
+	unsigned int documents = ss->js.documents;
+	size_t sts;
+	
+	if ( ss->error || httpSub.responseCode() >= 400 )
+	{
+		ss->error = 1;
+		return ( len );
+	}
+	pthread_mutex_lock(&statusMutex );
+	sts = statusWrite(data, len, &ss->js );
+	if ( ss->js.documents != documents )
+	{
+		publishStatusChanges();
+		// Polls can stop once the stream has delivered a status
+		subscribed = 1;
+	}
+	pthread_mutex_unlock(&statusMutex );
+	return ( sts );
+}
+
+void *
+subscribe_thread(void *ptr )
+{
+	struct subscribeStream ss;
+	struct timespec ts;
+	long long opened;
+	int failures = 0;
+	int sts;
+	
+	while ( 1 )
 	{
-		// Super-simple parse routine
-		section = SEC_NONE;
-		while (fgets(msgbuf, BUF_LEN_MAX, pipe) != NULL)
+		simJsonInit(&ss.js, statusValue, NULL );
+		ss.error = 0;
+		
+		clock_gettime(CLOCK_MONOTONIC, &ts );
+		opened = ts.tv_sec;
+		sts = httpSub.stream("simctrlsubscribe=1", subscribeWrite, &ss );
+		clock_gettime(CLOCK_MONOTONIC, &ts );
+		
+		// Stream ended. Resume polling until it is re-established.
+		subscribed = 0;
+		if ( ss.error || ( sts == -2 && httpSub.responseCode() >= 400 ) || ss.js.documents == 0 ||
+			 ts.tv_sec - opened < SUBSCRIBE_MIN_OPEN_SEC )
 		{
-			for ( i = 0 ; msgbuf[i] != 0 ; i++ )
-			{
-				switch ( msgbuf[i] )
-				{
-					case ':':
-					case '"':
-					case '}':
-					case '{':
-					case ',':
-						msgbuf[i] = ' ';
-						break;
-				}
-			}
-			// Check for a data line
-			sts = sscanf(msgbuf, "%s %s", name, value );
-			if ( sts == 1 )
-			{
-				// printf("Section: '%s'\n", name );
-				if ( strcmp(name, "cardiac" ) == 0 )
-				{
-					section = SEC_CARDIAC;
-				}
-				else if ( strcmp(name, "respiration" ) == 0 )
-				{
-					section = SEC_RESPIRATION;
-				}
-				else
-				{
-					section = SEC_NONE;
-				}
-				
-			}
-			else if ( sts == 2 )
+			failures++;
+			if ( failures >= SUBSCRIBE_MAX_FAILURES )
 			{
-				switch ( section )
-				{
-					case SEC_NONE:
-						if ( debug > 1)
-						{
-							printf("none: '%s', Value '%s'\n", name, value );
-						}
-						break;
-					case SEC_CARDIAC:
-						if ( debug > 1)
-						{
-							printf("cardiac: '%s', Value '%s'\n", name, value );
-						}
-						cardiac_parse(name,  value, &shmData->cardiac );
-						break;
-					case SEC_RESPIRATION:
-						if ( debug > 1 )
-						{
-							printf("respiration: '%s', Value '%s'\n", name, value );
-						}
-						respiration_parse(name,  value, &shmData->respiration );
-						break;
-				}
+				log_message("", "Status subscription not available - Polling" );
+				return ( NULL );
 			}
-
 		}
-		pclose(pipe );
+		else
+		{
+			failures = 0;
+			log_message("", "Status subscription closed - Reconnecting" );
+		}
+		sleep(SUBSCRIBE_RETRY_DELAY );
 	}
 }
-
-	
\ No newline at end of file
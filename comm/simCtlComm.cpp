@@ -22,7 +22,12 @@
  * This class will find the simmgr and establish a communications link.
  * 
  * The specific host name may be provided by creating a file, /simulator/simmgr that contains the host name or IP address.
- * If the file does not exist or is empty, the local subnet will be scanned to find a simmgr.
+ * If the file does not exist or is empty, the address the simmgr was last found at (/simulator/simmgrLast) is tried,
+ * then a discovery query is broadcast on each interface (see discover()). If nothing answers, the local subnet will
+ * be scanned to find a simmgr.
+ *
+ * The sync connection uses TCP keepalives, so a sim-mgr that has gone away is noticed within a few seconds.
+ * When the connection is lost, wait() reopens it before it returns (see reopen()).
 */
 #include <stdlib.h>
 #include <unistd.h>
@@ -36,11 +41,14 @@
 #include <sys/ipc.h>
 #include <sys/msg.h>
 #include <errno.h>
+#include <poll.h>
+#include <time.h>
 
 #include <iostream>
 #include <string>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <ctype.h>
 #include <arpa/inet.h>
@@ -53,8 +61,16 @@
 
 #define BUF_MAX	4096
 
+#define SCAN_WINDOW			64		// Connects in flight at once during a subnet scan
+#define SCAN_TIMEOUT_MS		250		// Time allowed for each connect
+#define SCAN_POLL_MS		10		// Longest wait in poll(), so timed out connects are retired promptly
+
+#define DISCOVER_TRIES		3		// Discovery queries sent before falling back to the scan
+#define DISCOVER_WAIT_MS	100		// Time to collect replies to each query
+
 using namespace std;
 extern int debug;
+extern struct shmData *shmData;
 
 extern char msgbuf[];
 
@@ -72,6 +88,26 @@ simCtlComm::simCtlComm(int port )
 	commPort = port;
 	simMgrName[0] = 0;
 	simMgrIPAddr[0] = 0;
+	simMgrHttpPort = 0;
+	ringHead = 0;
+	ringTail = 0;
+	readMessages = 0;
+	delimited = 0;
+	readTime = 0;
+	readReal = 0;
+	binary = 0;
+	haveSeq = 0;
+	lastSeq = 0;
+	skipping = 0;
+	binaryWanted = 1;
+	recordFile = NULL;
+	recordLast = 0;
+	recordSeq = 0;
+	recordFlags = 0;
+	memset(&stats, 0, sizeof(stats) );
+	memset(&localIP, 0, sizeof(localIP) );
+	pthread_mutex_init(&linkMutex, NULL );
+	downSince = 0;
 	
 	fd = fopen("/simulator/simmgrName", "r" );
 	if ( fd != NULL )
@@ -86,6 +122,72 @@ simCtlComm::simCtlComm(int port )
 	}
 }
 
+static long long
+msecNow(void )
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts );
+	return ( (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000 );
+}
+
+static long long
+usecNow(void )
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts );
+	return ( (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 );
+}
+
+static long long
+realNow(void )
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_REALTIME, &ts );
+	return ( (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 );
+}
+
+static int
+readLastAddr(char *addr )
+{
+	FILE *fd;
+	char *ptr = NULL;
+	
+	fd = fopen(SIMMGR_LAST_FILE, "r" );
+	if ( fd != NULL )
+	{
+		ptr = fgets(addr, SIM_IP_ADDR_SIZE, fd );
+		fclose(fd );
+	}
+	if ( ptr == NULL )
+	{
+		return ( 0 );
+	}
+	addr[strcspn(addr, "\n\r")] = 0;
+	return ( strlen(addr ) > 0 );
+}
+
+static void
+saveLastAddr(const char *addr )
+{
+	FILE *fd;
+	
+	fd = fopen(SIMMGR_LAST_FILE, "w" );
+	if ( fd == NULL )
+	{
+		if ( debug )
+		{
+			sprintf(msgbuf, "Cannot save simMgr address to %s: %s", SIMMGR_LAST_FILE, strerror(errno ) );
+			log_message("", msgbuf);
+		}
+		return;
+	}
+	fprintf(fd, "%s\n", addr );
+	fclose(fd );
+}
+
 /* openSimMgr:
  *
  * Scans the local subnet to find the simMgr
@@ -94,17 +196,20 @@ simCtlComm::simCtlComm(int port )
 int
 simCtlComm::openListen(int active )
 {
-    int fd;
+    int fd = -1;
 	int sts;
 
 	char hostAddr[32];
+	char lastAddr[SIM_IP_ADDR_SIZE];
 	struct IPv4 myIP;
-	int i;
+	long long start;
+	const char *how;
 	struct ifaddrs *myaddrs, *ifa;
     void *in_addr;
 	struct sockaddr_in *s4;
 
 	commFD = -1;
+	start = msecNow();
 	
 	// Find our local IPV4 subnet address
 	sts = -1;
@@ -123,10 +228,12 @@ simCtlComm::openListen(int active )
 		{
 			for ( ifa = myaddrs ; ifa != NULL ; ifa = ifa->ifa_next )
 			{
+				// Take the first IPv4 interface that is up, but prefer eth0
 				if ( ( ifa->ifa_addr != NULL ) &&
 					 ( ifa->ifa_flags & IFF_UP ) &&
+					 ! ( ifa->ifa_flags & IFF_LOOPBACK ) &&
 					 ( ifa->ifa_addr->sa_family ==  AF_INET ) && 
-					 ( strncmp(ifa->ifa_name, "eth0", 4 ) == 0 ) )
+					 ( sts != 0 || strncmp(ifa->ifa_name, "eth0", 4 ) == 0 ) )
 				{
 					s4 = (struct sockaddr_in *)ifa->ifa_addr;
 					in_addr = &s4->sin_addr;
@@ -146,7 +253,10 @@ simCtlComm::openListen(int active )
 						myIP.b4 = (s4->sin_addr.s_addr & 0xff000000) >> 24;
 						
 						sts = 0;
-						break;
+						if ( strncmp(ifa->ifa_name, "eth0", 4 ) == 0 )
+						{
+							break;
+						}
 					}
 				}
 			}
@@ -163,41 +273,37 @@ simCtlComm::openListen(int active )
 			}
 		}
 	}
+	localIP = myIP;
 	if ( strlen(simMgrName) == 0 )
 	{
-		sts = -1;
-		while ( sts )
+		// The sim-mgr usually keeps its address, so try the last one first
+		how = "last known address";
+		if ( readLastAddr(lastAddr ) )
 		{
-			// Scan the local subnet looking for the server
-			for ( i = 1 ; i < 255 ; i++ )
+			fd = this->trySimMgrOpen(lastAddr );
+		}
+		while ( fd <= 0 )
+		{
+			how = "discovery query";
+			fd = this->discover();
+			if ( fd <= 0 )
 			{
-				if ( i == myIP.b4 ) // Don't scan our own address
-				{
-					continue;
-				}
-				sprintf(hostAddr, "%d.%d.%d.%d", myIP.b1, myIP.b2, myIP.b3, i );
-				if ( debug )
-				{
-					printf("Trying %s\n", hostAddr );
-				}
-				fd = this->trySimMgrOpen(hostAddr );
-				if ( fd <= 0 )
-				{
-				}
-				else
-				{
-					commFD = fd;
-					sts = 0;
-					break;
-				}
-
+				how = "subnet scan";
+				fd = this->scanSubnet(&myIP );
 			}
-			if ( sts )
+			if ( fd <= 0 )
 			{
 				// Not found - Wait and then try again
 				sleep(2 );
 			}
+			else
+			{
+				saveLastAddr(simMgrIPAddr );
+			}
 		}
+		commFD = fd;
+		sprintf(msgbuf, "simMgr %s found by %s in %lld ms", simMgrIPAddr, how, msecNow() - start );
+		log_message("", msgbuf);
 	}
 	else
 	{
@@ -231,71 +337,948 @@ simCtlComm::openListen(int active )
 			close(commFD );
 			commFD = 0;
 		}
+		else
+		{
+			this->keepalive(commFD );
+			pthread_mutex_lock(&linkMutex );
+			this->hello(commFD );
+			stats.up = 1;
+			this->publishStats();
+			pthread_mutex_unlock(&linkMutex );
+		}
 	}
 	return ( 0 );
 }
 
-#define SM_BUF_MAX	32
+/*
+ * Turn on TCP keepalives for the sync connection. The sim-mgr only sends, so without them
+ * a sim-mgr that has lost power or network is never noticed. TCP_USER_TIMEOUT also bounds
+ * how long the probes may go unanswered.
+*/
+void
+simCtlComm::keepalive(int fd )
+{
+	int on = 1;
+	int idle = SYNC_KEEPIDLE;
+	int intvl = SYNC_KEEPINTVL;
+	int cnt = SYNC_KEEPCNT;
+	unsigned int timeout = SYNC_USER_TIMEOUT;
+	
+	if ( setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on) ) < 0 ||
+		 setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle) ) < 0 ||
+		 setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &intvl, sizeof(intvl) ) < 0 ||
+		 setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &cnt, sizeof(cnt) ) < 0 )
+	{
+		sprintf(msgbuf, "comm.keepalive: %s", strerror(errno ) );
+		log_message("", msgbuf);
+	}
+#ifdef TCP_USER_TIMEOUT
+	if ( setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &timeout, sizeof(timeout) ) < 0 && debug )
+	{
+		sprintf(msgbuf, "comm.keepalive TCP_USER_TIMEOUT: %s", strerror(errno ) );
+		log_message("", msgbuf);
+	}
+#endif
+}
 
+/*
+ * Offer binary frames on a new connection. The connection stays in ASCII until the
+ * sim-mgr answers (see nextMessage()). Called with linkMutex held.
+*/
+void
+simCtlComm::hello(int fd )
+{
+	const char *msg = SYNC_HELLO "\n";
+	
+	binary = 0;
+	haveSeq = 0;
+	skipping = 0;
+	stats.binary = 0;
+	if ( binaryWanted && write(fd, msg, strlen(msg ) ) < 0 && debug )
+	{
+		sprintf(msgbuf, "comm.hello: %s", strerror(errno ) );
+		log_message("", msgbuf);
+	}
+}
+
+/*
+ * Scan the local /24 for a host accepting connections on the sync port.
+ *
+ * Non-blocking connects are started to up to SCAN_WINDOW hosts at once and collected
+ * with poll(). The first to complete is kept and the rest are closed. Returns the open
+ * (non-blocking) socket, with simMgrIPAddr set, or -1 if no host answered.
+*/
 int
-simCtlComm::wait(const char *syncMessage )
+simCtlComm::scanSubnet(struct IPv4 *myIP )
 {
-	int len;
-	char buffer[SM_BUF_MAX];
-	int msgLen = strlen(syncMessage );
+	struct pollfd pfd[SCAN_WINDOW];
+	int host[SCAN_WINDOW];
+	long long started[SCAN_WINDOW];
+	struct sockaddr_in addr;
+	char hostAddr[32];
+	socklen_t lon;
+	int valopt;
+	int active = 0;
+	int next = 1;
+	int found = -1;
+	int foundHost = 0;
+	int done;
+	int fd;
+	int i;
+	long long now;
 	
-	while ( 1 )
+	while ( found < 0 && ( next < 255 || active > 0 ) )
 	{
-		memset(buffer, 0, SM_BUF_MAX );
-		len = read(commFD, buffer, SM_BUF_MAX-1 );
-		if ( len > 0 )
+		// Keep the window full
+		while ( found < 0 && active < SCAN_WINDOW && next < 255 )
 		{
-			if ( debug > 1 )
+			if ( next == myIP->b4 ) // Don't scan our own address
 			{
-				printf("%s", buffer );
+				next++;
+				continue;
 			}
-			if ( msgLen == 0 )
+			sprintf(hostAddr, "%d.%d.%d.%d", myIP->b1, myIP->b2, myIP->b3, next );
+			fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0 );
+			if ( fd < 0 )
 			{
-				if ( strncmp(buffer, "pulse", 5 ) == 0 )
+				if ( debug )
 				{
-					if ( strncmp(buffer, "pulseVPC", 8 ) == 0 )
+					sprintf(msgbuf, "comm.scanSubnet socket: %s", strerror(errno ) );
+					log_message("", msgbuf);
+				}
+				break;	// Out of descriptors; wait for some in flight to finish
+			}
+			memset(&addr, 0, sizeof(addr) );
+			addr.sin_family = AF_INET;
+			addr.sin_port = htons(SYNC_PORT );
+			addr.sin_addr.s_addr = inet_addr(hostAddr );
+			if ( connect(fd, (struct sockaddr *)&addr, sizeof(addr) ) == 0 )
+			{
+				found = fd;
+				foundHost = next;
+			}
+			else if ( errno == EINPROGRESS )
+			{
+				pfd[active].fd = fd;
+				pfd[active].events = POLLOUT;
+				pfd[active].revents = 0;
+				host[active] = next;
+				started[active] = msecNow();
+				active++;
+			}
+			else
+			{
+				close(fd );
+			}
+			next++;
+		}
+		if ( found >= 0 || active == 0 )
+		{
+			if ( found < 0 && next < 255 )
+			{
+				// Could not open a socket and nothing in flight
+				return ( -1 );
+			}
+			break;
+		}
+		if ( poll(pfd, active, SCAN_POLL_MS ) < 0 && errno != EINTR )
+		{
+			sprintf(msgbuf, "comm.scanSubnet poll: %s", strerror(errno ) );
+			log_message("", msgbuf);
+			break;
+		}
+		now = msecNow();
+		for ( i = 0 ; i < active ; )
+		{
+			done = 0;
+			if ( pfd[i].revents )
+			{
+				lon = sizeof(int);
+				if ( found < 0 &&
+					 getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, (void*)(&valopt), &lon ) == 0 &&
+					 valopt == 0 )
+				{
+					found = pfd[i].fd;
+					foundHost = host[i];
+				}
+				else
+				{
+					// Not a SimManager. It did not answer on the port.
+					close(pfd[i].fd );
+				}
+				done = 1;
+			}
+			else if ( now - started[i] >= SCAN_TIMEOUT_MS )
+			{
+				close(pfd[i].fd );
+				done = 1;
+			}
+			if ( done )
+			{
+				active--;
+				pfd[i] = pfd[active];
+				host[i] = host[active];
+				started[i] = started[active];
+			}
+			else
+			{
+				i++;
+			}
+		}
+	}
+	for ( i = 0 ; i < active ; i++ )
+	{
+		close(pfd[i].fd );
+	}
+	if ( found < 0 )
+	{
+		if ( debug )
+		{
+			sprintf(msgbuf, "comm.scanSubnet %d.%d.%d.0/24: no simMgr found", myIP->b1, myIP->b2, myIP->b3 );
+			log_message("", msgbuf);
+		}
+		return ( -1 );
+	}
+	sprintf(simMgrIPAddr, "%d.%d.%d.%d", myIP->b1, myIP->b2, myIP->b3, foundHost );
+	sprintf(msgbuf, "Found simMgr at %s\n", simMgrIPAddr );
+	log_message("", msgbuf);
+	return ( found );
+}
+
+/*
+ * Broadcast a discovery query (DISCOVER_QUERY) to DISCOVER_PORT on every IPv4 interface
+ * that is up, and wait for a sim-mgr to answer with "SIMMGR <addr> <http_port> <sync_port>".
+ * An <addr> of "-" means the address the reply came from. The answer is confirmed by
+ * connecting to the sync port. Returns the open socket, with simMgrIPAddr and
+ * simMgrHttpPort set, or -1 if there was no usable answer.
+*/
+int
+simCtlComm::discover(void )
+{
+	struct ifaddrs *myaddrs, *ifa;
+	struct sockaddr_in to;
+	struct sockaddr_in from;
+	socklen_t fromLen;
+	struct pollfd pfd;
+	char reply[128];
+	char addr[SIM_IP_ADDR_SIZE];
+	int httpPort;
+	int syncPort;
+	int on = 1;
+	int sent;
+	int sock;
+	int len;
+	int tries;
+	int fd = -1;
+	long long end;
+	long long now;
+	
+	sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0 );
+	if ( sock < 0 )
+	{
+		sprintf(msgbuf, "comm.discover socket: %s", strerror(errno ) );
+		log_message("", msgbuf);
+		return ( -1 );
+	}
+	setsockopt(sock, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on) );
+	
+	for ( tries = 0 ; tries < DISCOVER_TRIES && fd < 0 ; tries++ )
+	{
+		sent = 0;
+		if ( getifaddrs(&myaddrs) == 0 )
+		{
+			for ( ifa = myaddrs ; ifa != NULL ; ifa = ifa->ifa_next )
+			{
+				if ( ( ifa->ifa_addr != NULL ) &&
+					 ( ifa->ifa_broadaddr != NULL ) &&
+					 ( ifa->ifa_addr->sa_family == AF_INET ) &&
+					 ( ifa->ifa_flags & IFF_UP ) &&
+					 ( ifa->ifa_flags & IFF_BROADCAST ) )
+				{
+					memcpy(&to, ifa->ifa_broadaddr, sizeof(to) );
+					to.sin_port = htons(DISCOVER_PORT );
+					if ( sendto(sock, DISCOVER_QUERY, strlen(DISCOVER_QUERY ), 0,
+								(struct sockaddr *)&to, sizeof(to) ) > 0 )
 					{
-						return ( SYNC_PULSE_VPC );
+						sent++;
 					}
-					else
+					else if ( debug )
 					{
-						return ( SYNC_PULSE );
+						sprintf(msgbuf, "comm.discover sendto %s: %s", ifa->ifa_name, strerror(errno ) );
+						log_message("", msgbuf);
 					}
 				}
-				else if (  strncmp(buffer, "breath", 6 ) == 0 )
+			}
+			freeifaddrs(myaddrs);
+		}
+		if ( sent == 0 )
+		{
+			break;
+		}
+		
+		end = msecNow() + DISCOVER_WAIT_MS;
+		while ( fd < 0 && ( now = msecNow() ) < end )
+		{
+			pfd.fd = sock;
+			pfd.events = POLLIN;
+			if ( poll(&pfd, 1, (int)( end - now ) ) <= 0 )
+			{
+				continue;
+			}
+			fromLen = sizeof(from);
+			len = recvfrom(sock, reply, sizeof(reply) - 1, 0, (struct sockaddr *)&from, &fromLen );
+			if ( len <= 0 )
+			{
+				continue;
+			}
+			reply[len] = 0;
+			if ( sscanf(reply, DISCOVER_REPLY " %31s %d %d", addr, &httpPort, &syncPort ) != 3 ||
+				 syncPort != commPort )
+			{
+				continue;
+			}
+			if ( strcmp(addr, "-" ) == 0 || inet_addr(addr ) == INADDR_NONE )
+			{
+				inet_ntop(AF_INET, &from.sin_addr, addr, sizeof(addr) );
+			}
+			if ( debug )
+			{
+				sprintf(msgbuf, "comm.discover: answer from %s, http %d sync %d", addr, httpPort, syncPort );
+				log_message("", msgbuf);
+			}
+			fd = this->trySimMgrOpen(addr );
+			if ( fd > 0 )
+			{
+				simMgrHttpPort = httpPort;
+			}
+			else
+			{
+				fd = -1;
+			}
+		}
+	}
+	close(sock );
+	return ( fd );
+}
+
+/*
+ * Sync message framing
+ *
+ * Messages are the words in syncNames, separated by newlines (or any of SYNC_DELIM).
+ * Bytes read from the socket go into a ring and are parsed from there, so several
+ * messages in one read and messages split across reads are all returned, in order.
+ * Words from a peer that sends no separators at all ("pulsebreath") are also split.
+ * Once the peer has answered the hello, the ring holds struct syncFrame instead.
+*/
+#define SYNC_RING_MASK	( SYNC_RING_SIZE - 1 )
+#define SYNC_DELIM(c)	( (c) == '\n' || (c) == '\r' || (c) == ' ' || (c) == 0 )
+#define SYNC_HELLO_ACK	0x10		// The peer's answer to SYNC_HELLO; not returned by wait()
+
+struct syncName
+{
+	const char *name;
+	unsigned int len;
+	int type;
+};
+
+// Longer names first, where one is a prefix of another
+static const struct syncName syncNames[] =
+{
+	{ "pulseVPC",	8,	SYNC_PULSE_VPC },
+	{ "pulse",		5,	SYNC_PULSE },
+	{ "breath",		6,	SYNC_BREATH },
+	{ SYNC_HELLO,	4,	SYNC_HELLO_ACK },
+	{ NULL,			0,	0 }
+};
+
+const char *
+simCtlComm::syncName(int type )
+{
+	int i;
+	
+	for ( i = 0 ; syncNames[i].name ; i++ )
+	{
+		if ( syncNames[i].type == type )
+		{
+			return ( syncNames[i].name );
+		}
+	}
+	return ( "unknown" );
+}
+
+/*
+ * Take the next message from the ring. Returns its SYNC_ type, or 0 if more data is
+ * needed. A name that could be the start of a longer one ("pulse" of "pulseVPC") is
+ * complete when a separator follows, or, from a peer that has not sent a separator,
+ * when nothing more is waiting on the socket (final).
+ * Anything that is not a sync message is dropped, up to the next separator.
+*/
+int
+simCtlComm::nextMessage(int final )
+{
+	unsigned int avail;
+	unsigned int i;
+	unsigned int j;
+	int partial;
+	char bad[SYNC_RING_SIZE+1];
+	
+	if ( binary )
+	{
+		return ( this->nextFrame() );
+	}
+	while ( 1 )
+	{
+		while ( ringTail != ringHead && SYNC_DELIM(ring[ringTail & SYNC_RING_MASK] ) )
+		{
+			ringTail++;
+			delimited = 1;
+		}
+		if ( delimited )
+		{
+			final = 0;
+		}
+		avail = ringHead - ringTail;
+		if ( avail == 0 )
+		{
+			return ( 0 );
+		}
+		partial = 0;
+		for ( i = 0 ; syncNames[i].name ; i++ )
+		{
+			for ( j = 0 ; j < syncNames[i].len && j < avail ; j++ )
+			{
+				if ( ring[( ringTail + j ) & SYNC_RING_MASK] != syncNames[i].name[j] )
 				{
-					return ( SYNC_BREATH );
+					break;
 				}
-				else
+			}
+			if ( j == syncNames[i].len )
+			{
+				if ( partial && ! ( final && avail == j ) )
 				{
-					sprintf(msgbuf, "bad sync msg %s", buffer );
+					// May yet be a longer name
+					return ( 0 );
+				}
+				ringTail += j;
+				if ( syncNames[i].type == SYNC_HELLO_ACK )
+				{
+					binary = 1;
+					stats.binary = 1;
+					sprintf(msgbuf, "Sync connection using binary frames" );
 					log_message("", msgbuf);
+					return ( this->nextFrame() );
 				}
+				return ( syncNames[i].type );
 			}
-			else if (  strncmp(buffer, syncMessage, msgLen ) == 0 )
+			if ( j == avail )
 			{
-				return ( 1 );
+				partial = 1;	// The start of this name; wait for the rest
+			}
+		}
+		if ( partial )
+		{
+			return ( 0 );
+		}
+		
+		// Not a sync message
+		for ( j = 0 ; ringTail != ringHead && ! SYNC_DELIM(ring[ringTail & SYNC_RING_MASK] ) ; j++ )
+		{
+			bad[j] = ring[ringTail & SYNC_RING_MASK];
+			ringTail++;
+		}
+		bad[j] = 0;
+		stats.malformed++;
+		sprintf(msgbuf, "bad sync msg %s", bad );
+		log_message("", msgbuf);
+	}
+}
+
+/*
+ * Take the next binary frame from the ring. Returns its SYNC_ type, or 0 if more data is
+ * needed. Counts frames missing from the sequence, and the one way latency from the
+ * sender's clock (which the local clock is synced to) to the read that delivered it.
+ * Anything else is skipped up to the next SYNC_FRAME_MAGIC.
+*/
+int
+simCtlComm::nextFrame(void )
+{
+	struct syncFrame frame;
+	unsigned char *ptr = (unsigned char *)&frame;
+	unsigned short seq;
+	unsigned short gap;
+	unsigned int i;
+	int latency;
+	
+	while ( 1 )
+	{
+		while ( ringTail != ringHead && (unsigned char)ring[ringTail & SYNC_RING_MASK] != SYNC_FRAME_MAGIC )
+		{
+			// The newline after the hello answer is expected. Count each run of anything else once.
+			if ( ! SYNC_DELIM(ring[ringTail & SYNC_RING_MASK] ) && ! skipping )
+			{
+				skipping = 1;
+				stats.malformed++;
+			}
+			ringTail++;
+		}
+		if ( ringHead - ringTail < sizeof(frame) )
+		{
+			return ( 0 );
+		}
+		for ( i = 0 ; i < sizeof(frame) ; i++ )
+		{
+			ptr[i] = ring[( ringTail + i ) & SYNC_RING_MASK];
+		}
+		if ( frame.type != SYNC_PULSE && frame.type != SYNC_PULSE_VPC && frame.type != SYNC_BREATH )
+		{
+			// Not a frame after all; look for the next magic byte
+			if ( ! skipping )
+			{
+				skipping = 1;
+				stats.malformed++;
+			}
+			ringTail++;
+			continue;
+		}
+		ringTail += sizeof(frame);
+		skipping = 0;
+		
+		seq = ntohs(frame.seq );
+		if ( haveSeq )
+		{
+			gap = (unsigned short)( seq - lastSeq - 1 );
+			if ( gap != 0 && gap < 0x8000 )
+			{
+				stats.lost += gap;
+				if ( debug )
+				{
+					sprintf(msgbuf, "comm: %d sync frames lost before seq %d", gap, seq );
+					log_message("", msgbuf);
+				}
+			}
+		}
+		lastSeq = seq;
+		haveSeq = 1;
+		
+		latency = (int)( (unsigned int)readReal - ntohl(frame.sent ) );
+		stats.latency = latency;
+		if ( stats.avgLatency == 0 )
+		{
+			stats.avgLatency = latency;
+		}
+		else
+		{
+			stats.avgLatency = stats.avgLatency - ( stats.avgLatency / 16 ) + ( latency / 16 );
+		}
+		if ( latency > stats.maxLatency )
+		{
+			stats.maxLatency = latency;
+		}
+		return ( frame.type );
+	}
+}
+
+/*
+ * Read what is waiting on the socket into the ring.
+ * Returns the byte count, 0 if the connection has closed, or -1 on error.
+*/
+int
+simCtlComm::fill(void )
+{
+	unsigned int space;
+	unsigned int offset;
+	int len;
+	
+	if ( ringHead - ringTail == SYNC_RING_SIZE )
+	{
+		// Cannot happen while nextMessage() drops bad data; recover anyway
+		stats.malformed++;
+		ringTail = ringHead;
+	}
+	offset = ringHead & SYNC_RING_MASK;
+	space = SYNC_RING_SIZE - ( ringHead - ringTail );
+	if ( space > SYNC_RING_SIZE - offset )
+	{
+		space = SYNC_RING_SIZE - offset;	// Up to the end of the ring; the rest on the next read
+	}
+	do
+	{
+		len = read(commFD, &ring[offset], space );
+	} while ( len < 0 && errno == EINTR );
+	if ( len > 0 )
+	{
+		readTime = usecNow();
+		readReal = realNow();
+		ringHead += len;
+		stats.reads++;
+		readMessages = 0;
+	}
+	else if ( len < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+	{
+		len = -2;
+	}
+	return ( len );
+}
+
+/*
+ * Log a sync message in shared memory, stamped with the time of the read that
+ * delivered it, and count its jitter (see struct syncTiming in shmData.h).
+*/
+void
+simCtlComm::logArrival(int type )
+{
+	struct syncTiming *timing;
+	struct syncJitter *jit;
+	struct syncArrival *entry;
+	long long jitter;
+	unsigned int n;
+	int rate;
+	
+	if ( ! shmData )
+	{
+		return;
+	}
+	timing = &shmData->sync;
+	if ( type == SYNC_BREATH )
+	{
+		jit = &timing->breath;
+		rate = shmData->respiration.rate;
+	}
+	else
+	{
+		jit = &timing->beat;
+		rate = shmData->cardiac.rate;
+	}
+	jitter = SYNC_JITTER_NONE;
+	if ( jit->last )
+	{
+		// A VPC is early and the beat after it late, by design; don't count either
+		if ( rate > 0 && type != SYNC_PULSE_VPC && jit->lastType != SYNC_PULSE_VPC )
+		{
+			jitter = ( readTime - jit->last ) - 60000000 / rate;
+			if ( jitter >= SYNC_JITTER_NONE || jitter <= -SYNC_JITTER_NONE )
+			{
+				jitter = SYNC_JITTER_NONE - 1;
 			}
+			jit->hist[syncJitterBin((int)jitter )]++;
+			jit->count++;
+			if ( llabs(jitter ) > jit->maxJitter )
+			{
+				jit->maxJitter = (int)llabs(jitter );
+			}
+		}
+		else
+		{
+			jit->skipped++;
+		}
+	}
+	jit->last = readTime;
+	jit->lastType = type;
+	
+	n = timing->arrivals;
+	entry = &timing->log[n & ( SYNC_LOG_SIZE - 1 )];
+	entry->seq = 0;
+	__sync_synchronize();
+	entry->type = type;
+	entry->when = readTime;
+	entry->jitter = (int)jitter;
+	__sync_synchronize();
+	entry->seq = n + 1;
+	this->publishStats();
+	__sync_synchronize();
+	timing->arrivals = n + 1;
+	syncEventPost();
+	
+	if ( recordFile )
+	{
+		this->writeRecord(type );
+	}
+}
+
+/*
+ * Start recording the sync messages to path, for playback with syncReplay.
+ * Returns 0, or -1 if the file cannot be written.
+*/
+int
+simCtlComm::record(const char *path )
+{
+	struct syncRecordHeader header;
+	struct timespec ts;
+	
+	recordFile = fopen(path, "w" );
+	if ( recordFile == NULL )
+	{
+		sprintf(msgbuf, "comm.record %s: %s", path, strerror(errno ) );
+		log_message("", msgbuf);
+		return ( -1 );
+	}
+	memcpy(header.magic, SYNC_RECORD_MAGIC, sizeof(header.magic) );
+	clock_gettime(CLOCK_REALTIME, &ts );
+	header.start = (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	recordLast = usecNow();
+	if ( fwrite(&header, sizeof(header), 1, recordFile ) != 1 )
+	{
+		fclose(recordFile );
+		recordFile = NULL;
+		return ( -1 );
+	}
+	fflush(recordFile );
+	sprintf(msgbuf, "Recording sync messages to %s", path );
+	log_message("", msgbuf);
+	return ( 0 );
+}
+
+void
+simCtlComm::writeRecord(int type )
+{
+	struct syncRecord rec;
+	long long delta = readTime - recordLast;
+	
+	if ( delta < 0 )
+	{
+		delta = 0;
+	}
+	else if ( delta > 0xffffffffLL )
+	{
+		delta = 0xffffffffLL;
+	}
+	rec.delta = (unsigned int)delta;
+	rec.type = type;
+	rec.flags = recordFlags;
+	rec.seq = binary ? lastSeq : recordSeq++;
+	recordFlags = 0;
+	recordLast = readTime;
+	
+	// Flushed each time, so a recording survives a crash. There are only a few a second.
+	if ( fwrite(&rec, sizeof(rec), 1, recordFile ) != 1 || fflush(recordFile ) != 0 )
+	{
+		sprintf(msgbuf, "comm.record: %s. Recording stopped", strerror(errno ) );
+		log_message("", msgbuf);
+		fclose(recordFile );
+		recordFile = NULL;
+	}
+}
+
+/*
+ * Copy the stats to shmData. Called with linkMutex held.
+*/
+void
+simCtlComm::publishStats(void )
+{
+	if ( shmData )
+	{
+		shmData->sync.comm = stats;
+	}
+}
+
+/*
+ * The sync connection has been lost (err is the errno, or 0 if the sim-mgr closed it).
+ * Called from wait() with linkMutex held, and returns with a new connection. There is
+ * nothing for the waiting thread to do until then, so the reconnect runs on it.
+*/
+void
+simCtlComm::reopen(int err )
+{
+	if ( commFD > 0 )
+	{
+		close(commFD );
+	}
+	commFD = -1;
+	ringHead = ringTail = 0;
+	delimited = 0;
+	binary = 0;
+	stats.binary = 0;
+	stats.up = 0;
+	recordFlags |= SYNC_RECORD_RECONNECT;
+	stats.outages++;
+	stats.lastOutage = 0;
+	if ( err == ETIMEDOUT )
+	{
+		stats.timeouts++;
+	}
+	downSince = msecNow();
+	sprintf(msgbuf, "Sync connection to %s lost: %s", simMgrIPAddr, err ? strerror(err ) : "closed by simMgr" );
+	log_message("", msgbuf);
+	if ( shmData )
+	{
+		// The gap is the outage, not jitter
+		shmData->sync.beat.last = 0;
+		shmData->sync.breath.last = 0;
+	}
+	this->publishStats();
+	this->reconnectLoop();
+}
+
+/*
+ * Reopen the sync connection. The sim-mgr has most likely restarted at the same address,
+ * so that is tried first, with the delay doubling from SYNC_BACKOFF_MIN_MS to
+ * SYNC_BACKOFF_MAX_MS between tries. Every SYNC_SEARCH_TRIES tries, it is searched for
+ * again with discover() and scanSubnet() in case it has moved.
+ *
+ * Called with linkMutex held. It is released during each try and backoff.
+*/
+void
+simCtlComm::reconnectLoop(void )
+{
+	char addr[SIM_IP_ADDR_SIZE];
+	const char *how;
+	int backoff = SYNC_BACKOFF_MIN_MS;
+	int tries = 0;
+	int fd = -1;
+	
+	memcpy(addr, simMgrIPAddr, SIM_IP_ADDR_SIZE );
+	while ( fd <= 0 )
+	{
+		tries++;
+		stats.attempts++;
+		pthread_mutex_unlock(&linkMutex );
+		if ( strlen(simMgrName ) > 0 )
+		{
+			how = "name";
+			fd = this->trySimMgrOpen(simMgrName );
 		}
 		else
 		{
-			// Check if closed and try to reopen
-			buffer[0] = 'P';
-			
-			len = write(commFD, buffer, 1 );
-			if ( ( len < 0 )  ||  ( errno == EPIPE ) )
+			how = "last known address";
+			fd = this->trySimMgrOpen(addr );
+			if ( fd <= 0 && ( tries % SYNC_SEARCH_TRIES ) == 0 )
 			{
-				this->openListen(1);
-				sprintf(msgbuf, "Closed - Reopen Pipe" );
+				how = "discovery query";
+				fd = this->discover();
+				if ( fd <= 0 )
+				{
+					how = "subnet scan";
+					fd = this->scanSubnet(&localIP );
+				}
+				if ( fd > 0 )
+				{
+					saveLastAddr(simMgrIPAddr );
+				}
+			}
+		}
+		if ( fd <= 0 )
+		{
+			pthread_mutex_lock(&linkMutex );
+			stats.lastOutage = (unsigned int)( msecNow() - downSince );
+			this->publishStats();
+			pthread_mutex_unlock(&linkMutex );
+			usleep(backoff * 1000 );
+			backoff *= 2;
+			if ( backoff > SYNC_BACKOFF_MAX_MS )
+			{
+				backoff = SYNC_BACKOFF_MAX_MS;
+			}
+		}
+		pthread_mutex_lock(&linkMutex );
+	}
+	this->keepalive(fd );
+	this->hello(fd );
+	
+	commFD = fd;
+	stats.up = 1;
+	stats.reconnects++;
+	stats.lastOutage = (unsigned int)( msecNow() - downSince );
+	stats.totalOutage += stats.lastOutage;
+	if ( stats.lastOutage > stats.maxOutage )
+	{
+		stats.maxOutage = stats.lastOutage;
+	}
+	this->publishStats();
+	sprintf(msgbuf, "Sync connection to %s restored by %s after %u ms, %d tries",
+		simMgrIPAddr, how, stats.lastOutage, tries );
+	log_message("", msgbuf);
+}
+
+void
+simCtlComm::attach(int fd )
+{
+	commFD = fd;
+	ringHead = ringTail = 0;
+	readMessages = 0;
+	delimited = 0;
+	binary = 0;
+	haveSeq = 0;
+	skipping = 0;
+}
+
+/*
+ * Block until the next sync message arrives.
+ *
+ * With an empty syncMessage, returns the message's SYNC_ type. Otherwise, returns 1
+ * when a message starting with syncMessage arrives; others are discarded.
+*/
+int
+simCtlComm::wait(const char *syncMessage )
+{
+	int msgLen = strlen(syncMessage );
+	struct pollfd pfd;
+	int final = 0;
+	int type;
+	int sts;
+	int err;
+	
+	// Held while stats may change: everywhere but the poll
+	pthread_mutex_lock(&linkMutex );
+	while ( 1 )
+	{
+		type = this->nextMessage(final );
+		if ( type )
+		{
+			stats.messages++;
+			if ( readMessages++ > 0 )
+			{
+				stats.coalesced++;
+			}
+			this->logArrival(type );
+			if ( debug > 1 )
+			{
+				printf("%s\n", syncName(type ) );
+			}
+			if ( msgLen == 0 )
+			{
+				pthread_mutex_unlock(&linkMutex );
+				return ( type );
+			}
+			if ( strncmp(syncName(type ), syncMessage, msgLen ) == 0 )
+			{
+				pthread_mutex_unlock(&linkMutex );
+				return ( 1 );
+			}
+			continue;
+		}
+		
+		// If what is buffered may already be a whole message, only check for more
+		pfd.fd = commFD;
+		pfd.events = POLLIN;
+		pthread_mutex_unlock(&linkMutex );
+		sts = poll(&pfd, 1, ( ringHead != ringTail && ! final ) ? 0 : -1 );
+		err = errno;
+		pthread_mutex_lock(&linkMutex );
+		if ( sts == 0 )
+		{
+			final = 1;
+			continue;
+		}
+		if ( sts < 0 )
+		{
+			if ( err != EINTR )
+			{
+				sprintf(msgbuf, "comm.wait poll: %s", strerror(err ) );
 				log_message("", msgbuf);
+				this->reopen(err );
 			}
+			continue;
+		}
+		final = 0;
+		sts = this->fill();
+		if ( sts == 0 )
+		{
+			this->reopen(0 );
+		}
+		else if ( sts == -1 )
+		{
+			this->reopen(errno );
 		}
-		usleep(1000);
 	}
 }
 
@@ -21,7 +21,18 @@
 #ifndef SIMCTLCOMM_H_
 #define SIMCTLCOMM_H_
 
+#include <stdio.h>
+#include <pthread.h>
+
+#include "shmData.h"
+
 #define SYNC_PORT	50200
+
+// Discovery: sim-ctl broadcasts DISCOVER_QUERY to DISCOVER_PORT and the sim-mgr replies
+// "SIMMGR <addr> <http_port> <sync_port>", with "-" for <addr> to mean the sender's address
+#define DISCOVER_PORT	50201
+#define DISCOVER_QUERY	"SIMCTL?"
+#define DISCOVER_REPLY	"SIMMGR"
 #define LISTEN_ACTIVE	1
 #define LISTEN_INACTIVE	0
 
@@ -29,15 +40,114 @@
 #define SYNC_PULSE_VPC		2
 #define SYNC_BREATH			3
 
+#define SYNC_RING_SIZE	256		// Sync port receive ring, bytes. Must be a power of 2
+
+/*
+ * Binary sync frames. On connect, sim-ctl sends SYNC_HELLO and a newline. A sim-mgr that
+ * supports frames answers with the same line and sends a struct syncFrame for each sync
+ * from then on. Older sim-mgrs ignore the hello and keep sending the ASCII words.
+*/
+#define SYNC_HELLO			"BIN1"
+#define SYNC_FRAME_MAGIC	0xA5
+
+struct syncFrame
+{
+	unsigned char magic;		// SYNC_FRAME_MAGIC
+	unsigned char type;			// SYNC_PULSE, SYNC_PULSE_VPC or SYNC_BREATH
+	unsigned short seq;			// Network order. Counts every frame sent on the connection
+	unsigned int sent;			// Network order. usec of the sender's CLOCK_REALTIME, low 32 bits
+};
+
+/*
+ * Sync recording (simController -o): a struct syncRecordHeader, then a struct syncRecord
+ * for each sync message received, in order. Played back by syncReplay. Written in host
+ * byte order.
+*/
+#define SYNC_RECORD_MAGIC	"SYNCREC1"
+
+struct syncRecordHeader
+{
+	char magic[8];				// SYNC_RECORD_MAGIC, not terminated
+	long long start;			// usec, CLOCK_REALTIME when the recording started
+};
+
+struct syncRecord
+{
+	unsigned int delta;			// usec, CLOCK_MONOTONIC since the previous record (or the start)
+	unsigned char type;			// SYNC_PULSE, SYNC_PULSE_VPC or SYNC_BREATH
+	unsigned char flags;		// SYNC_RECORD_ flags
+	unsigned short seq;			// Frame sequence number, or a count for ASCII messages
+};
+#define SYNC_RECORD_RECONNECT	0x01	// First message after the connection was reopened
+
 #define SIM_IP_ADDR_SIZE 32
 #define SIM_NAME_SIZE	512
 
+#define SIMMGR_LAST_FILE	"/simulator/simmgrLast"	// Address the sim-mgr was last found at
+
+// Sync connection health. Keepalives find a dead connection in about
+// SYNC_KEEPIDLE + SYNC_KEEPCNT * SYNC_KEEPINTVL sec. It is then reopened by the
+// thread in wait(), at the last known address first, with backoff between tries.
+#define SYNC_KEEPIDLE		2		// sec idle before the first keepalive probe
+#define SYNC_KEEPINTVL		1		// sec between probes
+#define SYNC_KEEPCNT		3		// Unanswered probes before the connection is dropped
+#define SYNC_USER_TIMEOUT	5000	// msec, longest time sent data may go unacknowledged
+#define SYNC_BACKOFF_MIN_MS	250		// First delay between reconnect attempts
+#define SYNC_BACKOFF_MAX_MS	8000	// Longest delay between reconnect attempts
+#define SYNC_SEARCH_TRIES	4		// Attempts at the last address before searching again
+
+struct IPv4
+{
+	unsigned char b1;
+	unsigned char b2;
+	unsigned char b3;
+	unsigned char b4;
+};
+
 class simCtlComm {
 
 private:
 	int commFD;
 	int commPort;
 	int trySimMgrOpen(char *name );
+	int scanSubnet(struct IPv4 *myIP );
+	int discover(void );
+	
+	// Sync port receive ring
+	char ring[SYNC_RING_SIZE];
+	unsigned int ringHead;		// Next byte to be written
+	unsigned int ringTail;		// Next byte to be parsed
+	int readMessages;			// Messages taken from the data of the latest read
+	int delimited;				// The peer separates its messages
+	long long readTime;			// usec, CLOCK_MONOTONIC of the latest read
+	long long readReal;			// usec, CLOCK_REALTIME of the latest read
+	int binary;					// The peer has answered the hello and sends frames
+	int haveSeq;
+	unsigned short lastSeq;
+	int skipping;				// Skipping bytes that are not a frame
+	int fill(void );
+	int nextMessage(int final );
+	int nextFrame(void );
+	void hello(int fd );
+	
+	// Recording
+	FILE *recordFile;
+	long long recordLast;		// usec, CLOCK_MONOTONIC of the last record
+	unsigned short recordSeq;
+	int recordFlags;
+	void writeRecord(int type );
+	void reopen(int err );
+	void logArrival(int type );
+	
+	// Sync connection state. While down, wait() runs reconnectLoop() and returns once
+	// it has a new connection. linkMutex is held for every change to stats and every
+	// copy of them to shmData.
+	struct IPv4 localIP;
+	pthread_mutex_t linkMutex;
+	long long downSince;		// msec, CLOCK_MONOTONIC the connection was lost
+	void keepalive(int fd );
+	void reconnectLoop(void );
+	void publishStats(void );
 	
 public:
 	simCtlComm(int port);
@@ -46,19 +156,17 @@ public:
 	int openListen(int active );	// If Active is set, the port stays open. Otherwise, this is simply used to discover the simmgr
 	int closeListen(void );
 	int wait(const char *syncMessage );
+	void attach(int fd );			// Use an already open connection for wait()
+	static const char *syncName(int type );
+	struct syncCommStats stats;
+	int binaryWanted;				// Offer binary frames on connect (default)
+	int record(const char *path );	// Record the sync messages received to a file
 	void show(void );
 	
 	char simMgrName[SIM_NAME_SIZE];
 	char simMgrIPAddr[SIM_IP_ADDR_SIZE];
+	int simMgrHttpPort;		// HTTP port announced by the sim-mgr, 0 if not known
 	virtual ~simCtlComm();
 };
 
-struct IPv4
-{
-	unsigned char b1;
-	unsigned char b2;
-	unsigned char b3;
-	unsigned char b4;
-};
-	
 #endif /* SIMCTLCOMM_H_ */
\ No newline at end of file
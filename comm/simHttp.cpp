@@ -0,0 +1,272 @@
+/*
+ * simHttp.cpp
+ *
+ * This file is part of the sim-ctl distribution (https://github.com/OpenVetSimDevelopers/sim-ctl).
+ * 
+ * Copyright (c) 2019 VetSim, Cornell University College of Veterinary Medicine Ithaca, NY
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * In-process HTTP client for the sim-mgr status CGI.
+ *
+ * A single libcurl easy handle is kept for the life of the process. libcurl holds the
+ * TCP connection open between transfers (HTTP/1.1 keep-alive), so the periodic status
+ * reads and sensor writes do not pay for a fork/exec or a new connection each time.
+*/
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "simHttp.h"
+#include "simUtil.h"
+
+extern int debug;
+
+#define SIM_HTTP_CONNECT_TIMEOUT_MS	1000
+#define SIM_HTTP_TIMEOUT_MS			2000
+
+struct bufferSink
+{
+	char *buf;
+	int bufLen;
+	int len;
+};
+
+static size_t
+writeCallback(char *ptr, size_t size, size_t nmemb, void *userdata )
+{
+	size_t len = size * nmemb;
+	void **args = (void **)userdata;
+	simHttpSink sink = (simHttpSink)args[0];
+
+	return ( sink(ptr, len, args[1] ) );
+}
+
+static size_t
+bufferWrite(const char *data, size_t len, void *ctx )
+{
+	struct bufferSink *bs = (struct bufferSink *)ctx;
+	size_t room = bs->bufLen - bs->len - 1;
+
+	if ( len > room )
+	{
+		// Response too large for the caller's buffer
+		return ( 0 );
+	}
+	memcpy(&bs->buf[bs->len], data, len );
+	bs->len += len;
+	bs->buf[bs->len] = 0;
+	return ( len );
+}
+
+simHttp::simHttp(void )
+{
+	curl = NULL;
+	baseUrl[0] = 0;
+	url[0] = 0;
+	memset(&stats, 0, sizeof(stats) );
+}
+
+int
+simHttp::open(const char *host )
+{
+	this->close();
+
+	snprintf(baseUrl, SIM_HTTP_URL_SIZE, "http://%s%s", host, SIM_HTTP_STATUS_CGI );
+
+	curl = curl_easy_init();
+	if ( ! curl )
+	{
+		log_message("", "simHttp: curl_easy_init failed" );
+		return ( -1 );
+	}
+	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L );
+	curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L );
+	curl_easy_setopt(curl, CURLOPT_TCP_NODELAY, 1L );
+	curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, (long)SIM_HTTP_CONNECT_TIMEOUT_MS );
+	curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, (long)SIM_HTTP_TIMEOUT_MS );
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeCallback );
+
+	return ( 0 );
+}
+
+void
+simHttp::close(void )
+{
+	if ( curl )
+	{
+		curl_easy_cleanup(curl );
+		curl = NULL;
+	}
+}
+
+int
+simHttp::get(const char *query, simHttpSink sink, void *ctx )
+{
+	CURLcode res;
+	long code = 0;
+	void *args[2];
+	char buf[256];
+	int len;
+
+	if ( ! curl )
+	{
+		return ( -1 );
+	}
+	if ( query && query[0] )
+	{
+		len = snprintf(url, SIM_HTTP_URL_SIZE, "%s?%s", baseUrl, query );
+	}
+	else
+	{
+		len = snprintf(url, SIM_HTTP_URL_SIZE, "%s", baseUrl );
+	}
+	if ( len < 0 || len >= SIM_HTTP_URL_SIZE )
+	{
+		// A truncated query would set some fields and silently drop the rest
+		snprintf(buf, sizeof(buf), "simHttp: request of %d bytes is too long, not sent", len );
+		log_message("", buf );
+		stats.requests++;
+		stats.failures++;
+		return ( -1 );
+	}
+	args[0] = (void *)sink;
+	args[1] = ctx;
+	curl_easy_setopt(curl, CURLOPT_URL, url );
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)args );
+
+	res = curl_easy_perform(curl );
+	if ( res == CURLE_OK )
+	{
+		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code );
+	}
+	if ( res != CURLE_OK || code >= 400 )
+	{
+		updateStats(0 );
+		if ( debug || stats.failures == 1 )
+		{
+			if ( res != CURLE_OK )
+			{
+				snprintf(buf, sizeof(buf), "simHttp: %s", curl_easy_strerror(res ) );
+			}
+			else
+			{
+				snprintf(buf, sizeof(buf), "simHttp: HTTP status %ld", code );
+			}
+			log_message("", buf );
+		}
+		return ( -2 );
+	}
+	updateStats(1 );
+	return ( 0 );
+}
+
+int
+simHttp::get(const char *query, char *buf, int bufLen )
+{
+	struct bufferSink bs;
+	int sts;
+
+	bs.buf = buf;
+	bs.bufLen = bufLen;
+	bs.len = 0;
+	buf[0] = 0;
+
+	sts = get(query, bufferWrite, &bs );
+	if ( sts < 0 )
+	{
+		return ( sts );
+	}
+	return ( bs.len );
+}
+
+int
+simHttp::stream(const char *query, simHttpSink sink, void *ctx )
+{
+	int sts;
+
+	if ( ! curl )
+	{
+		return ( -1 );
+	}
+	curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, 0L );
+	curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1L );
+	curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, (long)SIM_HTTP_STREAM_IDLE_SEC );
+
+	sts = get(query, sink, ctx );
+
+	curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, (long)SIM_HTTP_TIMEOUT_MS );
+	curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 0L );
+	curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 0L );
+	return ( sts );
+}
+
+long
+simHttp::responseCode(void )
+{
+	long code = 0;
+
+	if ( curl )
+	{
+		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code );
+	}
+	return ( code );
+}
+
+void
+simHttp::updateStats(int ok )
+{
+	long connects = 0;
+	double total = 0;
+	unsigned int usec;
+
+	stats.requests++;
+	if ( ! ok )
+	{
+		stats.failures++;
+	}
+	curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects );
+	if ( connects > 0 )
+	{
+		stats.connects += connects;
+	}
+	else if ( ok )
+	{
+		stats.reused++;
+	}
+	curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &total );
+	usec = (unsigned int)( total * 1000000 );
+	stats.lastLatency = usec;
+	if ( usec > stats.maxLatency )
+	{
+		stats.maxLatency = usec;
+	}
+	// Running average, weighted 1/16 to the newest sample
+	if ( stats.requests == 1 )
+	{
+		stats.avgLatency = usec;
+	}
+	else
+	{
+		stats.avgLatency = stats.avgLatency - ( stats.avgLatency / 16 ) + ( usec / 16 );
+	}
+}
+
+simHttp::~simHttp()
+{
+	this->close();
+}
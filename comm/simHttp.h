@@ -0,0 +1,68 @@
+/*
+ * simHttp.h
+ *
+ * This file is part of the sim-ctl distribution (https://github.com/OpenVetSimDevelopers/sim-ctl).
+ * 
+ * Copyright (c) 2019 VetSim, Cornell University College of Veterinary Medicine Ithaca, NY
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SIMHTTP_H_
+#define SIMHTTP_H_
+
+#include <curl/curl.h>
+
+#include "shmData.h"
+
+#define SIM_HTTP_URL_SIZE		4096
+#define SIM_HTTP_STATUS_CGI		"/cgi-bin/simstatus.cgi"
+#define SIM_HTTP_STREAM_IDLE_SEC	15	// A stream with no data for this long is considered dead
+
+// Called with each block of the response body as it arrives. Return the number
+// of bytes consumed; anything less than len aborts the transfer.
+typedef size_t (*simHttpSink)(const char *data, size_t len, void *ctx );
+
+class simHttp {
+
+private:
+	CURL *curl;
+	char baseUrl[SIM_HTTP_URL_SIZE];
+	char url[SIM_HTTP_URL_SIZE];
+
+	void updateStats(int ok );
+
+public:
+	simHttp(void );
+
+	int open(const char *host );	// Set the sim-mgr address. The connection is opened on first use.
+	void close(void );
+
+	// Issue a GET for SIM_HTTP_STATUS_CGI with the given query string. The connection
+	// is kept open and reused for the following requests.
+	int get(const char *query, simHttpSink sink, void *ctx );
+	int get(const char *query, char *buf, int bufLen );	// Returns the body length, or < 0 on failure
+	
+	// As get(), but with no overall time limit, for long-poll and streaming responses.
+	// Returns when the server ends the response, the link fails or the sink aborts.
+	int stream(const char *query, simHttpSink sink, void *ctx );
+	
+	// HTTP status of the response in progress or last received, 0 if none yet.
+	// A sink can check it to skip an error page.
+	long responseCode(void );
+
+	struct httpStats stats;
+	virtual ~simHttp();
+};
+
+#endif /* SIMHTTP_H_ */
@@ -0,0 +1,345 @@
+/*
+ * simJson.c
+ *
+ * This file is part of the sim-ctl distribution (https://github.com/OpenVetSimDevelopers/sim-ctl).
+ * 
+ * Copyright (c) 2019 VetSim, Cornell University College of Veterinary Medicine Ithaca, NY
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Incremental JSON tokenizer for the sim-mgr status responses.
+ *
+ * The input is consumed one byte at a time by a small state machine, so a response
+ * can be parsed directly from the HTTP receive callback as each block arrives, with
+ * no need to hold the whole body or to split it into lines. Keys and values are
+ * collected into fixed buffers in the parser and handed to the callback along with
+ * the name of the enclosing object.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "simJson.h"
+
+#define JS_VALUE		0	// Expecting a value
+#define JS_KEY_START	1	// In an object, expecting a key or '}'
+#define JS_KEY			2	// In a key string
+#define JS_COLON		3	// Expecting ':' after a key
+#define JS_STRING		4	// In a string value
+#define JS_LITERAL		5	// In a number, true, false or null
+#define JS_NEXT			6	// After a value, expecting ',' or the end of the container
+#define JS_ERROR		7
+
+void
+simJsonInit(struct simJson *js, simJsonCallback callback, void *ctx )
+{
+	memset(js, 0, sizeof(struct simJson ) );
+	js->state = JS_VALUE;
+	js->level[0].type = '{';	// Top level, so values always find an enclosing object
+	js->callback = callback;
+	js->ctx = ctx;
+}
+
+static void
+tokenAdd(char *buf, int *len, char c )
+{
+	if ( *len < SIM_JSON_TOKEN_MAX - 1 )
+	{
+		buf[*len] = c;
+	}
+	(*len)++;
+}
+
+static void
+tokenEnd(struct simJson *js, char *buf, int *len )
+{
+	if ( *len >= SIM_JSON_TOKEN_MAX )
+	{
+		js->truncated++;
+		*len = SIM_JSON_TOKEN_MAX - 1;
+	}
+	buf[*len] = 0;
+}
+
+static int
+hexValue(char c )
+{
+	if ( c >= '0' && c <= '9' )
+	{
+		return ( c - '0' );
+	}
+	if ( c >= 'a' && c <= 'f' )
+	{
+		return ( c - 'a' + 10 );
+	}
+	if ( c >= 'A' && c <= 'F' )
+	{
+		return ( c - 'A' + 10 );
+	}
+	return ( 0 );
+}
+
+/*
+ * Add one character of a key or string value. Returns 1 at the closing quote.
+ * Escapes are decoded; \u sequences outside of ASCII are replaced by '?'.
+*/
+static int
+stringChar(struct simJson *js, char c, char *buf, int *len )
+{
+	if ( js->escape == 1 )
+	{
+		js->escape = 0;
+		switch ( c )
+		{
+			case 'n': c = '\n'; break;
+			case 't': c = '\t'; break;
+			case 'r': c = '\r'; break;
+			case 'b': c = '\b'; break;
+			case 'f': c = '\f'; break;
+			case 'u':
+				js->escape = 2;
+				js->unicode = 0;
+				return ( 0 );
+			default:	// \" \\ and \/ stand for themselves
+				break;
+		}
+		tokenAdd(buf, len, c );
+	}
+	else if ( js->escape >= 2 )
+	{
+		js->unicode = ( js->unicode * 16 ) + hexValue(c );
+		if ( ++js->escape == 6 )
+		{
+			js->escape = 0;
+			tokenAdd(buf, len, ( js->unicode < 0x80 ) ? (char)js->unicode : '?' );
+		}
+	}
+	else if ( c == '\\' )
+	{
+		js->escape = 1;
+	}
+	else if ( c == '"' )
+	{
+		tokenEnd(js, buf, len );
+		return ( 1 );
+	}
+	else
+	{
+		tokenAdd(buf, len, c );
+	}
+	return ( 0 );
+}
+
+static void
+emitValue(struct simJson *js )
+{
+	struct simJsonLevel *lv = &js->level[js->depth];
+	int d;
+
+	if ( ! js->callback )
+	{
+		return;
+	}
+	if ( lv->type == '{' )
+	{
+		js->callback(lv->name, js->key, js->value, js->ctx );
+	}
+	else
+	{
+		// Array element: reported under the array's key, in the nearest object
+		for ( d = js->depth - 1 ; js->level[d].type != '{' ; d-- )
+		{
+		}
+		js->callback(js->level[d].name, lv->name, js->value, js->ctx );
+	}
+}
+
+static int
+push(struct simJson *js, char type )
+{
+	struct simJsonLevel *parent = &js->level[js->depth];
+	struct simJsonLevel *lv;
+
+	if ( js->depth >= SIM_JSON_DEPTH_MAX )
+	{
+		return ( -1 );
+	}
+	lv = &js->level[js->depth + 1];
+	lv->type = type;
+	if ( js->depth == 0 )
+	{
+		lv->name[0] = 0;
+	}
+	else if ( parent->type == '{' )
+	{
+		memcpy(lv->name, js->key, js->keyLen + 1 );
+	}
+	else
+	{
+		memcpy(lv->name, parent->name, SIM_JSON_TOKEN_MAX );
+	}
+	js->depth++;
+	js->state = ( type == '{' ) ? JS_KEY_START : JS_VALUE;
+	return ( 0 );
+}
+
+static int
+pop(struct simJson *js, char c )
+{
+	if ( js->depth == 0 || ( c == '}' ) != ( js->level[js->depth].type == '{' ) )
+	{
+		return ( -1 );
+	}
+	js->depth--;
+	if ( js->depth == 0 )
+	{
+		js->documents++;
+		js->state = JS_VALUE;
+	}
+	else
+	{
+		js->state = JS_NEXT;
+	}
+	return ( 0 );
+}
+
+// Structural characters, for the states outside of keys and values
+static int
+structChar(struct simJson *js, char c )
+{
+	switch ( js->state )
+	{
+		case JS_VALUE:
+			if ( c == '{' || c == '[' )
+			{
+				return ( push(js, c ) );
+			}
+			if ( js->depth == 0 )
+			{
+				return ( -1 );
+			}
+			if ( c == '"' )
+			{
+				js->valueLen = 0;
+				js->escape = 0;
+				js->state = JS_STRING;
+				return ( 0 );
+			}
+			if ( c == ']' && js->level[js->depth].type == '[' )
+			{
+				// Empty array, or a trailing comma
+				return ( pop(js, c ) );
+			}
+			if ( c == ',' || c == ':' || c == '}' || c == ']' )
+			{
+				return ( -1 );
+			}
+			js->valueLen = 0;
+			tokenAdd(js->value, &js->valueLen, c );
+			js->state = JS_LITERAL;
+			return ( 0 );
+
+		case JS_KEY_START:
+			if ( c == '"' )
+			{
+				js->keyLen = 0;
+				js->escape = 0;
+				js->state = JS_KEY;
+				return ( 0 );
+			}
+			if ( c == '}' )
+			{
+				// Empty object, or a trailing comma
+				return ( pop(js, c ) );
+			}
+			return ( -1 );
+
+		case JS_COLON:
+			if ( c == ':' )
+			{
+				js->state = JS_VALUE;
+				return ( 0 );
+			}
+			return ( -1 );
+
+		case JS_NEXT:
+			if ( c == ',' )
+			{
+				js->state = ( js->level[js->depth].type == '{' ) ? JS_KEY_START : JS_VALUE;
+				return ( 0 );
+			}
+			if ( c == '}' || c == ']' )
+			{
+				return ( pop(js, c ) );
+			}
+			return ( -1 );
+	}
+	return ( -1 );
+}
+
+int
+simJsonFeed(struct simJson *js, const char *data, size_t len )
+{
+	size_t i = 0;
+	char c;
+
+	while ( i < len )
+	{
+		c = data[i];
+		switch ( js->state )
+		{
+			case JS_ERROR:
+				return ( -1 );
+
+			case JS_KEY:
+				if ( stringChar(js, c, js->key, &js->keyLen ) )
+				{
+					js->state = JS_COLON;
+				}
+				break;
+
+			case JS_STRING:
+				if ( stringChar(js, c, js->value, &js->valueLen ) )
+				{
+					emitValue(js );
+					js->state = JS_NEXT;
+				}
+				break;
+
+			case JS_LITERAL:
+				if ( c == ',' || c == '}' || c == ']' || isspace((unsigned char)c ) )
+				{
+					tokenEnd(js, js->value, &js->valueLen );
+					emitValue(js );
+					js->state = JS_NEXT;
+					continue;	// The delimiter is handled in the JS_NEXT state
+				}
+				tokenAdd(js->value, &js->valueLen, c );
+				break;
+
+			default:
+				if ( ! isspace((unsigned char)c ) && structChar(js, c ) < 0 )
+				{
+					js->errors++;
+					js->state = JS_ERROR;
+					return ( -1 );
+				}
+				break;
+		}
+		i++;
+	}
+	return ( 0 );
+}
@@ -0,0 +1,67 @@
+/*
+ * simJson.h
+ *
+ * This file is part of the sim-ctl distribution (https://github.com/OpenVetSimDevelopers/sim-ctl).
+ * 
+ * Copyright (c) 2019 VetSim, Cornell University College of Veterinary Medicine Ithaca, NY
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SIMJSON_H_
+#define SIMJSON_H_
+
+#include <stddef.h>
+
+#define SIM_JSON_TOKEN_MAX	128		// Longest key or value kept; longer ones are truncated
+#define SIM_JSON_DEPTH_MAX	8		// Deepest object/array nesting tracked
+
+// Called for each scalar value. section is the key of the innermost enclosing object
+// ("" at the top level), key is the value's own key. All three are NUL terminated and
+// are valid only for the duration of the call.
+typedef void (*simJsonCallback)(const char *section, const char *key, const char *value, void *ctx );
+
+struct simJsonLevel
+{
+	char type;							// '{' or '['
+	char name[SIM_JSON_TOKEN_MAX];		// Key this object or array was stored under
+};
+
+struct simJson
+{
+	int state;
+	int depth;
+	int escape;					// String escape state: 1 after a backslash, 2-5 in a \u sequence
+	int unicode;
+	struct simJsonLevel level[SIM_JSON_DEPTH_MAX+1];
+	char key[SIM_JSON_TOKEN_MAX];
+	int keyLen;
+	char value[SIM_JSON_TOKEN_MAX];
+	int valueLen;
+
+	simJsonCallback callback;
+	void *ctx;
+
+	unsigned int documents;		// Complete top level objects parsed
+	unsigned int truncated;		// Keys or values longer than SIM_JSON_TOKEN_MAX
+	unsigned int errors;		// Syntax errors
+};
+
+void simJsonInit(struct simJson *js, simJsonCallback callback, void *ctx );
+
+// Feed the next block of input. Documents may be split at any byte and several may
+// follow one another on the same stream. Returns 0, or -1 on a syntax error. After an
+// error, the rest of the input is ignored until simJsonInit() is called again.
+int simJsonFeed(struct simJson *js, const char *data, size_t len );
+
+#endif /* SIMJSON_H_ */
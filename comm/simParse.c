@@ -25,482 +25,272 @@
 #include <time.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
 
 #include "shmData.h"
 
 extern int debug;
 
-int
-cardiac_parse(const char *elem,  const char *value, struct cardiac *card )
+/*
+ * Status field tables
+ *
+ * Each field of struct cardiac and struct respiration that is set from the sim-mgr
+ * status has an entry here, giving its name in the status, its location in the
+ * structure, how the value is converted and the change bit reported for it. To add a
+ * field, add it to shmData.h and add one line to the table.
+ *
+ * Lookups go through a hash index, built from the table on first use.
+*/
+#define FIELD_INT		0	// Integer value
+#define FIELD_STRING	1	// String, up to the size of the field
+#define FIELD_PULSE		2	// Pulse strength: none, weak, medium or strong, stored as 0-3
+
+struct parseField
 {
-	int sts = 0;
-	int int_val = atoi(value );
-	int pulse_val;
-	
-	if ( ( ! elem ) || ( ! value) || ( ! card ) )
-	{
-		return ( -11 );
-	}
-	if ( strcmp(elem, ("rhythm" ) ) == 0 )
-	{
-		if ( strcmp(value, card->rhythm ) != 0 )
-		{
-			if ( debug )
-			{
-				printf("Cardiac rhythm: %s (old %s)\n", value, card->rhythm );
-			}
-			sprintf(card->rhythm, "%s", value );
-		}
-	}
-	else if ( strcmp(elem, ("vpc" ) ) == 0 )
-	{
-		if ( strcmp(value, card->vpc ) != 0 )
-		{
-			if ( debug )
-			{
-				printf("Cardiac vpc: %s\n", value );
-			}
-			sprintf(card->vpc, "%s", value );
-		}
-	}
-	else if ( strcmp(elem, ("pea" ) ) == 0 )
-	{
-		if ( int_val != card->pea )
-		{
-			if ( debug )
-			{
-				printf("Cardiac pea: %d\n", int_val );
-			}
-			card->pea = int_val;
-		}
-	}
-	else if ( strcmp(elem, ("vpc_freq" ) ) == 0 )
-	{
-		if ( int_val != card->vpc_freq )
-		{
-			if ( debug )
-			{
-				printf("Cardiac vpc_freq: %d\n", int_val );
-			}
-			card->vpc_freq = int_val;
-		}
-	}
-	else if ( strcmp(elem, ("vfib_amplitude" ) ) == 0 )
-	{
-		if ( strcmp(value, card->vfib_amplitude ) != 0 )
-		{
-			if ( debug )
-			{
-				printf("Cardiac vfib_amplitude: %s\n", value );
-			}
-			sprintf(card->vfib_amplitude, "%s", value );
-		}
-	}
-	else if ( strcmp(elem, ("pwave" ) ) == 0 )
-	{
-		if ( strcmp(value, card->pwave ) != 0 )
-		{
-			if ( debug )
-			{
-				printf("Cardiac pwave: %s\n", value );
-			}
-			sprintf(card->pwave, "%s", value );
-		}
-	}
-	else if ( strcmp(elem, ("rate" ) ) == 0 )
-	{
-		if ( int_val != card->rate )
-		{
-			if ( debug )
-			{
-				printf("Cardiac rate: %d\n", int_val );
-			}
-			card->rate = int_val;
-		}
-	}
-	else if ( strcmp(elem, ("pr_interval" ) ) == 0 )
-	{
-		if ( int_val != card->pr_interval )
-		{
-			if ( debug )
-			{
-				printf("Cardiac pr_interval: %d\n", int_val );
-			}
-			card->pr_interval = int_val;
-		}
-	}
-	else if ( strcmp(elem, ("qrs_interval" ) ) == 0 )
-	{
-		if ( int_val != card->qrs_interval )
-		{
-			if ( debug )
-			{
-				printf("Cardiac qrs_interval: %d\n", int_val );
-			}
-			card->qrs_interval = int_val;
-		}
-	}
-	else if ( strcmp(elem, ("bps_sys" ) ) == 0 )
+	const char *name;
+	int offset;
+	int type;
+	int size;
+	unsigned int change;	// CHG_* bit reported when the value changes
+};
+
+#define PARSE_HASH_SIZE		64	// Power of 2, at least twice the number of fields in a table
+
+struct parseTable
+{
+	const char *section;			// For debug messages
+	struct parseField *fields;
+	unsigned char index[PARSE_HASH_SIZE];	// Hash slot to field number + 1, 0 for empty
+	unsigned int changes;			// CHG_* bits of the fields changed since parse_changes()
+};
+
+#define CARDIAC_FIELD(name, type, change )		{ #name, offsetof(struct cardiac, name ), type, sizeof(((struct cardiac *)0)->name ), change }
+#define RESPIRATION_FIELD(name, type, change )	{ #name, offsetof(struct respiration, name ), type, sizeof(((struct respiration *)0)->name ), change }
+
+static struct parseField cardiacFields[] =
+{
+	CARDIAC_FIELD(rhythm, FIELD_STRING, CHG_CARDIAC_RHYTHM ),
+	CARDIAC_FIELD(vpc, FIELD_STRING, CHG_CARDIAC_VPC ),
+	CARDIAC_FIELD(pea, FIELD_INT, CHG_CARDIAC_PEA ),
+	CARDIAC_FIELD(vpc_freq, FIELD_INT, CHG_CARDIAC_VPC ),
+	CARDIAC_FIELD(vfib_amplitude, FIELD_STRING, CHG_CARDIAC_VFIB_AMPLITUDE ),
+	CARDIAC_FIELD(pwave, FIELD_STRING, CHG_CARDIAC_PWAVE ),
+	CARDIAC_FIELD(rate, FIELD_INT, CHG_CARDIAC_RATE ),
+	CARDIAC_FIELD(pr_interval, FIELD_INT, CHG_CARDIAC_INTERVALS ),
+	CARDIAC_FIELD(qrs_interval, FIELD_INT, CHG_CARDIAC_INTERVALS ),
+	CARDIAC_FIELD(bps_sys, FIELD_INT, CHG_CARDIAC_BPS ),
+	CARDIAC_FIELD(bps_dia, FIELD_INT, CHG_CARDIAC_BPS ),
+	CARDIAC_FIELD(nibp_rate, FIELD_INT, CHG_CARDIAC_NIBP ),
+	CARDIAC_FIELD(nibp_read, FIELD_INT, CHG_CARDIAC_NIBP ),
+	CARDIAC_FIELD(nibp_freq, FIELD_INT, CHG_CARDIAC_NIBP ),
+	CARDIAC_FIELD(heart_sound_volume, FIELD_INT, CHG_CARDIAC_HEART_VOLUME ),
+	CARDIAC_FIELD(heart_sound_mute, FIELD_INT, CHG_CARDIAC_HEART_VOLUME ),
+	CARDIAC_FIELD(heart_sound, FIELD_STRING, CHG_CARDIAC_HEART_SOUND ),
+	CARDIAC_FIELD(right_dorsal_pulse_strength, FIELD_PULSE, CHG_CARDIAC_PULSE_STRENGTH ),
+	CARDIAC_FIELD(left_dorsal_pulse_strength, FIELD_PULSE, CHG_CARDIAC_PULSE_STRENGTH ),
+	CARDIAC_FIELD(right_femoral_pulse_strength, FIELD_PULSE, CHG_CARDIAC_PULSE_STRENGTH ),
+	CARDIAC_FIELD(left_femoral_pulse_strength, FIELD_PULSE, CHG_CARDIAC_PULSE_STRENGTH ),
+	{ NULL, 0, 0, 0, 0 }
+};
+
+static struct parseField respirationFields[] =
+{
+	RESPIRATION_FIELD(inhalation_duration, FIELD_INT, CHG_RESP_DURATION ),
+	RESPIRATION_FIELD(exhalation_duration, FIELD_INT, CHG_RESP_DURATION ),
+	RESPIRATION_FIELD(left_lung_sound_volume, FIELD_INT, CHG_RESP_LEFT_VOLUME ),
+	RESPIRATION_FIELD(left_lung_sound_mute, FIELD_INT, CHG_RESP_LEFT_VOLUME ),
+	RESPIRATION_FIELD(right_lung_sound_volume, FIELD_INT, CHG_RESP_RIGHT_VOLUME ),
+	RESPIRATION_FIELD(right_lung_sound_mute, FIELD_INT, CHG_RESP_RIGHT_VOLUME ),
+	RESPIRATION_FIELD(left_lung_sound, FIELD_STRING, CHG_RESP_LEFT_SOUND ),
+	RESPIRATION_FIELD(right_lung_sound, FIELD_STRING, CHG_RESP_RIGHT_SOUND ),
+	RESPIRATION_FIELD(rate, FIELD_INT, CHG_RESP_RATE ),
+	RESPIRATION_FIELD(awRR, FIELD_INT, CHG_RESP_AWRR ),
+	RESPIRATION_FIELD(chest_movement, FIELD_INT, CHG_RESP_CHEST_MOVEMENT ),
+	{ NULL, 0, 0, 0, 0 }
+};
+
+static struct parseTable cardiacTable = { "Cardiac", cardiacFields, { 0 }, 0 };
+static struct parseTable respirationTable = { "Respiration", respirationFields, { 0 }, 0 };
+static pthread_once_t parseOnce = PTHREAD_ONCE_INIT;
+
+// FNV-1a
+static unsigned int
+parseHash(const char *name )
+{
+	unsigned int hash = 2166136261u;
+
+	while ( *name )
 	{
-		if ( int_val != card->bps_sys )
-		{
-			if ( debug )
-			{
-				printf("Cardiac bps_sys: %d\n", int_val );
-			}
-			card->bps_sys = int_val;
-		}
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619u;
 	}
-	else if ( strcmp(elem, ("bps_dia" ) ) == 0 )
+	return ( hash );
+}
+
+static void
+parseTableInit(struct parseTable *table )
+{
+	unsigned int slot;
+	int i;
+
+	for ( i = 0 ; table->fields[i].name ; i++ )
 	{
-		if ( int_val != card->bps_dia )
+		slot = parseHash(table->fields[i].name ) & ( PARSE_HASH_SIZE - 1 );
+		while ( table->index[slot] )
 		{
-			if ( debug )
-			{
-				printf("Cardiac bps_dia: %d\n", int_val );
-			}
-			card->bps_dia = int_val;
+			slot = ( slot + 1 ) & ( PARSE_HASH_SIZE - 1 );
 		}
+		table->index[slot] = i + 1;
 	}
-	else if ( strcmp(elem, ("nibp_rate" ) ) == 0 )
+}
+
+static void
+parseInit(void )
+{
+	parseTableInit(&cardiacTable );
+	parseTableInit(&respirationTable );
+}
+
+static struct parseField *
+parseLookup(struct parseTable *table, const char *name )
+{
+	unsigned int slot;
+	struct parseField *field;
+
+	// Every time: pthread_once() also orders the reads of the index after its setup
+	pthread_once(&parseOnce, parseInit );
+	slot = parseHash(name ) & ( PARSE_HASH_SIZE - 1 );
+	while ( table->index[slot] )
 	{
-		if ( int_val != card->nibp_rate )
+		field = &table->fields[table->index[slot] - 1];
+		if ( strcmp(field->name, name ) == 0 )
 		{
-			if ( debug )
-			{
-				printf("Cardiac nibp_rate: %d\n", int_val );
-			}
-			card->nibp_rate = int_val;
+			return ( field );
 		}
+		slot = ( slot + 1 ) & ( PARSE_HASH_SIZE - 1 );
 	}
-	else if ( strcmp(elem, "nibp_read" ) == 0 )
+	return ( NULL );
+}
+
+static int
+pulseStrength(const char *value )
+{
+	if ( strcmp(value, "none" ) == 0 )
 	{
-		if ( int_val != card->nibp_read )
-		{
-			if ( debug )
-			{
-				printf("Cardiac nibp_read: %d\n", int_val );
-			}
-			card->nibp_read = int_val;
-		}
+		return ( 0 );
 	}
-	else if ( strcmp(elem, "nibp_freq" ) == 0 )
+	else if ( strcmp(value, "weak" ) == 0 )
 	{
-		if ( int_val != card->nibp_freq )
-		{
-			if ( debug )
-			{
-				printf("Cardiac nibp_freq: %d\n", int_val );
-			}
-			card->nibp_freq = int_val;
-		}
+		return ( 1 );
 	}
-	
-	
-	else if ( strcmp(elem, ("heart_sound_volume" ) ) == 0 )
+	else if ( strcmp(value, "medium" ) == 0 )
 	{
-		if ( int_val != card->heart_sound_volume )
-		{
-			if ( debug )
-			{
-				printf("Cardiac heart_sound_volume: %d\n", int_val );
-			}
-			card->heart_sound_volume = int_val;
-		}
+		return ( 2 );
 	}
-	
-	else if ( strcmp(elem, ("heart_sound_mute" ) ) == 0 )
+	else if ( strcmp(value, "strong" ) == 0 )
 	{
-		if ( int_val != card->heart_sound_mute )
-		{
-			if ( debug )
-			{
-				printf("Cardiac heart_sound_mute: %d\n", int_val );
-			}
-			card->heart_sound_mute = int_val;
-		}
-		card->heart_sound_mute = atoi(value );
+		return ( 3 );
 	}
-	else if ( strcmp(elem, ("heart_sound" ) ) == 0 )
+	return ( -1 );
+}
+
+/*
+ * Set one field from the status. Returns 0 on success, 1 for an unknown field and
+ * 3 for an unrecognized pulse strength.
+*/
+static int
+parseField(struct parseTable *table, const char *elem, const char *value, void *base )
+{
+	struct parseField *field;
+	char *str;
+	int *ip;
+	int int_val;
+
+	field = parseLookup(table, elem );
+	if ( ! field )
 	{
-		if ( strcmp(value, card->heart_sound ) != 0 )
-		{
-			if ( debug )
-			{
-				printf("Cardiac heart_sound: %s\n", value );
-			}
-		}
-		sprintf(card->heart_sound, "%s", value );
+		return ( 1 );
 	}
-	else if ( strcmp(elem, ("right_dorsal_pulse_strength" ) ) == 0 )
+	switch ( field->type )
 	{
-		if ( (strcmp(value, "none" ) ) == 0 )
-		{
-			pulse_val = 0;
-		}
-		else if ( (strcmp(value, "weak" ) ) == 0 )
-		{
-			pulse_val = 1;
-		}
-		else if ( (strcmp(value, "medium" ) ) == 0 )
-		{
-			pulse_val = 2;
-		}
-		else if ( (strcmp(value, "strong" ) ) == 0 )
-		{
-			pulse_val = 3;
-		}
-		else
-		{
-			sts = 3;
-		}
-		if ( ( sts != 3 ) && ( card->right_dorsal_pulse_strength != pulse_val ) )
-		{
-			if ( debug )
+		case FIELD_STRING:
+			str = (char *)base + field->offset;
+			if ( strcmp(value, str ) != 0 )
 			{
-				printf("Cardiac right_dorsal_pulse_strength: %d\n", pulse_val );
+				if ( debug )
+				{
+					printf("%s %s: %s (old %s)\n", table->section, field->name, value, str );
+				}
+				snprintf(str, field->size, "%s", value );
+				__sync_fetch_and_or(&table->changes, field->change );
 			}
-			card->right_dorsal_pulse_strength = pulse_val;
-		}
-	}
-	else if ( strcmp(elem, ("left_dorsal_pulse_strength" ) ) == 0 )
-	{
-		if ( (strcmp(value, "none" ) ) == 0 )
-		{
-			pulse_val = 0;
-		}
-		else if ( (strcmp(value, "weak" ) ) == 0 )
-		{
-			pulse_val = 1;
-		}
-		else if ( (strcmp(value, "medium" ) ) == 0 )
-		{
-			pulse_val = 2;
-		}
-		else if ( (strcmp(value, "strong" ) ) == 0 )
-		{
-			pulse_val = 3;
-		}
-		else
-		{
-			sts = 3;
-		}
-		if ( ( sts != 3 ) && ( card->left_dorsal_pulse_strength != pulse_val ) )
-		{
-			if ( debug )
+			break;
+
+		case FIELD_INT:
+		case FIELD_PULSE:
+			if ( field->type == FIELD_PULSE )
 			{
-				printf("Cardiac left_dorsal_pulse_strength: %d\n", pulse_val );
+				int_val = pulseStrength(value );
+				if ( int_val < 0 )
+				{
+					return ( 3 );
+				}
 			}
-			card->left_dorsal_pulse_strength = pulse_val;
-		}
-	}
-	else if ( strcmp(elem, ("right_femoral_pulse_strength" ) ) == 0 )
-	{
-		if ( (strcmp(value, "none" ) ) == 0 )
-		{
-			pulse_val = 0;
-		}
-		else if ( (strcmp(value, "weak" ) ) == 0 )
-		{
-			pulse_val = 1;
-		}
-		else if ( (strcmp(value, "medium" ) ) == 0 )
-		{
-			pulse_val = 2;
-		}
-		else if ( (strcmp(value, "strong" ) ) == 0 )
-		{
-			pulse_val = 3;
-		}
-		else
-		{
-			sts = 3;
-		}
-		if ( ( sts != 3 ) && ( card->right_femoral_pulse_strength != pulse_val ) )
-		{
-			if ( debug )
+			else
 			{
-				printf("Cardiac right_femoral_pulse_strength: %d\n", pulse_val );
+				int_val = atoi(value );
 			}
-			card->right_femoral_pulse_strength = pulse_val;
-		}
-	}
-	else if ( strcmp(elem, ("left_femoral_pulse_strength" ) ) == 0 )
-	{
-		if ( (strcmp(value, "none" ) ) == 0 )
-		{
-			pulse_val = 0;
-		}
-		else if ( (strcmp(value, "weak" ) ) == 0 )
-		{
-			pulse_val = 1;
-		}
-		else if ( (strcmp(value, "medium" ) ) == 0 )
-		{
-			pulse_val = 2;
-		}
-		else if ( (strcmp(value, "strong" ) ) == 0 )
-		{
-			pulse_val = 3;
-		}
-		else
-		{
-			sts = 3;
-		}
-		if ( ( sts != 3 ) && ( card->left_femoral_pulse_strength != pulse_val ) )
-		{
-			if ( debug )
+			ip = (int *)( (char *)base + field->offset );
+			if ( int_val != *ip )
 			{
-				printf("Cardiac left_femoral_pulse_strength: %d\n", pulse_val );
+				if ( debug )
+				{
+					printf("%s %s: %d\n", table->section, field->name, int_val );
+				}
+				*ip = int_val;
+				__sync_fetch_and_or(&table->changes, field->change );
 			}
-			card->left_femoral_pulse_strength = pulse_val;
-		}
+			break;
 	}
-	else
+	return ( 0 );
+}
+
+int
+cardiac_parse(const char *elem,  const char *value, struct cardiac *card )
+{
+	if ( ( ! elem ) || ( ! value) || ( ! card ) )
 	{
-		sts = 1;
+		return ( -11 );
 	}
-	return ( sts );
+	return ( parseField(&cardiacTable, elem, value, card ) );
 }
 
 int
 respiration_parse(const char *elem,  const char *value, struct respiration *resp )
 {
-	int sts = 0;
-	int int_val = atoi(value );
-	
 	if ( ( ! elem ) || ( ! value) || ( ! resp ) )
 	{
 		return ( -12 );
 	}
-	if ( strcmp(elem, "inhalation_duration" ) == 0 )
-	{
-		if ( int_val != resp->inhalation_duration )
-		{
-			if ( debug )
-			{
-				printf("Respiration inhalation_duration: %d\n", int_val );
-			}
-			resp->inhalation_duration = int_val;
-		}
-	}
-	else if ( strcmp(elem, "exhalation_duration" ) == 0 )
-	{
-		if ( int_val != resp->exhalation_duration )
-		{
-			if ( debug )
-			{
-				printf("Respiration exhalation_duration: %d\n", int_val );
-			}
-		}
-		resp->exhalation_duration = int_val;
-	}
-	
-	else if ( strcmp(elem, "left_lung_sound_volume" ) == 0 )
-	{
-		if ( int_val != resp->left_lung_sound_volume )
-		{
-			if ( debug )
-			{
-				printf("Respiration left_lung_sound_volume: %d\n", int_val );
-			}
-		}
-		resp->left_lung_sound_volume = int_val;
-	}
-	
-	else if ( strcmp(elem, "left_lung_sound_mute" ) == 0 )
-	{
-		if ( int_val != resp->left_lung_sound_mute )
-		{
-			if ( debug )
-			{
-				printf("Respiration left_lung_sound_mute: %d\n", int_val );
-			}
-			resp->left_lung_sound_mute = int_val;
-		}
-	}
-	
-	else if ( strcmp(elem, "right_lung_sound_volume" ) == 0 )
-	{
-		if ( int_val != resp->right_lung_sound_volume )
-		{
-			if ( debug )
-			{
-				printf("Respiration right_lung_sound_volume: %d\n", int_val );
-			}
-			resp->right_lung_sound_volume = int_val;
-		}
-	}
-	
-	else if ( strcmp(elem, "right_lung_sound_mute" ) == 0 )
-	{
-		if ( int_val != resp->right_lung_sound_mute )
-		{
-			if ( debug )
-			{
-				printf("Respiration right_lung_sound_mute: %d\n", int_val );
-			}
-			resp->right_lung_sound_mute = int_val;
-		}
-	}
-	else if ( strcmp(elem, "left_lung_sound" ) == 0 )
-	{
-		if ( strcmp(value, resp->left_lung_sound ) != 0 )
-		{
-			if ( debug )
-			{
-				printf("Respiration left_lung_sound: %s\n", value );
-			}
-			sprintf(resp->left_lung_sound, "%s", value );
-		}
-	}
-	else if ( strcmp(elem, "right_lung_sound" ) == 0 )
-	{
-		if ( strcmp(value, resp->right_lung_sound ) != 0 )
-		{
-			if ( debug )
-			{
-				printf("Respiration right_lung_sound: %s\n", value );
-			}
-			sprintf(resp->right_lung_sound, "%s", value );
-		}
-	}
-	else if ( strcmp(elem, "rate" ) == 0 )
-	{
-		if ( int_val != resp->rate )
-		{
-			if ( debug )
-			{
-				printf("Respiration rate: %d\n", int_val );
-			}
-			resp->rate = int_val;
-		}
-	}
-	else if ( strcmp(elem, "awRR" ) == 0 )
-	{
-		if ( int_val != resp->awRR )
-		{
-			if ( debug )
-			{
-				printf("Respiration awRR: %d\n", int_val );
-			}
-			resp->awRR = int_val;
-		}
-	}
-	else if ( strcmp(elem, "chest_movement" ) == 0 )
+	return ( parseField(&respirationTable, elem, value, resp ) );
+}
+
+/*
+ * Return the CHG_* bits of the fields changed by cardiac_parse or respiration_parse
+ * since the last call, and clear them. section is SHM_SECTION_CARDIAC or
+ * SHM_SECTION_RESPIRATION.
+*/
+unsigned int
+parse_changes(int section )
+{
+	if ( section == SHM_SECTION_CARDIAC )
 	{
-		if ( int_val != resp->chest_movement )
-		{
-			if ( debug )
-			{
-				printf("Respiration chest_movement: %d\n", int_val );
-			}
-			resp->chest_movement = int_val;
-		}
+		return ( __sync_fetch_and_and(&cardiacTable.changes, 0 ) );
 	}
-	else
+	if ( section == SHM_SECTION_RESPIRATION )
 	{
-		sts = 1;
+		return ( __sync_fetch_and_and(&respirationTable.changes, 0 ) );
 	}
-	return ( sts );
+	return ( 0 );
 }
@@ -0,0 +1,309 @@
+/*
+ * simStat.cpp
+ *
+ * This file is part of the sim-ctl distribution (https://github.com/OpenVetSimDevelopers/sim-ctl).
+ * 
+ * Copyright (c) 2019 VetSim, Cornell University College of Veterinary Medicine Ithaca, NY
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Command line view of the sim-ctl statistics kept in shared memory: sync message
+ * arrival jitter, the sync connection counters, and the HTTP link, poll scheduler
+ * and clock sync state kept by simController. Also the window of sensor samples held
+ * in the sensor rings: the rate, and the range and mean of each value, and each
+ * daemon's loop timing, I/O rate and last error.
+ *
+ * Jitter percentiles are shown two ways: from the histogram over all beats since
+ * start (upper edge of the bin) and exactly over the recent arrivals in the log.
+ *
+ * Usage: simStat [-l] [-s] [-w seconds]
+ *		-l : List the recent sync arrivals
+ *		-s : List the samples in the sensor rings
+ *		-w : Repeat every <seconds>
+*/
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "simCtlComm.h"
+#include "simUtil.h"
+#include "shmData.h"
+
+struct shmData *shmData;
+int debug = 0;
+
+static const char *
+typeName(int type )
+{
+	switch ( type )
+	{
+		case SYNC_PULSE:		return ( "pulse" );
+		case SYNC_PULSE_VPC:	return ( "pulseVPC" );
+		case SYNC_BREATH:		return ( "breath" );
+	}
+	return ( "unknown" );
+}
+
+static int
+compareInt(const void *a, const void *b )
+{
+	return ( *(const int *)a - *(const int *)b );
+}
+
+// Exact percentile of the absolute jitter over the recent arrivals of one kind
+static int
+recentPercentile(struct syncArrival *log, int count, int breath, int pct )
+{
+	int values[SYNC_LOG_SIZE];
+	int n = 0;
+	int i;
+	
+	for ( i = 0 ; i < count ; i++ )
+	{
+		if ( log[i].jitter != SYNC_JITTER_NONE && ( log[i].type == SYNC_BREATH ) == breath )
+		{
+			values[n++] = abs(log[i].jitter );
+		}
+	}
+	if ( n == 0 )
+	{
+		return ( 0 );
+	}
+	qsort(values, n, sizeof(int), compareInt );
+	i = ( n * pct + 99 ) / 100 - 1;
+	return ( values[i < 0 ? 0 : i] );
+}
+
+static void
+showJitter(const char *name, struct syncJitter *jit, struct syncArrival *log, int count, int breath )
+{
+	int bin;
+	
+	printf("%-7s %u intervals (%u skipped), jitter p50 %d p99 %d max %d usec, recent p50 %d p99 %d usec\n",
+		name, jit->count, jit->skipped,
+		syncJitterPercentile(jit, 50 ), syncJitterPercentile(jit, 99 ), jit->maxJitter,
+		recentPercentile(log, count, breath, 50 ), recentPercentile(log, count, breath, 99 ) );
+	printf("       ");
+	for ( bin = 0 ; bin < SYNC_JITTER_BINS ; bin++ )
+	{
+		printf(" %u", jit->hist[bin] );
+	}
+	printf("\n");
+}
+
+static void
+showSensor(const char *name, struct sensorRing *ring, int list )
+{
+	struct sensorSample samples[SENSOR_RING_SIZE];
+	struct sensorRingReader reader;
+	int count;
+	int values;
+	int min[SENSOR_VALUES];
+	int max[SENSOR_VALUES];
+	long long sum[SENSOR_VALUES];
+	long long span;
+	int i;
+	int v;
+	
+	memset(&reader, 0, sizeof(reader) );
+	count = sensorRingRead(ring, &reader, samples, SENSOR_RING_SIZE );
+	values = ring->values;
+	if ( count == 0 || values <= 0 || values > SENSOR_VALUES )
+	{
+		printf("%-7s no samples\n", name );
+		return;
+	}
+	for ( v = 0 ; v < values ; v++ )
+	{
+		min[v] = max[v] = samples[0].values[v];
+		sum[v] = 0;
+	}
+	for ( i = 0 ; i < count ; i++ )
+	{
+		for ( v = 0 ; v < values ; v++ )
+		{
+			if ( samples[i].values[v] < min[v] )
+			{
+				min[v] = samples[i].values[v];
+			}
+			if ( samples[i].values[v] > max[v] )
+			{
+				max[v] = samples[i].values[v];
+			}
+			sum[v] += samples[i].values[v];
+		}
+	}
+	span = samples[count - 1].when - samples[0].when;
+	printf("%-7s %u samples, window %d of %lld ms", name, ring->count, count, span / 1000 );
+	if ( span > 0 )
+	{
+		printf(" (%.1f/s)", ( count - 1 ) * 1000000.0 / span );
+	}
+	printf(", min/mean/max");
+	for ( v = 0 ; v < values ; v++ )
+	{
+		printf(" %d/%lld/%d", min[v], sum[v] / count, max[v] );
+	}
+	printf("\n");
+	
+	if ( list )
+	{
+		for ( i = 0 ; i < count ; i++ )
+		{
+			printf("%12lld.%06lld", samples[i].when / 1000000, samples[i].when % 1000000 );
+			for ( v = 0 ; v < values ; v++ )
+			{
+				printf(" %6d", samples[i].values[v] );
+			}
+			printf("\n");
+		}
+	}
+}
+
+#define METRIC_STALE	5	// sec without a loop before a daemon is shown as stalled
+
+static void
+showMetrics(void )
+{
+	struct daemonMetrics m;
+	unsigned int age;
+	int slot;
+	
+	for ( slot = 0 ; slot < METRIC_SLOTS ; slot++ )
+	{
+		if ( ! metricsRead(slot, &m, &age ) )
+		{
+			printf("%-13s not started\n", metricsName(slot ) );
+			continue;
+		}
+		printf("%-13s pid %d, %u loops, period %u usec (max %u), busy %u (max %u)",
+			metricsName(slot ), m.pid, m.loops, m.period, m.maxPeriod, m.busy, m.maxBusy );
+		if ( m.target )
+		{
+			printf(", %u overruns of %u", m.overruns, m.target );
+		}
+		printf(", io %u/s (%u), %u errors, %u major faults%s", m.ioRate, m.ioOps, m.errors,
+			m.majorFaults, m.rtMemory ? " (locked)" : "" );
+		if ( age >= METRIC_STALE )
+		{
+			printf(", STALLED %u s", age );
+		}
+		printf("\n");
+		if ( m.errors )
+		{
+			printf("              last error %d, %u s ago: %s\n", m.lastError,
+				age + m.updated - m.lastErrorAt, m.lastErrorText );
+		}
+	}
+}
+
+static void
+showStats(int list, int sensors )
+{
+	struct syncArrival log[SYNC_LOG_SIZE];
+	struct syncTiming *sync = &shmData->sync;
+	int count;
+	int i;
+	
+	count = syncLogRead(sync, log );
+	
+	printf("sync:   %u messages, %u reads, %u coalesced, %u malformed, %u reconnects\n",
+		sync->comm.messages, sync->comm.reads, sync->comm.coalesced, sync->comm.malformed,
+		sync->comm.reconnects );
+	printf("link:   %s, %u outages (%u timed out), %u attempts, outage last %u max %u total %u ms\n",
+		sync->comm.up ? "up" : "DOWN", sync->comm.outages, sync->comm.timeouts, sync->comm.attempts,
+		sync->comm.lastOutage, sync->comm.maxOutage, sync->comm.totalOutage );
+	if ( sync->comm.binary )
+	{
+		printf("frames: %u lost, latency %d usec, avg %d max %d\n",
+			sync->comm.lost, sync->comm.latency, sync->comm.avgLatency, sync->comm.maxLatency );
+	}
+	showJitter("beat", &sync->beat, log, count, 0 );
+	showJitter("breath", &sync->breath, log, count, 1 );
+	printf("http:   %u requests, %u failed, latency avg %u max %u usec\n",
+		shmData->http.requests, shmData->http.failures, shmData->http.avgLatency, shmData->http.maxLatency );
+	printf("sched:  read every %u ms, %u reads (%u changed), %u writes (%u urgent), backoff %u ms\n",
+		shmData->sched.readInterval, shmData->sched.reads, shmData->sched.readsChanged,
+		shmData->sched.writes, shmData->sched.urgentWrites, shmData->sched.backoff );
+	printf("clock:  offset %lld usec +/- %u, rtt %u usec, %u syncs\n",
+		shmData->timeSync.offset, shmData->timeSync.error, shmData->timeSync.rtt, shmData->timeSync.syncs );
+	showSensor("pulse", &shmData->sensors.pulse, sensors );
+	showSensor("breath", &shmData->sensors.breath, sensors );
+	showSensor("cpr", &shmData->sensors.cpr, sensors );
+	showMetrics();
+	
+	if ( list )
+	{
+		for ( i = 0 ; i < count ; i++ )
+		{
+			printf("%12lld.%06lld %-8s", log[i].when / 1000000, log[i].when % 1000000,
+				typeName(log[i].type ) );
+			if ( log[i].jitter != SYNC_JITTER_NONE )
+			{
+				printf(" %+d", log[i].jitter );
+			}
+			printf("\n");
+		}
+	}
+}
+
+int
+main(int argc, char *argv[] )
+{
+	int c;
+	int list = 0;
+	int sensors = 0;
+	int interval = 0;
+	
+	while (( c = getopt(argc, argv, "lsw:h" ) ) != -1 )
+	{
+		switch ( c )
+		{
+			case 'l':
+				list = 1;
+				break;
+			case 's':
+				sensors = 1;
+				break;
+			case 'w':
+				interval = atoi(optarg );
+				break;
+			case 'h':
+			default:
+				printf("Usage: %s [-l] [-s] [-w seconds]\n", argv[0] );
+				printf("\t-l : List the recent sync arrivals\n" );
+				printf("\t-s : List the samples in the sensor rings\n" );
+				printf("\t-w : Repeat every <seconds>\n" );
+				exit ( 0 );
+		}
+	}
+	if ( initSHM(SHM_OPEN ) < 0 )
+	{
+		printf("initSHM failed\n" );
+		exit ( -1 );
+	}
+	while ( 1 )
+	{
+		showStats(list, sensors );
+		if ( interval <= 0 )
+		{
+			break;
+		}
+		sleep(interval );
+		printf("\n");
+	}
+	return ( 0 );
+}
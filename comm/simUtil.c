@@ -37,9 +37,16 @@
 #include <termios.h>
 #include <syslog.h>
 #include <signal.h>
+#include <sched.h>
 #include <execinfo.h>
 #include <string.h>
 #include <libgen.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/resource.h>
 
 #include "simUtil.h"
 #include "shmData.h"
@@ -252,69 +259,1323 @@ catchFaults(void )
 int shmFile;
 extern struct shmData *shmData;
 
+#define SHM_MEMBER(member )				{ offsetof(struct shmData, member ), sizeof(((struct shmData *)0)->member ) }
+#define SHM_SPAN(first, last )			{ offsetof(struct shmData, first ), \
+										  offsetof(struct shmData, last ) + sizeof(((struct shmData *)0)->last ) - offsetof(struct shmData, first ) }
+
+// The layout this program was built with, by SHM_REGION_*
+static const struct shmRegion shmLayout[SHM_REGIONS] =
+{
+	SHM_SPAN(i2c_sema, simMgrIPAddr ),
+	SHM_MEMBER(cardiac ),
+	SHM_MEMBER(respiration ),
+	SHM_MEMBER(auscultation ),
+	SHM_MEMBER(pulse ),
+	SHM_MEMBER(cpr ),
+	SHM_MEMBER(defibrillation ),
+	SHM_SPAN(manual_breath_ain, manual_breath_baseline ),
+	SHM_SPAN(http, sync ),
+	SHM_SPAN(change, seqlockReaders ),
+	SHM_MEMBER(sensors ),
+	SHM_MEMBER(metrics ),
+};
+
+static const char *shmRegionNames[SHM_REGIONS] =
+{
+	"config", "cardiac", "respiration", "auscultation", "pulse", "cpr",
+	"defibrillation", "breath", "stats", "change", "sensors", "metrics"
+};
+
+/*
+ * Function: shmLayoutCheck
+ *
+ * Compare a shared memory header with the layout this program was built with
+ *
+ * Parameters: header - the header of the segment
+ *             segSize - size of the segment, bytes
+ *             regions - mask of the regions to check, (1 << SHM_REGION_*)
+ *             why - set to a description of the first difference, if any
+ *
+ * Returns: 0 if the regions match, -1 if not
+ */
+static int
+shmLayoutCheck(struct shmHeader *header, size_t segSize, unsigned int regions, char *why )
+{
+	int i;
+	
+	if ( header->magic != SHM_MAGIC )
+	{
+		sprintf(why, "no header (magic %08x)", header->magic );
+		return ( -1 );
+	}
+	if ( header->version != SHM_VERSION )
+	{
+		sprintf(why, "header version %u, expected %u", header->version, SHM_VERSION );
+		return ( -1 );
+	}
+	if ( header->size > segSize || header->regionCount > SHM_REGIONS_MAX )
+	{
+		sprintf(why, "bad header: size %u in a segment of %u, %u regions",
+			header->size, (unsigned int)segSize, header->regionCount );
+		return ( -1 );
+	}
+	for ( i = 0 ; i < SHM_REGIONS ; i++ )
+	{
+		if ( ! ( regions & ( 1 << i ) ) )
+		{
+			continue;
+		}
+		if ( i >= (int)header->regionCount )
+		{
+			sprintf(why, "region %s missing", shmRegionNames[i] );
+			return ( -1 );
+		}
+		if ( header->regions[i].offset != shmLayout[i].offset || header->regions[i].size != shmLayout[i].size )
+		{
+			sprintf(why, "region %s at %u size %u, expected at %u size %u", shmRegionNames[i],
+				header->regions[i].offset, header->regions[i].size, shmLayout[i].offset, shmLayout[i].size );
+			return ( -1 );
+		}
+	}
+	return ( 0 );
+}
+
+/*
+ * Function: initSHM
+ *
+ * Map shmData, checking all of its regions (see initSHMRegions)
+ *
+ * Parameters: create - SHM_CREATE or SHM_OPEN
+ *
+ * Returns: 0 on success, negative on failure
+ */
+int
+initSHM(int create )
+{
+	return ( initSHMRegions(create, SHM_REGIONS_ALL ) );
+}
+
+/*
+ * Function: initSHMRegions
+ *
+ * Map shmData. With SHM_CREATE (simController), an existing segment is kept if its
+ * layout matches this program's, and replaced if not. With SHM_OPEN, the segment's
+ * header must match this program's layout in the regions given; other regions may
+ * differ, and must not be used.
+ *
+ * Parameters: create - SHM_CREATE or SHM_OPEN
+ *             regions - mask of the regions used, (1 << SHM_REGION_*). Ignored for SHM_CREATE.
+ *
+ * Returns: 0 on success, -3 if the segment cannot be opened, -4 if it cannot be
+ *          mapped, -5 if its layout does not match
+ */
+int
+initSHMRegions(int create, unsigned int regions )
+{
+	void *space;
+	struct shmHeader header;
+	struct stat sb;
+	size_t mmapSize;
+	int pageSize;
+	int allocSize;
+	int i;
+	char why[256];
+	char msg[512];
+	
+	mmapSize = sizeof(struct shmData );
+	// Round up size to integral number of pages
+	pageSize = getpagesize();
+	allocSize = (mmapSize+pageSize-1) & ~(pageSize-1);
+
+	// Open the Shared Memory space
+	if ( create )
+	{
+		shmFile = shm_open(SHM_NAME, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR );
+	}
+	else
+	{
+		shmFile = shm_open(SHM_NAME, O_RDWR, 0 );
+	}
+	if ( shmFile < 0 )
+	{
+		fprintf(stderr, "Failed to open %s. Rval is %d\n", SHM_NAME, shmFile );
+		perror("shm_open" );
+		return ( -3 );
+	}
+	if ( fstat(shmFile, &sb ) < 0 )
+	{
+		perror("fstat" );
+		return ( -3 );
+	}
+	memset(&header, 0, sizeof(header) );
+	if ( sb.st_size >= (off_t)sizeof(header) )
+	{
+		if ( pread(shmFile, &header, sizeof(header), 0 ) != sizeof(header) )
+		{
+			memset(&header, 0, sizeof(header) );
+		}
+	}
+	
+	if ( create )
+	{
+		if ( sb.st_size > 0 &&
+			 ( header.size != sizeof(struct shmData ) ||
+			   shmLayoutCheck(&header, sb.st_size, SHM_REGIONS_ALL, why ) != 0 ) )
+		{
+			// A different layout. The daemons still attached keep the old segment until restarted.
+			if ( header.size != sizeof(struct shmData ) && header.magic == SHM_MAGIC )
+			{
+				sprintf(why, "size %u, expected %u", header.size, (unsigned int)sizeof(struct shmData ) );
+			}
+			sprintf(msg, "Replacing %s: %s. Restart the other daemons.", SHM_NAME, why );
+			log_message("", msg );
+			close(shmFile );
+			shm_unlink(SHM_NAME );
+			shmFile = shm_open(SHM_NAME, O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR );
+			if ( shmFile < 0 )
+			{
+				perror("shm_open" );
+				return ( -3 );
+			}
+			sb.st_size = 0;
+		}
+		// Set file size
+		if ( ftruncate(shmFile, allocSize) == -1)
+		{
+			perror("ftruncate" );
+			
+			return ( -3 );
+		}
+	}
+	else
+	{
+		if ( shmLayoutCheck(&header, sb.st_size, regions, why ) != 0 )
+		{
+			sprintf(msg, "%s does not match this build: %s", SHM_NAME, why );
+			log_message("", msg );
+			if ( ! debug )
+			{
+				fprintf(stderr, "%s\n", msg );
+			}
+			return ( -5 );
+		}
+		// Only the creator's size is mapped. The regions checked are within it.
+		mmapSize = header.size;
+	}
+	// In real-time memory mode, fault the whole segment in now rather than on first use
+	space = mmap((caddr_t)0,
+				mmapSize, 
+				PROT_READ | PROT_WRITE,
+				MAP_SHARED | ( rtMemoryRequested() ? MAP_POPULATE : 0 ),
+				shmFile,
+				0 );
+	if ( space == MAP_FAILED )
+	{
+		perror("mmap" );
+		return ( -4 );
+	}
+	
+	shmData = (struct shmData *)space;
+	
+	if ( create )
+	{
+		if ( sb.st_size == 0 )
+		{
+			// New segment. The header is written last, so no reader sees half of it.
+			shmData->header.version = SHM_VERSION;
+			shmData->header.size = sizeof(struct shmData );
+			shmData->header.regionCount = SHM_REGIONS;
+			for ( i = 0 ; i < SHM_REGIONS ; i++ )
+			{
+				shmData->header.regions[i] = shmLayout[i];
+			}
+			__sync_synchronize();
+			shmData->header.magic = SHM_MAGIC;
+		}
+		else
+		{
+			sprintf(msg, "Attached to the existing %s", SHM_NAME );
+			log_message("", msg );
+		}
+		shmData->header.creates++;
+	}
+	return ( 0 );
+}
+
+/*
+ * Function: shmChangePublish
+ *
+ * Record a change to one section of shmData. Call after the new values have been
+ * stored. The mask is set before the count is advanced, so a reader that sees the
+ * new count also sees the mask. Wakes any readers blocked in shmChangeWait().
+ *
+ * Parameters: section - SHM_SECTION_*
+ *             mask - CHG_* bits of the fields changed
+ *
+ * Returns: none
+ */
+void
+shmChangePublish(int section, unsigned int mask )
+{
+	struct shmChange *chg = &shmData->change;
+	struct shmSeqlock *lock;
+	
+	if ( section < 0 || section >= SHM_SECTIONS || mask == 0 )
+	{
+		return;
+	}
+	lock = &shmData->seqlock[section];
+	lock->mask = mask;
+	__sync_synchronize();
+	__sync_fetch_and_add(&lock->count, 1 );
+	__sync_fetch_and_add(&chg->generation, 1 );
+	if ( chg->waiters )
+	{
+		syscall(SYS_futex, &chg->generation, FUTEX_WAKE, INT_MAX, NULL, NULL, 0 );
+	}
+}
+
+/*
+ * Function: shmChangeCheck
+ *
+ * Find what has changed since the reader's last check. When nothing has been
+ * published, this is a single compare.
+ *
+ * If a section was published more than once since the last check, or was published
+ * again while being checked, the intermediate masks are lost and all of its fields
+ * are reported as changed. The first check on a zeroed reader also reports all.
+ *
+ * Parameters: reader - the caller's reader state
+ *             masks - array of SHM_SECTIONS, set to the changed fields of each section
+ *
+ * Returns: a mask of the sections changed, (1 << SHM_SECTION_*)
+ */
+unsigned int
+shmChangeCheck(struct shmChangeReader *reader, unsigned int *masks )
+{
+	struct shmChange *chg = &shmData->change;
+	struct shmSeqlock *lock;
+	unsigned int generation;
+	unsigned int count;
+	unsigned int mask;
+	unsigned int sections = 0;
+	int i;
+	
+	generation = chg->generation;
+	__sync_synchronize();
+	if ( reader->primed && generation == reader->generation )
+	{
+		memset(masks, 0, sizeof(unsigned int) * SHM_SECTIONS );
+		return ( 0 );
+	}
+	for ( i = 0 ; i < SHM_SECTIONS ; i++ )
+	{
+		lock = &shmData->seqlock[i];
+		count = lock->count;
+		__sync_synchronize();
+		mask = lock->mask;
+		__sync_synchronize();
+		if ( ! reader->primed || lock->count != count || count - reader->count[i] > 1 )
+		{
+			masks[i] = CHG_ALL;
+		}
+		else if ( count != reader->count[i] )
+		{
+			masks[i] = mask;
+		}
+		else
+		{
+			masks[i] = 0;
+		}
+		if ( masks[i] )
+		{
+			sections |= ( 1 << i );
+		}
+		reader->count[i] = count;
+	}
+	reader->generation = generation;
+	reader->primed = 1;
+	return ( sections );
+}
+
+/*
+ * Function: shmChangeWait
+ *
+ * Block until one of the given sections changes, then check as shmChangeCheck()
+ * does. Returns at once if one has changed since the reader's last check, or if the
+ * reader has not checked before. Changes to other sections do not end the wait, but
+ * they are reported if there is also a change to one of the given sections.
+ *
+ * Parameters: reader - the caller's reader state
+ *             sections - mask of the sections to wait for, (1 << SHM_SECTION_*)
+ *             masks - array of SHM_SECTIONS, set to the changed fields of each section
+ *             timeout - msec, or -1 to wait indefinitely
+ *
+ * Returns: a mask of the sections changed, or 0 on timeout
+ */
+unsigned int
+shmChangeWait(struct shmChangeReader *reader, unsigned int sections, unsigned int *masks, int timeout )
+{
+	struct shmChange *chg = &shmData->change;
+	struct timespec deadline;
+	unsigned int generation;
+	int sts;
+	int i;
+	
+	if ( timeout >= 0 )
+	{
+		clock_gettime(CLOCK_MONOTONIC, &deadline );
+		deadline.tv_sec += timeout / 1000;
+		deadline.tv_nsec += ( timeout % 1000 ) * 1000000;
+		if ( deadline.tv_nsec >= 1000000000 )
+		{
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+	}
+	while ( 1 )
+	{
+		generation = chg->generation;
+		__sync_synchronize();
+		if ( ! reader->primed )
+		{
+			return ( shmChangeCheck(reader, masks ) );
+		}
+		if ( generation != reader->generation )
+		{
+			for ( i = 0 ; i < SHM_SECTIONS ; i++ )
+			{
+				if ( ( sections & ( 1 << i ) ) && shmData->seqlock[i].count != reader->count[i] )
+				{
+					return ( shmChangeCheck(reader, masks ) );
+				}
+			}
+		}
+		
+		// Sleep until the next publish. The deadline is absolute, so publishes to other
+		// sections do not extend the wait.
+		__sync_fetch_and_add(&chg->waiters, 1 );
+		sts = syscall(SYS_futex, &chg->generation, FUTEX_WAIT_BITSET, generation,
+					  ( timeout >= 0 ) ? &deadline : NULL, NULL, FUTEX_BITSET_MATCH_ANY );
+		__sync_fetch_and_sub(&chg->waiters, 1 );
+		if ( sts < 0 && errno == ETIMEDOUT )
+		{
+			memset(masks, 0, sizeof(unsigned int) * SHM_SECTIONS );
+			return ( 0 );
+		}
+	}
+}
+
+static long long
+shmMsec(void )
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts );
+	return ( (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000 );
+}
+
+/*
+ * Function: shmWriterGone
+ *
+ * Check whether a section's writer still exists
+ *
+ * Parameters: pid - the writer recorded in the section's seqlock
+ *
+ * Returns: non-zero if it does not
+ */
+static int
+shmWriterGone(int pid )
+{
+	return ( pid > 0 && kill(pid, 0 ) < 0 && errno == ESRCH );
+}
+
+/*
+ * Function: shmAbandon
+ *
+ * Record a section's write as abandoned. Logged once per write.
+ *
+ * Parameters: section - SHM_SECTION_*
+ *             seq - the section's seq
+ *             writer - pid of the writer
+ *
+ * Returns: none
+ */
+static void
+shmAbandon(int section, unsigned int seq, int writer )
+{
+	struct shmSeqlockReaders *readers = &shmData->seqlockReaders[section];
+	unsigned int stale = *(volatile unsigned int *)&readers->stale;
+	char msg[128];
+	
+	if ( stale != seq && __sync_bool_compare_and_swap(&readers->stale, stale, seq ) )
+	{
+		__sync_fetch_and_add(&readers->abandoned, 1 );
+		sprintf(msg, "shmData section %d: write by pid %d abandoned (seq %u), continuing", section, writer, seq );
+		log_message("", msg );
+	}
+}
+
+/*
+ * Function: shmWriteWait
+ *
+ * Wait for a write in progress on a section to finish. A write whose writer has
+ * exited, checked after SHM_WRITER_STALE_MS, or that is still in progress after
+ * SHM_WRITER_HUNG_MS, is abandoned, and later callers do not wait for it.
+ *
+ * Parameters: section - SHM_SECTION_*
+ *
+ * Returns: the section's seq: even, or odd if the write was abandoned
+ */
+static unsigned int
+shmWriteWait(int section )
+{
+	struct shmSeqlock *lock = &shmData->seqlock[section];
+	volatile unsigned int *seqp = &lock->seq;
+	unsigned int seq;
+	int writer;
+	long long start = 0;
+	long long waited;
+	
+	while ( ( seq = *seqp ) & 1 )
+	{
+		if ( seq == *(volatile unsigned int *)&shmData->seqlockReaders[section].stale )
+		{
+			break;
+		}
+		if ( start == 0 )
+		{
+			start = shmMsec();
+		}
+		else if ( ( waited = shmMsec() - start ) >= SHM_WRITER_STALE_MS )
+		{
+			writer = *(volatile int *)&lock->writer;
+			if ( waited >= SHM_WRITER_HUNG_MS || shmWriterGone(writer ) )
+			{
+				shmAbandon(section, seq, writer );
+				break;
+			}
+		}
+		sched_yield();
+	}
+	return ( seq );
+}
+
+// This process's pid, for the seqlock's writer. Cleared in a forked child.
+static int shmPid = 0;
+static int shmForkHandler = 0;
+
+static void
+shmForked(void )
+{
+	shmPid = 0;
+}
+
+/*
+ * Function: shmWriteBegin
+ *
+ * Start an update of a section. Each section has a single writer, so this never
+ * waits. If the section's seq is odd, the previous instance of the writer died
+ * in a write; it is logged and the count moves on to the next odd value, so that
+ * readers that went ahead of that write see a change. Call shmWriteEnd() when done.
+ * Do not nest.
+ *
+ * Parameters: section - SHM_SECTION_*
+ *
+ * Returns: none
+ */
+void
+shmWriteBegin(int section )
+{
+	struct shmSeqlock *lock = &shmData->seqlock[section];
+	unsigned int seq = lock->seq;
+	
+	if ( shmPid == 0 )
+	{
+		if ( ! shmForkHandler )
+		{
+			pthread_atfork(NULL, NULL, shmForked );
+			shmForkHandler = 1;
+		}
+		shmPid = getpid();
+	}
+	if ( seq & 1 )
+	{
+		shmAbandon(section, seq, lock->writer );
+		seq++;
+	}
+	lock->writer = shmPid;
+	lock->seq = seq + 1;
+	__sync_synchronize();
+}
+
+/*
+ * Function: shmWriteEnd
+ *
+ * Finish an update started by shmWriteBegin()
+ *
+ * Parameters: section - SHM_SECTION_*
+ *
+ * Returns: none
+ */
+void
+shmWriteEnd(int section )
+{
+	__sync_synchronize();
+	shmData->seqlock[section].seq++;
+}
+
+/*
+ * Function: shmReadBegin
+ *
+ * Start a read of a section. Waits out a write in progress, which is only a few
+ * stores long, unless it was abandoned (see shmWriteWait()).
+ *
+ * Parameters: section - SHM_SECTION_*
+ *
+ * Returns: the sequence to pass to shmReadRetry()
+ */
+unsigned int
+shmReadBegin(int section )
+{
+	unsigned int start;
+	
+	start = shmWriteWait(section );
+	__sync_synchronize();
+	return ( start );
+}
+
+/*
+ * Function: shmReadRetry
+ *
+ * Check a read started by shmReadBegin()
+ *
+ * Parameters: section - SHM_SECTION_*
+ *             seq - returned by shmReadBegin()
+ *
+ * Returns: non-zero if the section was written during the read, which must then
+ *          be repeated
+ */
+int
+shmReadRetry(int section, unsigned int seq )
+{
+	volatile unsigned int *now = &shmData->seqlock[section].seq;
+	
+	__sync_synchronize();
+	if ( *now != seq )
+	{
+		__sync_fetch_and_add(&shmData->seqlockReaders[section].retries, 1 );
+		return ( 1 );
+	}
+	return ( 0 );
+}
+
+/*
+ * Function: shmSnapshot
+ *
+ * Copy a whole section, consistently
+ *
+ * Parameters: section - SHM_SECTION_*
+ *             copy - a struct cardiac, respiration, auscultation, pulse or cpr, to
+ *                    match the section
+ *
+ * Returns: none
+ */
+void
+shmSnapshot(int section, void *copy )
+{
+	const void *src;
+	size_t len;
+	unsigned int seq;
+	
+	switch ( section )
+	{
+		case SHM_SECTION_CARDIAC:
+			src = &shmData->cardiac;
+			len = sizeof(struct cardiac );
+			break;
+		case SHM_SECTION_RESPIRATION:
+			src = &shmData->respiration;
+			len = sizeof(struct respiration );
+			break;
+		case SHM_SECTION_AUSCULTATION:
+			src = &shmData->auscultation;
+			len = sizeof(struct auscultation );
+			break;
+		case SHM_SECTION_PULSE:
+			src = &shmData->pulse;
+			len = sizeof(struct pulse );
+			break;
+		case SHM_SECTION_CPR:
+			src = &shmData->cpr;
+			len = sizeof(struct cpr );
+			break;
+		default:
+			return;
+	}
+	do
+	{
+		seq = shmReadBegin(section );
+		memcpy(copy, src, len );
+	} while ( shmReadRetry(section, seq ) );
+}
+
+/*
+ * Function: syncJitterBin
+ *
+ * Find the histogram bin for a jitter value (see struct syncTiming in shmData.h)
+ *
+ * Parameters: jitter - usec, either sign
+ *
+ * Returns: bin index
+ */
+int
+syncJitterBin(int jitter )
+{
+	int bin = 0;
+	
+	if ( jitter < 0 )
+	{
+		jitter = -jitter;
+	}
+	while ( bin < SYNC_JITTER_BINS - 1 && jitter >= ( SYNC_JITTER_BIN0 << bin ) )
+	{
+		bin++;
+	}
+	return ( bin );
+}
+
+/*
+ * Function: syncJitterPercentile
+ *
+ * Estimate a percentile of the jitter from the histogram
+ *
+ * Parameters: jit - histogram
+ *             pct - percentile, 1 to 100
+ *
+ * Returns: usec, the upper edge of the bin holding the percentile (the largest jitter
+ *          seen for the last bin), or 0 if nothing has been measured
+ */
+int
+syncJitterPercentile(struct syncJitter *jit, int pct )
+{
+	unsigned int want;
+	unsigned int sum = 0;
+	int bin;
+	
+	if ( jit->count == 0 )
+	{
+		return ( 0 );
+	}
+	want = ( (unsigned long long)jit->count * pct + 99 ) / 100;
+	for ( bin = 0 ; bin < SYNC_JITTER_BINS - 1 ; bin++ )
+	{
+		sum += jit->hist[bin];
+		if ( sum >= want )
+		{
+			return ( SYNC_JITTER_BIN0 << bin );
+		}
+	}
+	return ( jit->maxJitter );
+}
+
+/*
+ * Function: syncLogRead
+ *
+ * Copy the recent sync arrivals from shared memory, oldest first. Entries being
+ * rewritten during the copy are left out.
+ *
+ * Parameters: timing - the shared log
+ *             out - array of SYNC_LOG_SIZE entries
+ *
+ * Returns: number of entries copied
+ */
+int
+syncLogRead(struct syncTiming *timing, struct syncArrival *out )
+{
+	unsigned int newest;
+	unsigned int first;
+	unsigned int n;
+	int count = 0;
+	struct syncArrival *entry;
+	
+	newest = timing->arrivals;
+	__sync_synchronize();
+	first = ( newest > SYNC_LOG_SIZE ) ? newest - SYNC_LOG_SIZE : 0;
+	for ( n = first ; n < newest ; n++ )
+	{
+		entry = &timing->log[n & ( SYNC_LOG_SIZE - 1 )];
+		if ( entry->seq != n + 1 )
+		{
+			continue;
+		}
+		out[count] = *entry;
+		__sync_synchronize();
+		if ( entry->seq == n + 1 )
+		{
+			count++;
+		}
+	}
+	return ( count );
+}
+
+/*
+ * Function: syncEventPost
+ *
+ * Wake the processes waiting in syncEventWait(). Call after a new arrival has been
+ * logged and counted in shmData->sync.arrivals.
+ *
+ * Parameters: none
+ *
+ * Returns: none
+ */
+void
+syncEventPost(void )
+{
+	__sync_synchronize();
+	if ( shmData->sync.waiters )
+	{
+		syscall(SYS_futex, &shmData->sync.arrivals, FUTEX_WAKE, INT_MAX, NULL, NULL, 0 );
+	}
+}
+
+/*
+ * Function: syncEventWait
+ *
+ * Wait for the next sync message posted by simController. Events are returned in
+ * order. The first call returns only events that arrive after it.
+ *
+ * Parameters: reader - the caller's reader state
+ *             event - set to the event
+ *             timeout - msec, or -1 to wait indefinitely
+ *
+ * Returns: the event's SYNC_ type, or 0 on timeout
+ */
+int
+syncEventWait(struct syncEventReader *reader, struct syncArrival *event, int timeout )
+{
+	struct syncTiming *timing = &shmData->sync;
+	struct syncArrival *entry;
+	struct timespec ts;
+	unsigned int arrivals;
+	int sts;
+	
+	if ( ! reader->primed )
+	{
+		reader->next = timing->arrivals;
+		reader->primed = 1;
+	}
+	ts.tv_sec = timeout / 1000;
+	ts.tv_nsec = ( timeout % 1000 ) * 1000000;
+	while ( 1 )
+	{
+		arrivals = timing->arrivals;
+		__sync_synchronize();
+		if ( arrivals - reader->next > SYNC_LOG_SIZE )
+		{
+			// Fell behind by more than the log holds
+			reader->lost += arrivals - reader->next - SYNC_LOG_SIZE;
+			reader->next = arrivals - SYNC_LOG_SIZE;
+		}
+		while ( reader->next != arrivals )
+		{
+			entry = &timing->log[reader->next & ( SYNC_LOG_SIZE - 1 )];
+			*event = *entry;
+			__sync_synchronize();
+			if ( event->seq == reader->next + 1 && entry->seq == reader->next + 1 )
+			{
+				reader->next++;
+				return ( event->type );
+			}
+			// Overwritten while being read
+			reader->lost++;
+			reader->next++;
+		}
+		
+		__sync_fetch_and_add(&timing->waiters, 1 );
+		sts = syscall(SYS_futex, &timing->arrivals, FUTEX_WAIT, arrivals, ( timeout >= 0 ) ? &ts : NULL, NULL, 0 );
+		__sync_fetch_and_sub(&timing->waiters, 1 );
+		if ( sts < 0 && errno == ETIMEDOUT )
+		{
+			return ( 0 );
+		}
+	}
+}
+
+/*
+ * Function: sensorRingPut
+ *
+ * Log a sensor reading, stamped with the time now. Only the ring's one writer may
+ * call this.
+ *
+ * Parameters: ring - the ring, in shmData->sensors
+ *             values - the reading
+ *             count - number of values, up to SENSOR_VALUES
+ *
+ * Returns: none
+ */
+void
+sensorRingPut(struct sensorRing *ring, int *values, int count )
+{
+	struct sensorSample *sample;
+	struct timespec ts;
+	unsigned int n = ring->count;
+	int i;
+	
+	if ( count > SENSOR_VALUES )
+	{
+		count = SENSOR_VALUES;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ts );
+	sample = &ring->ring[n & ( SENSOR_RING_SIZE - 1 )];
+	sample->seq = 0;
+	__sync_synchronize();
+	for ( i = 0 ; i < SENSOR_VALUES ; i++ )
+	{
+		sample->values[i] = ( i < count ) ? values[i] : 0;
+	}
+	sample->when = (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	ring->values = count;
+	__sync_synchronize();
+	sample->seq = n + 1;
+	__sync_synchronize();
+	ring->count = n + 1;
+}
+
+/*
+ * Function: sensorRingRead
+ *
+ * Copy the samples logged since the reader's last call, oldest first. The first
+ * call returns all the samples the ring holds. If the reader has fallen more than
+ * the ring behind, the samples missed are counted in reader->lost.
+ *
+ * Parameters: ring - the ring, in shmData->sensors
+ *             reader - the caller's reader state
+ *             out - array of max samples
+ *             max - most samples to return. Call again to get the rest.
+ *
+ * Returns: number of samples copied
+ */
 int
-initSHM(int create )
+sensorRingRead(struct sensorRing *ring, struct sensorRingReader *reader, struct sensorSample *out, int max )
 {
-	void *space;
-	int mmapSize;
-	int pageSize;
-	int allocSize;
-	int mode;
-	int perm;
+	struct sensorSample *sample;
+	unsigned int count;
+	int n = 0;
 	
-	mmapSize = sizeof(struct shmData );
-	// Round up size to integral number of pages
-	pageSize = getpagesize();
-	allocSize = (mmapSize+pageSize-1) & ~(pageSize-1);
+	count = ring->count;
+	__sync_synchronize();
+	if ( ! reader->primed )
+	{
+		reader->next = ( count > SENSOR_RING_SIZE ) ? count - SENSOR_RING_SIZE : 0;
+		reader->primed = 1;
+	}
+	if ( count - reader->next > SENSOR_RING_SIZE )
+	{
+		reader->lost += count - reader->next - SENSOR_RING_SIZE;
+		reader->next = count - SENSOR_RING_SIZE;
+	}
+	while ( reader->next != count && n < max )
+	{
+		sample = &ring->ring[reader->next & ( SENSOR_RING_SIZE - 1 )];
+		out[n] = *sample;
+		__sync_synchronize();
+		if ( out[n].seq == reader->next + 1 && sample->seq == reader->next + 1 )
+		{
+			n++;
+		}
+		else
+		{
+			// Overwritten while being read
+			reader->lost++;
+		}
+		reader->next++;
+	}
+	return ( n );
+}
 
-	// Open the Shared Memory space
-	if ( create )
+/*
+ * Daemon metrics (see struct daemonMetrics in shmData.h)
+*/
+static struct daemonMetrics *metrics = NULL;	// This daemon's slot, once metricsInit() is called
+static long long metricsLoopAt = 0;				// usec, start of the current loop
+static long long metricsRateAt = 0;				// usec, start of the current ioRate second
+static unsigned int metricsRateOps = 0;			// ioOps at metricsRateAt
+static long metricsFaultsBase = 0;				// Major faults at the end of init
+
+static long majorFaults(void );
+
+static const char *metricsNames[METRIC_SLOTS] =
+{
+	"pulse", "breathSense", "cprScan", "rfidScan", "soundSense", "simController"
+};
+
+static long long
+metricsNow(void )
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts );
+	return ( (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 );
+}
+
+static unsigned int
+metricsAverage(unsigned int avg, unsigned int value )
+{
+	if ( avg == 0 )
 	{
-		mode = O_CREAT | O_RDWR;
-		perm = S_IRUSR | S_IWUSR;
+		return ( value );
 	}
-	else
+	return ( avg - ( avg / 16 ) + ( value / 16 ) );
+}
+
+/*
+ * Function: metricsInit
+ *
+ * Claim a metrics slot for this daemon and clear it. Until this is called the
+ * other metrics functions do nothing, so code shared with the tools may call them.
+ *
+ * Parameters: slot - METRIC_PULSE, ...
+ *             target - usec, the intended loop period. 0 if the loop waits on events.
+ *
+ * Returns: none
+ */
+void
+metricsInit(int slot, unsigned int target )
+{
+	struct daemonMetrics *m;
+	long long now;
+	
+	if ( slot < 0 || slot >= METRIC_SLOTS )
 	{
-		mode = O_RDWR;
-		perm = 0;
+		return;
 	}
+	now = metricsNow();
+	m = &shmData->metrics[slot];
+	m->pid = 0;
+	__sync_synchronize();
+	memset(m, 0, sizeof(struct daemonMetrics ) );
+	m->started = now / 1000000;
+	m->updated = m->started;
+	m->target = target;
+	__sync_synchronize();
+	m->pid = getpid();
 	
-	shmFile = shm_open(SHM_NAME, mode, perm );
-	if ( shmFile < 0 )
+	metrics = m;
+	metricsLoopAt = 0;
+	metricsRateAt = now;
+	metricsRateOps = 0;
+	metricsFaultsBase = majorFaults();
+}
+
+/*
+ * Function: metricsLoopStart
+ *
+ * Call at the start of each pass of the daemon's main loop. Times the period from
+ * the previous start, and once a second works out the I/O rate and counts the major
+ * page faults since init. In real-time memory mode a new major fault is logged.
+ *
+ * Parameters: none
+ *
+ * Returns: none
+ */
+void
+metricsLoopStart(void )
+{
+	long long now;
+	unsigned int period;
+	unsigned int ops;
+	unsigned int faults;
+	char msg[128];
+	
+	if ( ! metrics )
 	{
-		fprintf(stderr, "Failed to open %s. Rval is %d\n", SHM_NAME, shmFile );
-		perror("shm_open" );
-		return ( -3 );
+		return;
 	}
-	if ( create )
+	now = metricsNow();
+	if ( metricsLoopAt )
 	{
-		// Set file size
-		if ( ftruncate(shmFile, allocSize) == -1)
+		period = (unsigned int)( now - metricsLoopAt );
+		metrics->period = metricsAverage(metrics->period, period );
+		if ( period > metrics->maxPeriod )
 		{
-			perror("ftruncate" );
-			
-			return ( -3 );
+			metrics->maxPeriod = period;
+		}
+		if ( metrics->target && period > metrics->target + metrics->target / 2 )
+		{
+			metrics->overruns++;
 		}
 	}
-	space = mmap((caddr_t)0,
-				mmapSize, 
-				PROT_READ | PROT_WRITE,
-				MAP_SHARED,
-				shmFile,
-				0 );
-	if ( space == MAP_FAILED )
+	metricsLoopAt = now;
+	if ( now - metricsRateAt >= 1000000 )
 	{
-		perror("mmap" );
-		return ( -4 );
+		ops = metrics->ioOps;
+		metrics->ioRate = (unsigned int)( (long long)( ops - metricsRateOps ) * 1000000 / ( now - metricsRateAt ) );
+		metricsRateOps = ops;
+		metricsRateAt = now;
+		
+		faults = (unsigned int)( majorFaults() - metricsFaultsBase );
+		if ( faults != metrics->majorFaults )
+		{
+			if ( rtMemory )
+			{
+				sprintf(msg, "rtMemory: %u major page faults since init", faults );
+				log_message("", msg );
+			}
+			metrics->majorFaults = faults;
+		}
 	}
+	metrics->loops++;
+	metrics->updated = now / 1000000;
+}
+
+/*
+ * Function: metricsLoopEnd
+ *
+ * Call when the pass's work is done, before the loop sleeps or waits
+ *
+ * Parameters: none
+ *
+ * Returns: none
+ */
+void
+metricsLoopEnd(void )
+{
+	unsigned int busy;
 	
-	shmData = (struct shmData *)space;
+	if ( ! metrics || ! metricsLoopAt )
+	{
+		return;
+	}
+	busy = (unsigned int)( metricsNow() - metricsLoopAt );
+	metrics->busy = metricsAverage(metrics->busy, busy );
+	if ( busy > metrics->maxBusy )
+	{
+		metrics->maxBusy = busy;
+	}
+}
+
+/*
+ * Function: metricsIo
+ *
+ * Count I/O operations. May be called from any thread.
+ *
+ * Parameters: count - operations done
+ *
+ * Returns: none
+ */
+void
+metricsIo(int count )
+{
+	if ( metrics )
+	{
+		__sync_fetch_and_add(&metrics->ioOps, count );
+	}
+}
+
+/*
+ * Function: metricsError
+ *
+ * Count an error and keep it as the last one. May be called from any thread.
+ *
+ * Parameters: code - errno, or the daemon's own status code
+ *             text - short description, cut to METRIC_ERROR_LEN - 1
+ *
+ * Returns: none
+ */
+void
+metricsError(int code, const char *text )
+{
+	if ( ! metrics )
+	{
+		return;
+	}
+	metrics->lastError = code;
+	metrics->lastErrorAt = metricsNow() / 1000000;
+	strncpy(metrics->lastErrorText, text, METRIC_ERROR_LEN - 1 );
+	metrics->lastErrorText[METRIC_ERROR_LEN - 1] = 0;
+	__sync_synchronize();
+	__sync_fetch_and_add(&metrics->errors, 1 );
+}
+
+/*
+ * Function: metricsRead
+ *
+ * Copy a daemon's metrics slot
+ *
+ * Parameters: slot - METRIC_PULSE, ...
+ *             out - the copy
+ *             age - if not NULL, seconds since the daemon's last loop
+ *
+ * Returns: 1 if copied, 0 if no daemon has claimed the slot
+ */
+int
+metricsRead(int slot, struct daemonMetrics *out, unsigned int *age )
+{
+	struct daemonMetrics *m;
+	unsigned int errors;
+	int tries;
 	
-	return ( 0 );
+	if ( slot < 0 || slot >= METRIC_SLOTS )
+	{
+		return ( 0 );
+	}
+	m = &shmData->metrics[slot];
+	for ( tries = 0 ; tries < 4 ; tries++ )
+	{
+		errors = m->errors;
+		__sync_synchronize();
+		*out = *m;
+		__sync_synchronize();
+		if ( m->errors == errors )
+		{
+			break;
+		}
+	}
+	if ( age )
+	{
+		*age = (unsigned int)( metricsNow() / 1000000 ) - out->updated;
+	}
+	return ( out->pid != 0 );
+}
+
+/*
+ * Function: metricsName
+ *
+ * Parameters: slot - METRIC_PULSE, ...
+ *
+ * Returns: the name of the daemon that owns the slot
+ */
+const char *
+metricsName(int slot )
+{
+	if ( slot < 0 || slot >= METRIC_SLOTS )
+	{
+		return ( "unknown" );
+	}
+	return ( metricsNames[slot] );
+}
+
+/*
+ * Real-time memory mode
+ *
+ * A page fault in soundSense or a sensor daemon during a class can delay a heart
+ * sound or a valve by many milliseconds, more when the page must be read back from
+ * flash. Creating RT_MEMORY_FILE turns this mode on for the daemons that call
+ * rtMemoryInit():
+ *	- initSHM() maps shmData with MAP_POPULATE
+ *	- RT_STACK_PREFAULT of the main thread's stack is touched, then all memory is
+ *	  locked with mlockall(MCL_CURRENT | MCL_FUTURE), so code, data and heap stay
+ *	  resident and later allocations are faulted in when made
+ *	- threads created with rtThreadAttr() get an RT_THREAD_STACK stack, which
+ *	  MCL_FUTURE faults in at creation. The default 8 MB would all be locked.
+ *
+ * mlockall() needs CAP_IPC_LOCK, or a big enough RLIMIT_MEMLOCK. The daemons run as
+ * root. Major faults after init are counted in the daemon's metrics slot and logged.
+*/
+int rtMemory = 0;						// Memory is locked
+static int rtRequested = -1;			// RT_MEMORY_FILE exists, -1 until checked
+static pthread_attr_t rtAttr;
+
+static long
+majorFaults(void )
+{
+	struct rusage ru;
+	
+	if ( getrusage(RUSAGE_SELF, &ru ) != 0 )
+	{
+		return ( 0 );
+	}
+	return ( ru.ru_majflt );
+}
+
+/*
+ * Function: rtMemoryRequested
+ *
+ * Returns: 1 if RT_MEMORY_FILE exists. Checked once.
+ */
+int
+rtMemoryRequested(void )
+{
+	if ( rtRequested < 0 )
+	{
+		rtRequested = ( access(RT_MEMORY_FILE, F_OK ) == 0 );
+	}
+	return ( rtRequested );
+}
+
+static void
+rtStackPrefault(void )
+{
+	char stack[RT_STACK_PREFAULT];
+	long pageSize = sysconf(_SC_PAGESIZE );
+	int i;
+	
+	for ( i = 0 ; i < RT_STACK_PREFAULT ; i += pageSize )
+	{
+		stack[i] = 0;
+	}
+	// Keeps the stores, which are otherwise dead
+	asm volatile("" : : "r"(stack) : "memory" );
+}
+
+/*
+ * Function: rtMemoryInit
+ *
+ * Enter real-time memory mode, if RT_MEMORY_FILE exists. Call after daemonize(),
+ * as the locks are not inherited by a child, and before creating threads.
+ *
+ * Parameters: none
+ *
+ * Returns: 1 if memory is locked, 0 if the mode is off, -1 if mlockall() failed
+ */
+int
+rtMemoryInit(void )
+{
+	char msg[256];
+	
+	if ( ! rtMemoryRequested() )
+	{
+		return ( 0 );
+	}
+	rtStackPrefault();
+	if ( mlockall(MCL_CURRENT | MCL_FUTURE ) != 0 )
+	{
+		sprintf(msg, "rtMemory: mlockall failed: %s", strerror(errno ) );
+		log_message("", msg );
+		metricsError(errno, "mlockall failed" );
+		return ( -1 );
+	}
+	pthread_attr_init(&rtAttr );
+	pthread_attr_setstacksize(&rtAttr, RT_THREAD_STACK );
+	rtMemory = 1;
+	
+	// Faults from here on are the ones that matter
+	sprintf(msg, "rtMemory: memory locked, %ld major page faults during init", majorFaults() );
+	log_message("", msg );
+	metricsFaultsBase = majorFaults();
+	if ( metrics )
+	{
+		metrics->rtMemory = 1;
+		metrics->majorFaults = 0;
+	}
+	return ( 1 );
+}
+
+/*
+ * Function: rtThreadAttr
+ *
+ * Returns: the attributes for pthread_create(): a bounded stack in real-time memory
+ *          mode, otherwise NULL for the defaults
+ */
+pthread_attr_t *
+rtThreadAttr(void )
+{
+	return ( rtMemory ? &rtAttr : NULL );
 }
 
-#define PATH_MAX	512
-char ain_path[PATH_MAX];
+#define AIN_PATH_MAX	512
+char ain_path[AIN_PATH_MAX];
 int ain_path_found = 0;
 int ain_new_names = 0;
 
@@ -326,7 +1587,7 @@ int findAINPath(void )
 	
 	fp = popen("find /sys/devices -name AIN0", "r" );
 	
-	while ( fgets(ain_path, PATH_MAX, fp) != NULL)
+	while ( fgets(ain_path, AIN_PATH_MAX, fp) != NULL)
 	{
 		sprintf(ain_path, "%s", dirname(ain_path ) );	// Return the directory
 		if ( debug > 1 )
@@ -373,46 +1634,76 @@ int findAINPath(void )
 	return ( 0 );
 }
 	
+/*
+ * AIN channels are opened on first use and kept open. sysfs produces the value
+ * afresh on each read from offset 0, so a sample is one pread() with no path lookup.
+*/
+#define AIN_CHANNELS	8
+static int ainFd[AIN_CHANNELS] = { -1, -1, -1, -1, -1, -1, -1, -1 };
+
+static int
+ainOpen(int chan )
+{
+	int fd;
+	char name[AIN_PATH_MAX + 32];
+	
+	if ( ain_new_names )
+	{
+		sprintf(name, "%s/in_voltage%d_raw", ain_path, chan );
+	}
+	else
+	{
+		sprintf(name, "%s/AIN%d", ain_path, chan);
+	}
+	fd = open (name, O_RDONLY );
+	if ( fd < 0 )
+	{
+		if ( debug )
+		{
+			fprintf(stderr, "Failed to open %s", name );
+		}
+		perror("open" );
+		exit ( -2 );
+	}
+	// soundSense reads from more than one thread. The first to open the channel keeps it.
+	if ( ! __sync_bool_compare_and_swap(&ainFd[chan], -1, fd ) )
+	{
+		close(fd );
+	}
+	return ( ainFd[chan] );
+}
+
 int
 read_ain(int chan )
 {
 	int fd;
 	int val = 0;
-	char name[256];
 	int sts;
-	char buf[8];
+	char buf[16];
 	
 	if ( ain_path_found == 0 )
 	{
 		findAINPath();
 	}
-	if ( ain_path_found == 1 )
+	if ( ain_path_found == 1 && chan >= 0 && chan < AIN_CHANNELS )
 	{
-		if ( ain_new_names )
-		{
-			sprintf(name, "%s/in_voltage%d_raw", ain_path, chan );
-		}
-		else
-		{
-			sprintf(name, "%s/AIN%d", ain_path, chan);
-		}
-		fd = open (name, O_RDONLY );
+		fd = ainFd[chan];
 		if ( fd < 0 )
 		{
-			if ( debug )
-			{
-				fprintf(stderr, "Failed to open %s", name );
-			}
-			perror("open" );
-			exit ( -2 );
+			fd = ainOpen(chan );
 		}
-		
-		sts = read(fd, buf, 4 );
-		if ( sts == 4 )
+		// The value and a newline: "987\n" or "1234\n"
+		sts = pread(fd, buf, sizeof(buf) - 1, 0 );
+		metricsIo(1 );
+		if ( sts > 0 )
 		{
+			buf[sts] = 0;
 			val = atoi(buf );
 		}
-		close(fd);
+		else if ( sts < 0 )
+		{
+			metricsError(errno, "AIN read failed" );
+		}
 	}
 
 	return ( val );
@@ -592,6 +1883,7 @@ gpioPinRead(int pin, int *value)
 	}
 	sts = fread(&ch, 1, 1, ioval );
 	fclose(ioval );
+	metricsIo(1 );
 	if ( sts == 1 )
 	{
 		if (ch != '0')
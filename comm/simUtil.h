@@ -21,12 +21,65 @@
 #ifndef SIMUTIL_H_
 #define SIMUTIL_H_
 
+#include <pthread.h>
+
 void daemonize(void );
 void log_message(const char *filename, const char* message);
 void signal_handler(int sig );
 void catchFaults(void );
 
 int initSHM(int create );
+int initSHMRegions(int create, unsigned int regions );
+
+// Change tracking for shmData (see struct shmChange in shmData.h)
+struct shmChangeReader;
+void shmChangePublish(int section, unsigned int mask );
+unsigned int shmChangeCheck(struct shmChangeReader *reader, unsigned int *masks );
+unsigned int shmChangeWait(struct shmChangeReader *reader, unsigned int sections, unsigned int *masks, int timeout );
+
+// Section seqlocks (see struct shmSeqlock in shmData.h)
+void shmWriteBegin(int section );
+void shmWriteEnd(int section );
+unsigned int shmReadBegin(int section );
+int shmReadRetry(int section, unsigned int seq );
+void shmSnapshot(int section, void *copy );
+
+// Sync message timing (see struct syncTiming in shmData.h)
+struct syncJitter;
+struct syncTiming;
+struct syncArrival;
+int syncJitterBin(int jitter );
+int syncJitterPercentile(struct syncJitter *jit, int pct );
+int syncLogRead(struct syncTiming *timing, struct syncArrival *out );
+struct syncEventReader;
+void syncEventPost(void );
+int syncEventWait(struct syncEventReader *reader, struct syncArrival *event, int timeout );
+
+// Sensor sample rings (see struct sensorRing in shmData.h)
+struct sensorRing;
+struct sensorRingReader;
+struct sensorSample;
+void sensorRingPut(struct sensorRing *ring, int *values, int count );
+int sensorRingRead(struct sensorRing *ring, struct sensorRingReader *reader, struct sensorSample *out, int max );
+
+// Daemon metrics (see struct daemonMetrics in shmData.h)
+struct daemonMetrics;
+void metricsInit(int slot, unsigned int target );
+void metricsLoopStart(void );
+void metricsLoopEnd(void );
+void metricsIo(int count );
+void metricsError(int code, const char *text );
+int metricsRead(int slot, struct daemonMetrics *out, unsigned int *age );
+const char *metricsName(int slot );
+
+// Real-time memory mode (see rtMemoryInit() in simUtil.c)
+#define RT_MEMORY_FILE		"/simulator/rtMemory"	// Create to turn the mode on
+#define RT_STACK_PREFAULT	( 128 * 1024 )			// Main thread stack touched before locking
+#define RT_THREAD_STACK		( 256 * 1024 )			// Stack for threads created with rtThreadAttr()
+extern int rtMemory;
+int rtMemoryRequested(void );
+int rtMemoryInit(void );
+pthread_attr_t *rtThreadAttr(void );
 
 // Analog Input Assignments
 #define BREATH_AIN_CHANNEL			0
@@ -0,0 +1,544 @@
+/*
+ * syncReplay.cpp
+ *
+ * This file is part of the sim-ctl distribution (https://github.com/OpenVetSimDevelopers/sim-ctl).
+ * 
+ * Copyright (c) 2019 VetSim, Cornell University College of Veterinary Medicine Ithaca, NY
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Sync replay server
+ *
+ * Plays a sync recording (simController -o) to the clients on SYNC_PORT with the
+ * recorded timing, so simController, soundSense and the other sync clients can be run
+ * and load tested on a development machine without a sim-mgr. Instead of a recording,
+ * a stream can be generated at a given rate, with VPCs and breaths.
+ *
+ * Clients that send SYNC_HELLO get binary frames, as from a current sim-mgr. Run it with
+ * "simmgr_stub -n" to serve the status CGI and discovery without its own syncs.
+ *
+ * Usage: syncReplay [-v] [-a] [-l] [-s speed] [file]
+ *        syncReplay [-v] [-a] [-l] [-s speed] -g bpm [-V n] [-b breaths] [-t sec] [-o file]
+ *		-v : Verbose
+ *		-a : ASCII syncs only, as an older sim-mgr
+ *		-l : Loop: start again at the end
+ *		-s : Play <speed> times as fast (default 1)
+ *		-g : Generate pulses at <bpm> instead of playing a file
+ *		-V : Make every <n>th generated beat a VPC
+ *		-b : Generate <breaths> per minute
+ *		-t : Length of the generated stream, seconds (default 60)
+ *		-o : Save the generated stream as a recording
+*/
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "simCtlComm.h"
+
+#define MAX_CLIENTS		16
+#define HELLO_MAX		64
+#define VPC_EARLY		60		// A VPC comes at this percent of the beat interval
+
+struct client
+{
+	int fd;						// -1 if free
+	int binary;
+	unsigned short seq;
+	char in[HELLO_MAX+1];
+	int inLen;
+};
+
+struct event
+{
+	long long at;				// usec from the start of the stream
+	int type;
+};
+
+struct client clients[MAX_CLIENTS];
+struct event *events = NULL;
+int eventCount = 0;
+int eventMax = 0;
+
+int verbose = 0;
+int asciiOnly = 0;
+
+long long
+nowUs(void )
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts );
+	return ( (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 );
+}
+
+void
+addEvent(long long at, int type )
+{
+	if ( eventCount == eventMax )
+	{
+		eventMax = eventMax ? eventMax * 2 : 1024;
+		events = (struct event *)realloc(events, eventMax * sizeof(struct event ) );
+		if ( events == NULL )
+		{
+			perror("realloc" );
+			exit ( -1 );
+		}
+	}
+	events[eventCount].at = at;
+	events[eventCount].type = type;
+	eventCount++;
+}
+
+int
+loadRecording(const char *path )
+{
+	struct syncRecordHeader header;
+	struct syncRecord rec;
+	long long at = 0;
+	unsigned int reconnects = 0;
+	FILE *fp;
+
+	fp = fopen(path, "r" );
+	if ( fp == NULL )
+	{
+		perror(path );
+		return ( -1 );
+	}
+	if ( fread(&header, sizeof(header), 1, fp ) != 1 ||
+		 memcmp(header.magic, SYNC_RECORD_MAGIC, sizeof(header.magic) ) != 0 )
+	{
+		printf("%s is not a sync recording\n", path );
+		fclose(fp );
+		return ( -1 );
+	}
+	while ( fread(&rec, sizeof(rec), 1, fp ) == 1 )
+	{
+		at += rec.delta;
+		if ( rec.type != SYNC_PULSE && rec.type != SYNC_PULSE_VPC && rec.type != SYNC_BREATH )
+		{
+			continue;
+		}
+		if ( rec.flags & SYNC_RECORD_RECONNECT )
+		{
+			reconnects++;
+		}
+		addEvent(at, rec.type );
+	}
+	fclose(fp );
+	printf("%s: %d syncs over %.1f sec, %u reconnects\n", path, eventCount, at / 1000000.0, reconnects );
+	return ( 0 );
+}
+
+/*
+ * Generate <seconds> of pulses at bpm, with every vpcEvery'th beat a VPC (early, with
+ * the next beat late to keep the rhythm), and breaths at breathRate.
+*/
+void
+generate(int bpm, int vpcEvery, int breathRate, int seconds )
+{
+	long long end = (long long)seconds * 1000000;
+	long long period = 60000000LL / bpm;
+	long long breathPeriod = breathRate > 0 ? 60000000LL / breathRate : 0;
+	long long beat = period;
+	long long breath = breathPeriod ? breathPeriod : end + 1;
+	long long at;
+	int vpc;
+	int n = 1;
+
+	while ( beat < end || breath < end )
+	{
+		// When the next beat is actually sent: a VPC comes early
+		vpc = ( vpcEvery > 0 && ( n % vpcEvery ) == 0 );
+		at = vpc ? beat - period + ( period * VPC_EARLY ) / 100 : beat;
+		if ( breath < at )
+		{
+			addEvent(breath, SYNC_BREATH );
+			breath += breathPeriod;
+			continue;
+		}
+		addEvent(at, vpc ? SYNC_PULSE_VPC : SYNC_PULSE );
+		beat += period;
+		n++;
+	}
+	printf("Generated %d syncs over %d sec: %d bpm, VPC every %d, %d breaths/min\n",
+		eventCount, seconds, bpm, vpcEvery, breathRate );
+}
+
+int
+saveRecording(const char *path )
+{
+	struct syncRecordHeader header;
+	struct syncRecord rec;
+	struct timespec ts;
+	long long last = 0;
+	FILE *fp;
+	int i;
+
+	fp = fopen(path, "w" );
+	if ( fp == NULL )
+	{
+		perror(path );
+		return ( -1 );
+	}
+	memcpy(header.magic, SYNC_RECORD_MAGIC, sizeof(header.magic) );
+	clock_gettime(CLOCK_REALTIME, &ts );
+	header.start = (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	fwrite(&header, sizeof(header), 1, fp );
+	for ( i = 0 ; i < eventCount ; i++ )
+	{
+		if ( events[i].at < last )
+		{
+			printf("%s: sync %d is %lld usec before the one ahead of it, not saved\n", path, i, last - events[i].at );
+			fclose(fp );
+			unlink(path );
+			return ( -1 );
+		}
+		rec.delta = (unsigned int)( events[i].at - last );
+		rec.type = events[i].type;
+		rec.flags = 0;
+		rec.seq = i;
+		last = events[i].at;
+		fwrite(&rec, sizeof(rec), 1, fp );
+	}
+	return ( fclose(fp ) );
+}
+
+int
+openServer(int port )
+{
+	struct sockaddr_in addr;
+	int on = 1;
+	int fd;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0 );
+	if ( fd < 0 )
+	{
+		perror("socket" );
+		exit ( -1 );
+	}
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on) );
+	memset(&addr, 0, sizeof(addr) );
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY );
+	addr.sin_port = htons(port );
+	if ( bind(fd, (struct sockaddr *)&addr, sizeof(addr) ) < 0 || listen(fd, 8 ) < 0 )
+	{
+		printf("port %d: %s\n", port, strerror(errno ) );
+		exit ( -1 );
+	}
+	return ( fd );
+}
+
+void
+closeClient(struct client *cl )
+{
+	close(cl->fd );
+	cl->fd = -1;
+	if ( verbose )
+	{
+		printf("client closed\n" );
+	}
+}
+
+void
+acceptClient(int lfd )
+{
+	int on = 1;
+	int fd;
+	int i;
+
+	fd = accept(lfd, NULL, NULL );
+	if ( fd < 0 )
+	{
+		return;
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on) );
+	for ( i = 0 ; i < MAX_CLIENTS ; i++ )
+	{
+		if ( clients[i].fd < 0 )
+		{
+			memset(&clients[i], 0, sizeof(struct client ) );
+			clients[i].fd = fd;
+			if ( verbose )
+			{
+				printf("client on fd %d\n", fd );
+			}
+			return;
+		}
+	}
+	close(fd );
+}
+
+// Read from a client. Answer SYNC_HELLO, and send it frames from then on.
+void
+readClient(struct client *cl )
+{
+	const char *reply = SYNC_HELLO "\n";
+	int len;
+
+	if ( cl->inLen >= HELLO_MAX )
+	{
+		cl->inLen = 0;
+	}
+	len = read(cl->fd, &cl->in[cl->inLen], HELLO_MAX - cl->inLen );
+	if ( len <= 0 )
+	{
+		closeClient(cl );
+		return;
+	}
+	cl->inLen += len;
+	cl->in[cl->inLen] = 0;
+	if ( ! asciiOnly && ! cl->binary && strstr(cl->in, SYNC_HELLO ) )
+	{
+		if ( write(cl->fd, reply, strlen(reply ) ) == (int)strlen(reply ) )
+		{
+			cl->binary = 1;
+			if ( verbose )
+			{
+				printf("client on fd %d uses binary frames\n", cl->fd );
+			}
+		}
+	}
+}
+
+// Serve the clients until 'due', then return as close to it as possible
+void
+serveUntil(int lfd, long long due )
+{
+	struct pollfd pfd[MAX_CLIENTS+1];
+	int pidx[MAX_CLIENTS+1];
+	struct timespec ts;
+	long long now;
+	int n;
+	int i;
+
+	while ( ( now = nowUs() ) < due - 2000 )
+	{
+		n = 0;
+		pfd[n].fd = lfd;
+		pfd[n].events = POLLIN;
+		pidx[n++] = -1;
+		for ( i = 0 ; i < MAX_CLIENTS ; i++ )
+		{
+			if ( clients[i].fd >= 0 )
+			{
+				pfd[n].fd = clients[i].fd;
+				pfd[n].events = POLLIN;
+				pidx[n++] = i;
+			}
+		}
+		if ( poll(pfd, n, (int)( ( due - now - 1000 ) / 1000 ) ) <= 0 )
+		{
+			continue;
+		}
+		for ( i = 0 ; i < n ; i++ )
+		{
+			if ( pfd[i].revents )
+			{
+				if ( pidx[i] < 0 )
+				{
+					acceptClient(lfd );
+				}
+				else
+				{
+					readClient(&clients[pidx[i]] );
+				}
+			}
+		}
+	}
+	// The last 2 msec on the timer, which is more precise than poll()
+	ts.tv_sec = due / 1000000;
+	ts.tv_nsec = ( due % 1000000 ) * 1000;
+	while ( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL ) == EINTR )
+	{
+	}
+}
+
+int
+sendSync(int type )
+{
+	struct syncFrame frame;
+	struct timespec ts;
+	const char *msg;
+	int sent = 0;
+	int sts;
+	int i;
+
+	switch ( type )
+	{
+		case SYNC_PULSE_VPC:	msg = "pulseVPC"; break;
+		case SYNC_BREATH:		msg = "breath"; break;
+		default:				msg = "pulse"; break;
+	}
+	clock_gettime(CLOCK_REALTIME, &ts );
+	for ( i = 0 ; i < MAX_CLIENTS ; i++ )
+	{
+		if ( clients[i].fd < 0 )
+		{
+			continue;
+		}
+		if ( clients[i].binary )
+		{
+			frame.magic = SYNC_FRAME_MAGIC;
+			frame.type = type;
+			frame.seq = htons(clients[i].seq++ );
+			frame.sent = htonl((unsigned int)( (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 ) );
+			sts = write(clients[i].fd, &frame, sizeof(frame) ) != sizeof(frame);
+		}
+		else
+		{
+			sts = write(clients[i].fd, msg, strlen(msg ) ) != (int)strlen(msg );
+		}
+		if ( sts )
+		{
+			closeClient(&clients[i] );
+		}
+		else
+		{
+			sent++;
+		}
+	}
+	return ( sent );
+}
+
+void
+usage(const char *name )
+{
+	printf("Usage: %s [-v] [-a] [-l] [-s speed] [file]\n", name );
+	printf("       %s [-v] [-a] [-l] [-s speed] -g bpm [-V n] [-b breaths] [-t sec] [-o file]\n", name );
+	printf("\t-v : Verbose\n" );
+	printf("\t-a : ASCII syncs only, as an older sim-mgr\n" );
+	printf("\t-l : Loop: start again at the end\n" );
+	printf("\t-s : Play <speed> times as fast (default 1)\n" );
+	printf("\t-g : Generate pulses at <bpm> instead of playing a file\n" );
+	printf("\t-V : Make every <n>th generated beat a VPC\n" );
+	printf("\t-b : Generate <breaths> per minute\n" );
+	printf("\t-t : Length of the generated stream, seconds (default 60)\n" );
+	printf("\t-o : Save the generated stream as a recording\n" );
+}
+
+int
+main(int argc, char *argv[] )
+{
+	int c;
+	int i;
+	int lfd;
+	int loop = 0;
+	double speed = 1.0;
+	int bpm = 0;
+	int vpcEvery = 0;
+	int breathRate = 0;
+	int seconds = 60;
+	const char *savePath = NULL;
+	long long start;
+	long long cycleAt = 0;
+	long long due;
+	long long late;
+	long long lateMax = 0;
+	long long lateSum = 0;
+	unsigned int sent = 0;
+	int cycle = 0;
+
+	while (( c = getopt(argc, argv, "vals:g:V:b:t:o:h" ) ) != -1 )
+	{
+		switch ( c )
+		{
+			case 'v': verbose = 1; break;
+			case 'a': asciiOnly = 1; break;
+			case 'l': loop = 1; break;
+			case 's': speed = atof(optarg ); break;
+			case 'g': bpm = atoi(optarg ); break;
+			case 'V': vpcEvery = atoi(optarg ); break;
+			case 'b': breathRate = atoi(optarg ); break;
+			case 't': seconds = atoi(optarg ); break;
+			case 'o': savePath = optarg; break;
+			default:
+				usage(argv[0] );
+				exit ( 0 );
+		}
+	}
+	if ( speed <= 0 )
+	{
+		speed = 1.0;
+	}
+	if ( bpm > 0 )
+	{
+		generate(bpm, vpcEvery, breathRate, seconds );
+		if ( savePath && saveRecording(savePath ) )
+		{
+			exit ( -1 );
+		}
+	}
+	else if ( optind < argc )
+	{
+		if ( loadRecording(argv[optind] ) )
+		{
+			exit ( -1 );
+		}
+	}
+	else
+	{
+		usage(argv[0] );
+		exit ( -1 );
+	}
+	if ( eventCount == 0 )
+	{
+		printf("Nothing to play\n" );
+		exit ( -1 );
+	}
+	signal(SIGPIPE, SIG_IGN );
+	for ( i = 0 ; i < MAX_CLIENTS ; i++ )
+	{
+		clients[i].fd = -1;
+	}
+	lfd = openServer(SYNC_PORT );
+	printf("syncReplay: sync port %d, speed %.2f%s\n", SYNC_PORT, speed, loop ? ", looping" : "" );
+
+	start = nowUs();
+	do
+	{
+		for ( i = 0 ; i < eventCount ; i++ )
+		{
+			due = start + (long long)( ( cycleAt + events[i].at ) / speed );
+			serveUntil(lfd, due );
+			late = nowUs() - due;
+			sent += sendSync(events[i].type );
+			lateSum += late;
+			if ( late > lateMax )
+			{
+				lateMax = late;
+			}
+		}
+		cycleAt += events[eventCount - 1].at;
+		cycle++;
+		printf("Pass %d: %d syncs, %u sent, sent late by avg %lld max %lld usec\n",
+			cycle, eventCount, sent, lateSum / eventCount, lateMax );
+		fflush(stdout );
+		sent = 0;
+		lateSum = 0;
+		lateMax = 0;
+	} while ( loop );
+	return ( 0 );
+}
@@ -27,6 +27,7 @@
 #include <sys/ioctl.h>
 #include <stropts.h>
 #include <stdio.h>
+#include <errno.h>
 #include "cprI2C.h"
 #include <iostream>
 #include <math.h>
@@ -147,8 +148,10 @@ int cprI2C::readRegister(int reg )
 	}
 	status = ioctl(I2Cfile, I2C_RDWR, &ioctl_data );
 	releaseI2CLock();
+	metricsIo(1 );
 	if ( status < 0 )
 	{
+		metricsError(errno, "I2C transfer failed" );
 		perror("ioctl" );
 		printf("I2Cfile is %d\n", I2Cfile );
 		return ( -1 );
@@ -187,8 +190,10 @@ int cprI2C::readRegister16(int reg )
 	}
 	status = ioctl(I2Cfile, I2C_RDWR, &ioctl_data );
 	releaseI2CLock();
+	metricsIo(1 );
 	if ( status < 0 )
 	{
+		metricsError(errno, "I2C transfer failed" );
 		perror("ioctl" );
 		printf("I2Cfile is %d\n", I2Cfile );
 		return ( -1 );
@@ -218,8 +223,10 @@ int cprI2C::writeRegister(int reg, unsigned char val )
 	}
 	status = ioctl(I2Cfile, I2C_RDWR, &ioctl_data );
 	releaseI2CLock();
+	metricsIo(1 );
 	if ( status < 0 )
 	{
+		metricsError(errno, "I2C transfer failed" );
 		perror("ioctl" );
 		printf("I2Cfile is %d\n", I2Cfile );
 		return ( -1 );
@@ -54,6 +54,7 @@ int debug = 0;
 #define Z_RELEASE	5000
 #define X_Y_LIMIT	7000
 #define CPR_HOLD	20
+#define CPR_LOOP_US	25000	// Expected time between samples: the 20 ms sleep and a 5 ms poll
 
 int main(int argc, char *argv[])
 {
@@ -61,10 +62,13 @@ int main(int argc, char *argv[])
 	int newData;
 	int lastZ, diffZ;
 	int lastX, lastY;
+	int xyz[3];
 	int cummZ;
 	int count = 0;
 	int compressed = 0;
 	int loop = 0;
+	int oldCompression;
+	int oldRelease;
 	
 	if ( ! debug )
 	{
@@ -74,7 +78,8 @@ int main(int argc, char *argv[])
 	{
 		catchFaults();
 	}
-	sts = initSHM(0 );
+	sts = initSHMRegions(SHM_OPEN, ( 1 << SHM_REGION_CONFIG ) | ( 1 << SHM_REGION_CPR ) | ( 1 << SHM_REGION_CHANGE ) | ( 1 << SHM_REGION_SENSORS ) |
+							( 1 << SHM_REGION_METRICS ) );
 	if ( sts )
 	{
 		sprintf(msgbuf, "SHM Failed (%d) - Exiting", sts );
@@ -93,6 +98,8 @@ int main(int argc, char *argv[])
 		}
 		log_message("","cprSense Found Sensor" );
 	}
+	metricsInit(METRIC_CPR, CPR_LOOP_US );
+	rtMemoryInit();
 	
 	
 	// shmData->present = cprSense.present;
@@ -114,12 +121,17 @@ int main(int argc, char *argv[])
 		}
 		if ( newData )
 		{
+			// A pass is one sample; the polling above is the wait for it
+			metricsLoopStart();
+			oldCompression = shmData->cpr.compression;
+			oldRelease = shmData->cpr.release;
 			loop++;
 			diffZ = cprSense.readingZ - lastZ;
 			lastZ = cprSense.readingZ;
 			lastX = cprSense.readingX;
 			lastY = cprSense.readingY;
 			cummZ += diffZ;
+			shmWriteBegin(SHM_SECTION_CPR );
 #if 0
 			if ( compressed )
 			{
@@ -176,6 +188,16 @@ int main(int argc, char *argv[])
 			shmData->cpr.x = lastX;
 			shmData->cpr.y = lastY;
 			shmData->cpr.z = lastZ;
+			shmWriteEnd(SHM_SECTION_CPR );
+			xyz[0] = lastX;
+			xyz[1] = lastY;
+			xyz[2] = lastZ;
+			sensorRingPut(&shmData->sensors.cpr, xyz, 3 );
+			if ( oldCompression != shmData->cpr.compression || oldRelease != shmData->cpr.release )
+			{
+				shmChangePublish(SHM_SECTION_CPR, CHG_CPR_COMPRESSION );
+			}
+			metricsLoopEnd();
 		}
 		usleep(20000);
 	}
@@ -82,6 +82,7 @@ int isDaemon = 0;
 #define SENSE_MID			500
 #define SENSE_LO			250
 #define SENSE_OFFSET_ADJUST	20
+#define PULSE_LOOP_US		200000	// Sensor scan period
 
 struct senseChans
 {
@@ -145,7 +146,8 @@ int main(int argc, char *argv[])
 		isDaemon = 1;
 	}
 	
-	sts = initSHM(SHM_OPEN );
+	sts = initSHMRegions(SHM_OPEN, ( 1 << SHM_REGION_PULSE ) | ( 1 << SHM_REGION_CHANGE ) | ( 1 << SHM_REGION_SENSORS ) |
+							( 1 << SHM_REGION_METRICS ) );
 	if ( sts  )
 	{
 		perror("initSHM");
@@ -153,6 +155,8 @@ int main(int argc, char *argv[])
 	}
 
 	init_touch_sensors();
+	metricsInit(METRIC_PULSE, PULSE_LOOP_US );
+	rtMemoryInit();
 	
 	if ( debug )
 	{
@@ -161,6 +165,7 @@ int main(int argc, char *argv[])
 	
 	while ( 1 )
 	{
+		metricsLoopStart();
 		read_touch_sensors();
 
 		if ( debug && ( loops++ >= 10 ) )
@@ -181,7 +186,8 @@ int main(int argc, char *argv[])
 	
 			loops = 0;
 		}
-		usleep(200000 );
+		metricsLoopEnd();
+		usleep(PULSE_LOOP_US );
 	}
 	if ( isDaemon )
 	{
@@ -198,6 +204,7 @@ init_touch_sensors(void )
 	int sensor;
 	int position;
 	
+	shmWriteBegin(SHM_SECTION_PULSE );
 	for ( chan = 0 ; chan < 4 ; chan++ )
 	{
 		sensor = read_ain(senseChannels[chan].ainChannel );
@@ -214,6 +221,7 @@ init_touch_sensors(void )
 				chan, senseChannels[chan].baseline );
 		}
 	}
+	shmWriteEnd(SHM_SECTION_PULSE );
 }
 const char *positions[] = {
 	"None",
@@ -236,7 +244,12 @@ read_touch_sensors(void )
 {
 	int chan;
 	int pressure;
+	int *touch;
+	int changed = 0;
+	int ain[4];
 	
+	// All four channels are one write, so readers see a consistent set
+	shmWriteBegin(SHM_SECTION_PULSE );
 	for ( chan = 0 ; chan < 4 ; chan++ )
 	{
 		read_touch_sensor(chan );
@@ -245,20 +258,36 @@ read_touch_sensors(void )
 		switch ( senseChannels[chan].position )
 		{
 			case PULSE_RIGHT_DORSAL:
-				shmData->pulse.right_dorsal = pressure;
+				touch = &shmData->pulse.right_dorsal;
 				break;
 			case PULSE_LEFT_DORSAL:
-				shmData->pulse.left_dorsal = pressure;
+				touch = &shmData->pulse.left_dorsal;
 				break;
 			case PULSE_RIGHT_FEMORAL:
-				shmData->pulse.right_femoral = pressure;
+				touch = &shmData->pulse.right_femoral;
 				break;
 			case PULSE_LEFT_FEMORAL:
-				shmData->pulse.left_femoral = pressure;
+				touch = &shmData->pulse.left_femoral;
 				break;
 			default:
+				touch = NULL;
 				break;
 		}
+		if ( touch && *touch != pressure )
+		{
+			*touch = pressure;
+			changed = 1;
+		}
+	}
+	shmWriteEnd(SHM_SECTION_PULSE );
+	for ( chan = 0 ; chan < 4 ; chan++ )
+	{
+		ain[chan] = shmData->pulse.ain[PULSE_RIGHT_DORSAL + chan];
+	}
+	sensorRingPut(&shmData->sensors.pulse, ain, 4 );
+	if ( changed )
+	{
+		shmChangePublish(SHM_SECTION_PULSE, CHG_PULSE_PRESSURE );
 	}
 }
 void
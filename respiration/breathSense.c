@@ -46,6 +46,8 @@
 
 using namespace std;
 
+#define BREATH_LOOP_US	10000	// Sensor scan period
+
 struct shmData *shmData;
 
 char msgbuf[2048];
@@ -103,7 +105,13 @@ int main(int argc, char *argv[])
 		daemonize();
 		isDaemon = 1;
 	}
-	initSHM(0 );
+	if ( initSHMRegions(SHM_OPEN, ( 1 << SHM_REGION_RESPIRATION ) | ( 1 << SHM_REGION_BREATH ) | ( 1 << SHM_REGION_CHANGE ) | ( 1 << SHM_REGION_SENSORS ) |
+						 ( 1 << SHM_REGION_METRICS ) ) < 0 )
+	{
+		sprintf(msgbuf, "SHM Failed - Exiting" );
+		log_message("", msgbuf );
+		exit ( -1 );
+	}
 
 	if ( monitor )
 	{
@@ -123,12 +131,18 @@ int main(int argc, char *argv[])
 	sprintf(msgbuf, "Breath baseline: %d", baseline );
 	log_message("", msgbuf); 
 	shmData->manual_breath_baseline = baseline;
+	metricsInit(METRIC_BREATH, BREATH_LOOP_US );
+	rtMemoryInit();
 	
 	while ( 1 )
 	{
-		usleep(10000 );	
+		// Ends the previous pass here, as some passes end with continue
+		metricsLoopEnd();
+		usleep(BREATH_LOOP_US );
+		metricsLoopStart();
 		ain = read_ain(BREATH_AIN_CHANNEL );
 		shmData->manual_breath_ain = ain;
+		sensorRingPut(&shmData->sensors.breath, &ain, 1 );
 		if ( ain == 0 )
 		{
 			continue;
@@ -151,6 +165,7 @@ int main(int argc, char *argv[])
 				if ( ( ain < ( baseline+10 ) ) || ( activeLoops++ > 200 ) )
 				{
 					shmData->respiration.manual_breath = 1;
+					shmChangePublish(SHM_SECTION_BREATH, CHG_BREATH_MANUAL );
 					sprintf(msgbuf, "Breath: %d, Baseline %d", ain, baseline );
 					log_message("", msgbuf); 
 					sense = 0;
@@ -0,0 +1,219 @@
+/*
+ * ain_bench.c
+ *
+ * This file is part of the sim-ctl distribution (https://github.com/OpenVetSimDevelopers/sim-ctl).
+ * 
+ * Copyright (c) 2019 VetSim, Cornell University College of Veterinary Medicine Ithaca, NY
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * AIN read benchmark
+ *
+ * Times one AIN sample taken the way read_ain() used to (format the path, open, read
+ * 4 bytes, close) and the way it does now (pread() on a descriptor kept open), in
+ * samples per second and CPU time per sample. Also counts the samples the old 4 byte
+ * read discarded.
+ *
+ * On the SimCtl the channel's sysfs file is read, and read_ain() itself is timed too.
+ * Elsewhere, -f names a file to read instead, such as a sysfs attribute of the machine.
+ *
+ * Usage: ain_bench [-c channel] [-n samples] [-f file]
+*/
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "../comm/simUtil.h"
+#include "../comm/shmData.h"
+
+struct shmData *shmData;
+int debug = 0;
+char msgbuf[2048];
+
+// In simUtil.c
+extern char ain_path[];
+extern int ain_path_found;
+extern int ain_new_names;
+int findAINPath(void );
+
+char fileName[512];
+int shortReads;
+
+static double
+wallSec(void )
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts );
+	return ( ts.tv_sec + ts.tv_nsec / 1e9 );
+}
+
+static double
+cpuSec(void )
+{
+	struct rusage ru;
+	
+	getrusage(RUSAGE_SELF, &ru );
+	return ( ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+			 ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6 );
+}
+
+// The read_ain() this replaced
+static int
+openRead(int chan )
+{
+	char name[512];
+	char buf[8];
+	int fd;
+	int sts;
+	int val = 0;
+	
+	sprintf(name, "%s", fileName );
+	fd = open(name, O_RDONLY );
+	if ( fd < 0 )
+	{
+		perror(name );
+		exit ( -1 );
+	}
+	sts = read(fd, buf, 4 );
+	if ( sts == 4 )
+	{
+		buf[4] = 0;
+		val = atoi(buf );
+	}
+	else
+	{
+		shortReads++;
+	}
+	close(fd );
+	return ( val );
+}
+
+static int preadFd = -1;
+
+static int
+preadRead(int chan )
+{
+	char buf[16];
+	int sts;
+	int val = 0;
+	
+	if ( preadFd < 0 )
+	{
+		preadFd = open(fileName, O_RDONLY );
+		if ( preadFd < 0 )
+		{
+			perror(fileName );
+			exit ( -1 );
+		}
+	}
+	sts = pread(preadFd, buf, sizeof(buf) - 1, 0 );
+	if ( sts > 0 )
+	{
+		buf[sts] = 0;
+		val = atoi(buf );
+	}
+	return ( val );
+}
+
+static void
+run(const char *label, int (*sample)(int ), int chan, int samples )
+{
+	double wall;
+	double cpu;
+	int val = 0;
+	int i;
+	
+	shortReads = 0;
+	wall = wallSec();
+	cpu = cpuSec();
+	for ( i = 0 ; i < samples ; i++ )
+	{
+		val = sample(chan );
+	}
+	wall = wallSec() - wall;
+	cpu = cpuSec() - cpu;
+	printf("%-16s %8.0f samples/s, %6.2f usec CPU/sample, last value %d", label,
+		samples / wall, cpu * 1e6 / samples, val );
+	if ( shortReads )
+	{
+		printf(", %d short reads discarded", shortReads );
+	}
+	printf("\n");
+}
+
+int
+main(int argc, char *argv[] )
+{
+	int c;
+	int chan = BREATH_AIN_CHANNEL;
+	int samples = 20000;
+	int useAin = 1;
+	
+	while (( c = getopt(argc, argv, "c:n:f:h" ) ) != -1 )
+	{
+		switch ( c )
+		{
+			case 'c':
+				chan = atoi(optarg );
+				break;
+			case 'n':
+				samples = atoi(optarg );
+				break;
+			case 'f':
+				snprintf(fileName, sizeof(fileName), "%s", optarg );
+				useAin = 0;
+				break;
+			case 'h':
+			default:
+				printf("Usage: %s [-c channel] [-n samples] [-f file]\n", argv[0] );
+				exit ( 0 );
+		}
+	}
+	if ( samples <= 0 )
+	{
+		samples = 1;
+	}
+	if ( useAin )
+	{
+		findAINPath();
+		if ( ain_path_found != 1 )
+		{
+			printf("No AIN path found. Use -f to read another file.\n" );
+			exit ( 1 );
+		}
+		if ( ain_new_names )
+		{
+			sprintf(fileName, "%s/in_voltage%d_raw", ain_path, chan );
+		}
+		else
+		{
+			sprintf(fileName, "%s/AIN%d", ain_path, chan );
+		}
+	}
+	printf("%s, %d samples\n", fileName, samples );
+	run("open/read/close", openRead, chan, samples );
+	run("pread", preadRead, chan, samples );
+	if ( useAin )
+	{
+		run("read_ain", read_ain, chan, samples );
+	}
+	return ( 0 );
+}
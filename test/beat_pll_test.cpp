@@ -0,0 +1,191 @@
+/*
+ * beat_pll_test.cpp
+ *
+ * This file is part of the sim-ctl distribution (https://github.com/OpenVetSimDevelopers/sim-ctl).
+ * 
+ * Copyright (c) 2019 VetSim, Cornell University College of Veterinary Medicine Ithaca, NY
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Beat scheduler test
+ *
+ * Feeds a synthetic pulse sync stream to the phase locked beat scheduler
+ * (wav-trig/beatPll.c) and compares the beat to beat jitter with the previous scheme,
+ * where a beat played LUB_DELAY after its sync was noticed by the 10 ms soundSense loop.
+ *
+ * The sim-mgr beats at a steady rate (with a clock error of -d ppm). Each sync is
+ * delayed by a random network delay of up to -j ms, with a spike of -s ms on one sync
+ * in 50, and one in 100 is lost. Time is simulated, so the test runs instantly; the
+ * timer wake error of the scheduler is taken as up to 100 usec.
+ *
+ * Usage: beat_pll_test [-r rate] [-n beats] [-j jitter_ms] [-s spike_ms] [-d ppm]
+*/
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "../wav-trig/beatPll.h"
+#include "../comm/shmData.h"
+
+#define LOOP_USEC	10000		// soundSense main loop period
+
+unsigned int seed = 1;
+
+// Uniform in [0, max)
+long long
+randUsec(long long max )
+{
+	seed = seed * 1103515245 + 12345;
+	return ( max > 0 ? ( ( seed >> 8 ) % max ) : 0 );
+}
+
+struct jitterStats
+{
+	int count;
+	double sum;
+	double sumSq;
+	long long max;
+	long long *dev;
+};
+
+void
+addInterval(struct jitterStats *js, long long interval, long long period )
+{
+	long long dev = llabs(interval - period );
+
+	js->dev[js->count++] = dev;
+	js->sum += dev;
+	js->sumSq += (double)dev * dev;
+	if ( dev > js->max )
+	{
+		js->max = dev;
+	}
+}
+
+int
+compareLL(const void *a, const void *b )
+{
+	long long x = *(const long long *)a;
+	long long y = *(const long long *)b;
+
+	return ( x < y ? -1 : x > y );
+}
+
+void
+report(const char *name, struct jitterStats *js, int beats )
+{
+	qsort(js->dev, js->count, sizeof(long long), compareLL );
+	printf("%-18s %5d beats  jitter rms %7.0f  p50 %6lld  p99 %6lld  max %6lld usec\n", name, beats,
+		sqrt(js->sumSq / js->count ), js->dev[js->count / 2], js->dev[( js->count * 99 ) / 100], js->max );
+}
+
+int
+main(int argc, char *argv[] )
+{
+	int c;
+	int rate = 80;
+	int beats = 5000;
+	int jitterMs = 5;
+	int spikeMs = 40;
+	int ppm = 100;
+	long long period;
+	long long truePeriod;
+	long long delay = LUB_DELAY / 1000;
+	long long sync;
+	long long lastOld = 0;
+	long long lastNew = 0;
+	long long deadline;
+	long long play;
+	int played = 0;
+	int oldBeats = 0;
+	int k;
+	struct beatPll pll;
+	struct jitterStats oldStats;
+	struct jitterStats newStats;
+
+	while (( c = getopt(argc, argv, "r:n:j:s:d:" ) ) != -1 )
+	{
+		switch ( c )
+		{
+			case 'r': rate = atoi(optarg ); break;
+			case 'n': beats = atoi(optarg ); break;
+			case 'j': jitterMs = atoi(optarg ); break;
+			case 's': spikeMs = atoi(optarg ); break;
+			case 'd': ppm = atoi(optarg ); break;
+			default:
+				printf("Usage: %s [-r rate] [-n beats] [-j jitter_ms] [-s spike_ms] [-d ppm]\n", argv[0] );
+				exit ( 0 );
+		}
+	}
+	period = 60000000LL / rate;
+	truePeriod = period - ( period * ppm ) / 1000000;
+	memset(&oldStats, 0, sizeof(oldStats) );
+	memset(&newStats, 0, sizeof(newStats) );
+	oldStats.dev = (long long *)calloc(beats * 2, sizeof(long long) );
+	newStats.dev = (long long *)calloc(beats * 2, sizeof(long long) );
+	beatPllInit(&pll, delay );
+
+	for ( k = 1 ; k <= beats ; k++ )
+	{
+		// Beat k leaves the sim-mgr at k * truePeriod
+		sync = k * truePeriod + randUsec(jitterMs * 1000 );
+		if ( k % 50 == 0 )
+		{
+			sync += spikeMs * 1000;
+		}
+		if ( k % 100 == 0 )
+		{
+			sync = 0;	// Lost
+		}
+
+		// Play the scheduled beats that fall before this sync
+		while ( ( deadline = beatPllDeadline(&pll, sync ? sync : k * truePeriod, rate ) ) != 0 &&
+				deadline <= ( sync ? sync : k * truePeriod ) )
+		{
+			play = deadline + randUsec(100 );
+			if ( lastNew && played > PLL_LOCK_SYNCS + 1 )
+			{
+				addInterval(&newStats, play - lastNew, truePeriod );
+			}
+			lastNew = play;
+			played++;
+			beatPllPlayed(&pll, deadline );
+		}
+		if ( ! sync )
+		{
+			continue;
+		}
+		beatPllSync(&pll, sync, 0, rate );
+
+		// Previous scheme: noticed on the next pass of the loop, then LUB_DELAY
+		play = sync + randUsec(LOOP_USEC ) + delay;
+		if ( lastOld && play - lastOld < truePeriod + truePeriod / 2 )
+		{
+			addInterval(&oldStats, play - lastOld, truePeriod );
+		}
+		lastOld = play;
+		oldBeats++;
+	}
+
+	printf("rate %d, network jitter %d ms, spike %d ms every 50, 1 in 100 lost, clock error %d ppm\n",
+		rate, jitterMs, spikeMs, ppm );
+	report("sync driven", &oldStats, oldBeats );
+	report("phase locked", &newStats, played );
+	printf("pll: %u syncs, %u locks, %u unlocks, %u free running beats, period %lld usec (true %lld)\n",
+		pll.syncs, pll.locks, pll.unlocks, pll.freeRun, pll.period, truePeriod );
+	return ( 0 );
+}
@@ -0,0 +1,375 @@
+/*
+ * parse_bench.cpp
+ *
+ * This file is part of the sim-ctl distribution (https://github.com/OpenVetSimDevelopers/sim-ctl).
+ * 
+ * Copyright (c) 2019 VetSim, Cornell University College of Veterinary Medicine Ithaca, NY
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Status parse benchmark
+ *
+ * Compares the incremental JSON parser (comm/simJson.c) with the line based parse it
+ * replaced in simController, on a generated status document. The document is fed
+ * to the JSON parser in blocks of a given size, as it would arrive from the socket.
+ *
+ * It then times the field lookup in cardiac_parse/respiration_parse (comm/simParse.c)
+ * against a strcmp chain in the order of the original if/else code, over the keys of
+ * a status read.
+ *
+ * Usage: parse_bench [-k keys_per_section] [-s sections] [-b block_size] [-n iterations]
+*/
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "../comm/simJson.h"
+#include "../comm/shmData.h"
+
+#define DOC_MAX	(4 * 1024 * 1024 )
+
+char *doc;
+int docLen;
+unsigned int values;
+int debug = 0;
+
+double
+now(void )
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts );
+	return ( ts.tv_sec + ts.tv_nsec / 1e9 );
+}
+
+void
+makeDoc(int sections, int keys )
+{
+	int s;
+	int k;
+
+	docLen = sprintf(doc, "{\n" );
+	for ( s = 0 ; s < sections ; s++ )
+	{
+		docLen += sprintf(&doc[docLen], " \"%s%d\" : {\n", ( s & 1 ) ? "respiration" : "cardiac", s );
+		for ( k = 0 ; k < keys ; k++ )
+		{
+			docLen += sprintf(&doc[docLen], "  \"field_name_%d\" : \"%d\"%s\n", k, k * 7, ( k < keys - 1 ) ? "," : "" );
+		}
+		docLen += sprintf(&doc[docLen], " }%s\n", ( s < sections - 1 ) ? "," : "" );
+	}
+	docLen += sprintf(&doc[docLen], "}\n" );
+}
+
+void
+countValue(const char *section, const char *key, const char *value, void *ctx )
+{
+	values++;
+}
+
+// The previous simController parse: copy each line, blank out the punctuation and sscanf
+void
+lineParse(void )
+{
+	char line[1024];
+	char name[128];
+	char value[128];
+	char *p;
+	char *next;
+	int len;
+	int i;
+
+	for ( p = doc ; *p ; p = next )
+	{
+		next = strchr(p, '\n' );
+		len = next ? next - p : strlen(p );
+		next = next ? next + 1 : p + len;
+		if ( len > 1023 )
+		{
+			len = 1023;
+		}
+		memcpy(line, p, len );
+		line[len] = 0;
+		for ( i = 0 ; line[i] != 0 ; i++ )
+		{
+			switch ( line[i] )
+			{
+				case ':':
+				case '"':
+				case '}':
+				case '{':
+				case ',':
+					line[i] = ' ';
+					break;
+			}
+		}
+		if ( sscanf(line, "%127s %127s", name, value ) == 2 )
+		{
+			values++;
+		}
+	}
+}
+
+void
+jsonParse(int block )
+{
+	struct simJson js;
+	int off;
+	int n;
+
+	simJsonInit(&js, countValue, NULL );
+	for ( off = 0 ; off < docLen ; off += n )
+	{
+		n = ( docLen - off < block ) ? docLen - off : block;
+		if ( simJsonFeed(&js, &doc[off], n ) < 0 )
+		{
+			printf("Parse error at offset %d\n", off );
+			exit ( -1 );
+		}
+	}
+}
+
+// Expected values from a few awkward inputs, fed one byte at a time
+struct check
+{
+	const char *doc;
+	const char *expect;
+};
+
+struct check checks[] =
+{
+	{ "{\"cardiac\":{\"rate\":\"80\",\"rhythm\":\"sinus\"}}", "cardiac.rate=80 cardiac.rhythm=sinus " },
+	{ "{ \"a\" : { \"b\" : { \"c\" : 12 , \"d\" : true } } }", "b.c=12 b.d=true " },
+	{ "{\"s\":{\"k\":\"two words\",\"e\":\"q\\\"\\u0041\"}}", "s.k=two words s.e=q\"A " },
+	{ "{\"s\":{\"l\":[1,2],\"t\":\"x\",}}{\"s\":{\"k\":\"v\"}}", "s.l=1 s.l=2 s.t=x s.k=v " },
+	{ NULL, NULL }
+};
+
+void
+checkValue(const char *section, const char *key, const char *value, void *ctx )
+{
+	char *out = (char *)ctx;
+
+	sprintf(&out[strlen(out)], "%s.%s=%s ", section, key, value );
+}
+
+int
+runChecks(void )
+{
+	struct simJson js;
+	char out[1024];
+	int i;
+	size_t j;
+	int fails = 0;
+
+	for ( i = 0 ; checks[i].doc ; i++ )
+	{
+		out[0] = 0;
+		simJsonInit(&js, checkValue, out );
+		for ( j = 0 ; j < strlen(checks[i].doc ) ; j++ )
+		{
+			simJsonFeed(&js, &checks[i].doc[j], 1 );
+		}
+		if ( strcmp(out, checks[i].expect ) != 0 || js.errors )
+		{
+			printf("FAIL: %s\n\tgot '%s'\n\texpected '%s'\n", checks[i].doc, out, checks[i].expect );
+			fails++;
+		}
+	}
+	printf("%d checks, %d failed\n", i, fails );
+	return ( fails );
+}
+
+// Status keys, in the order of the old cardiac_parse and respiration_parse chains
+const char *cardiacChain[] =
+{
+	"rhythm", "vpc", "pea", "vpc_freq", "vfib_amplitude", "pwave", "rate", "pr_interval",
+	"qrs_interval", "bps_sys", "bps_dia", "nibp_rate", "nibp_read", "nibp_freq",
+	"heart_sound_volume", "heart_sound_mute", "heart_sound", "right_dorsal_pulse_strength",
+	"left_dorsal_pulse_strength", "right_femoral_pulse_strength", "left_femoral_pulse_strength",
+	NULL
+};
+const char *respirationChain[] =
+{
+	"inhalation_duration", "exhalation_duration", "left_lung_sound_volume", "left_lung_sound_mute",
+	"right_lung_sound_volume", "right_lung_sound_mute", "left_lung_sound", "right_lung_sound",
+	"rate", "awRR", "chest_movement",
+	NULL
+};
+
+// Keys in the order the sim-mgr sends them, with representative values
+struct statusKey
+{
+	int section;	// 0 cardiac, 1 respiration
+	const char *key;
+	const char *value;
+};
+
+struct statusKey statusKeys[] =
+{
+	{ 0, "rhythm", "sinus" }, { 0, "vpc", "none" }, { 0, "vpc_freq", "0" }, { 0, "vfib_amplitude", "high" },
+	{ 0, "pea", "0" }, { 0, "rate", "80" }, { 0, "pwave", "none" }, { 0, "pr_interval", "140" },
+	{ 0, "qrs_interval", "85" }, { 0, "bps_sys", "105" }, { 0, "bps_dia", "70" }, { 0, "nibp_rate", "80" },
+	{ 0, "nibp_read", "-1" }, { 0, "nibp_freq", "0" }, { 0, "right_dorsal_pulse_strength", "medium" },
+	{ 0, "right_femoral_pulse_strength", "medium" }, { 0, "left_dorsal_pulse_strength", "medium" },
+	{ 0, "left_femoral_pulse_strength", "medium" }, { 0, "heart_sound", "normal" },
+	{ 0, "heart_sound_volume", "10" }, { 0, "heart_sound_mute", "0" }, { 0, "ecg_indicator", "0" },
+	{ 1, "left_lung_sound", "normal" }, { 1, "left_lung_sound_volume", "10" }, { 1, "left_lung_sound_mute", "0" },
+	{ 1, "right_lung_sound", "normal" }, { 1, "right_lung_sound_volume", "10" }, { 1, "right_lung_sound_mute", "0" },
+	{ 1, "inhalation_duration", "1350" }, { 1, "exhalation_duration", "1050" }, { 1, "rate", "20" },
+	{ 1, "awRR", "20" }, { 1, "chest_movement", "1" }, { 1, "transfer_status", "0" },
+	{ 0, NULL, NULL }
+};
+
+// Cost of the old dispatch: compare against each name until a match
+int
+chainLookup(const char **chain, const char *key )
+{
+	int i;
+
+	for ( i = 0 ; chain[i] ; i++ )
+	{
+		if ( strcmp(key, chain[i] ) == 0 )
+		{
+			return ( i );
+		}
+	}
+	return ( -1 );
+}
+
+void
+fieldBench(int iterations )
+{
+	struct cardiac card;
+	struct respiration resp;
+	double start;
+	double chainTime;
+	double tableTime;
+	int found = 0;
+	int i;
+	int k = 0;
+
+	memset(&card, 0, sizeof(card) );
+	memset(&resp, 0, sizeof(resp) );
+	start = now();
+	for ( i = 0 ; i < iterations ; i++ )
+	{
+		for ( k = 0 ; statusKeys[k].key ; k++ )
+		{
+			if ( chainLookup(statusKeys[k].section ? respirationChain : cardiacChain, statusKeys[k].key ) >= 0 )
+			{
+				found++;
+			}
+		}
+	}
+	chainTime = now() - start;
+
+	start = now();
+	for ( i = 0 ; i < iterations ; i++ )
+	{
+		for ( k = 0 ; statusKeys[k].key ; k++ )
+		{
+			if ( statusKeys[k].section )
+			{
+				respiration_parse(statusKeys[k].key, statusKeys[k].value, &resp );
+			}
+			else
+			{
+				cardiac_parse(statusKeys[k].key, statusKeys[k].value, &card );
+			}
+		}
+	}
+	tableTime = now() - start;
+
+	printf("Field dispatch, %d keys per status (%d matched):\n", k, found / iterations );
+	printf("strcmp chain lookup only: %8.3f usec/status\n", chainTime * 1e6 / iterations );
+	printf("table lookup and store:   %8.3f usec/status\n", tableTime * 1e6 / iterations );
+}
+
+int
+main(int argc, char *argv[] )
+{
+	int c;
+	int sections = 2;
+	int keys = 25;
+	int block = 1448;
+	int iterations = 10000;
+	int i;
+	double start;
+	double lineTime;
+	double jsonTime;
+	unsigned int lineValues;
+
+	while (( c = getopt(argc, argv, "k:s:b:n:" ) ) != -1 )
+	{
+		switch ( c )
+		{
+			case 'k':
+				keys = atoi(optarg );
+				break;
+			case 's':
+				sections = atoi(optarg );
+				break;
+			case 'b':
+				block = atoi(optarg );
+				break;
+			case 'n':
+				iterations = atoi(optarg );
+				break;
+			default:
+				printf("Usage: %s [-k keys_per_section] [-s sections] [-b block_size] [-n iterations]\n", argv[0] );
+				exit ( 0 );
+		}
+	}
+	if ( runChecks() )
+	{
+		exit ( -1 );
+	}
+	doc = (char *)malloc(DOC_MAX );
+	if ( sections * keys * 48 > DOC_MAX - 1024 )
+	{
+		printf("Document too large\n" );
+		exit ( -1 );
+	}
+	makeDoc(sections, keys );
+
+	values = 0;
+	start = now();
+	for ( i = 0 ; i < iterations ; i++ )
+	{
+		lineParse();
+	}
+	lineTime = now() - start;
+	lineValues = values;
+
+	values = 0;
+	start = now();
+	for ( i = 0 ; i < iterations ; i++ )
+	{
+		jsonParse(block );
+	}
+	jsonTime = now() - start;
+
+	printf("Document: %d bytes, %d values, block size %d, %d iterations\n", docLen, sections * keys, block, iterations );
+	printf("line parse: %8.3f usec/doc %8.1f MB/s (%u values)\n",
+		lineTime * 1e6 / iterations, ( (double)docLen * iterations ) / lineTime / 1e6, lineValues );
+	printf("JSON parse: %8.3f usec/doc %8.1f MB/s (%u values)\n",
+		jsonTime * 1e6 / iterations, ( (double)docLen * iterations ) / jsonTime / 1e6, values );
+
+	fieldBench(iterations * 10 );
+	return ( 0 );
+}
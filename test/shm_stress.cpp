@@ -0,0 +1,811 @@
+/*
+ * shm_stress.cpp
+ *
+ * This file is part of the sim-ctl distribution (https://github.com/OpenVetSimDevelopers/sim-ctl).
+ * 
+ * Copyright (c) 2019 VetSim, Cornell University College of Veterinary Medicine Ithaca, NY
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * shmData seqlock stress test
+ *
+ * Writer processes update the cardiac, auscultation and pulse sections of a shared
+ * shmData as fast as they can, each update setting every field from one counter.
+ * Reader processes copy the sections with shmSnapshot() and check that all the fields
+ * of each copy came from the same update. A copy that mixes two updates is a tear.
+ *
+ * With -u the writers and readers skip the seqlock, to show that tears are seen
+ * without it. The shmData is an anonymous shared mapping, so the test does not
+ * disturb a running sim-ctl.
+ *
+ * -w pauses each writer between updates, 100 usec by default, as the daemons pause.
+ * With -w 0 the writers never pause; on a single core the readers then spend their
+ * turns waiting out writes that were preempted part way. The time per read shown is
+ * the readers' CPU time, as their wall time is mostly the other processes' turns.
+ *
+ * Then a writer exits in the middle of a write, and the test checks that readers wait
+ * no more than SHM_WRITER_STALE_MS for it, and that the writer's next instance carries on.
+ *
+ * -n instead times shmChangeWait(): a child waits for cardiac changes while the parent
+ * publishes n of them, mixed with pulse changes the child is not waiting for. Then it
+ * checks that the pulse changes do not stretch a timeout.
+ *
+ * -s instead tests the sensor rings: a writer logs samples of four equal values, one
+ * more each time, every -w usec, and readers follow it with sensorRingRead(), checking
+ * that every sample is whole and in order. Samples the readers fell too far behind to
+ * get are counted as lost, not as errors.
+ *
+ * -b instead times the soundSense main loop pass (a change check and snapshots of the
+ * sections it reads), first alone and then with the sensor daemons' writes going on
+ * in other processes: pulse, cprScan and breathSense logging their readings, and
+ * rfidScan moving the auscultation tag. Each writer pauses -w usec between writes
+ * (default 1000). This shows what writes to other parts of shmData cost the reader.
+ *
+ * Exits non-zero if a locked run sees a tear, an abandoned write is not recovered, a
+ * change notification is missed, or a ring sample is bad.
+ *
+ * Usage: shm_stress [-t seconds] [-r readers] [-w usec] [-u] [-n changes] [-s] [-b]
+*/
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "../comm/shmData.h"
+#include "../comm/simUtil.h"
+
+struct shmData *shmData;
+int debug = 0;
+char msgbuf[2048];
+
+#define READERS_MAX		8
+
+struct readerStats
+{
+	long long reads[SHM_SECTIONS];
+	long long tears[SHM_SECTIONS];
+	long long nsec;
+};
+
+struct stressResults
+{
+	volatile int stop;
+	long long writes[SHM_SECTIONS];
+	struct readerStats readers[READERS_MAX];
+	
+	// shmChangeWait() timing (-n)
+	volatile long long published;	// nsec, time of the latest cardiac publish
+	long long latencySum;
+	long long latencyMax;
+	int woken;
+	int missed;
+	long long timeoutNsec;			// Time taken by a 200 msec timeout
+	
+	// Sensor ring (-s)
+	long long samples;
+	long long ringRead[READERS_MAX];
+	long long ringLost[READERS_MAX];
+	long long ringBad[READERS_MAX];
+	
+	// Reader pass timing (-b)
+	long long benchWrites;
+};
+
+#define NOTIFY_TIMEOUT_MS	200
+
+struct stressResults *results;
+int unlocked = 0;
+int writePause = -1;	// usec between updates, -1 for the test's default
+
+long long
+nowNsec(void )
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts );
+	return ( (long long)ts.tv_sec * 1000000000 + ts.tv_nsec );
+}
+
+// CPU time used by this process. A reader's wall time on a busy machine is mostly
+// other processes' turns.
+long long
+cpuNsec(void )
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts );
+	return ( (long long)ts.tv_sec * 1000000000 + ts.tv_nsec );
+}
+
+void
+writeCardiac(int k )
+{
+	struct cardiac *c = &shmData->cardiac;
+
+	c->rate = k;
+	sprintf(c->heart_sound, "sound%d", k );
+	sprintf(c->rhythm, "rhythm%d", k );
+	c->pea = k & 1;
+	c->bps_sys = k;
+	c->bps_dia = k;
+	c->heart_sound_volume = k;
+}
+
+int
+checkCardiac(struct cardiac *c )
+{
+	char buf[STR_SIZE];
+	int k = c->rate;
+
+	sprintf(buf, "sound%d", k );
+	if ( strcmp(buf, c->heart_sound ) != 0 )
+	{
+		return ( 0 );
+	}
+	sprintf(buf, "rhythm%d", k );
+	if ( strcmp(buf, c->rhythm ) != 0 )
+	{
+		return ( 0 );
+	}
+	return ( c->pea == ( k & 1 ) && c->bps_sys == k && c->bps_dia == k && c->heart_sound_volume == k );
+}
+
+void
+writeAuscultation(int k )
+{
+	struct auscultation *a = &shmData->auscultation;
+
+	a->side = k;
+	a->row = k;
+	a->col = k;
+	a->heartStrength = k;
+	a->leftLungStrength = k;
+	a->rightLungStrength = k;
+	sprintf(a->tag, "%d", k );
+}
+
+int
+checkAuscultation(struct auscultation *a )
+{
+	char buf[STR_SIZE];
+	int k = a->side;
+
+	sprintf(buf, "%d", k );
+	return ( a->row == k && a->col == k && a->heartStrength == k && a->leftLungStrength == k &&
+			 a->rightLungStrength == k && strcmp(buf, a->tag ) == 0 );
+}
+
+void
+writePulse(int k )
+{
+	struct pulse *p = &shmData->pulse;
+	int i;
+
+	p->right_dorsal = k;
+	p->left_dorsal = k;
+	p->right_femoral = k;
+	p->left_femoral = k;
+	for ( i = 0 ; i < PULSE_POINTS_MAX ; i++ )
+	{
+		p->ain[i] = k;
+		p->touch[i] = k;
+		p->base[i] = k;
+	}
+}
+
+int
+checkPulse(struct pulse *p )
+{
+	int i;
+	int k = p->right_dorsal;
+
+	if ( p->left_dorsal != k || p->right_femoral != k || p->left_femoral != k )
+	{
+		return ( 0 );
+	}
+	for ( i = 0 ; i < PULSE_POINTS_MAX ; i++ )
+	{
+		if ( p->ain[i] != k || p->touch[i] != k || p->base[i] != k )
+		{
+			return ( 0 );
+		}
+	}
+	return ( 1 );
+}
+
+void
+writer(int section )
+{
+	int k = 0;
+
+	while ( ! results->stop )
+	{
+		k++;
+		if ( ! unlocked )
+		{
+			shmWriteBegin(section );
+		}
+		switch ( section )
+		{
+			case SHM_SECTION_CARDIAC:
+				writeCardiac(k );
+				break;
+			case SHM_SECTION_AUSCULTATION:
+				writeAuscultation(k );
+				break;
+			case SHM_SECTION_PULSE:
+				writePulse(k );
+				break;
+		}
+		if ( ! unlocked )
+		{
+			shmWriteEnd(section );
+		}
+		if ( writePause )
+		{
+			usleep(writePause );
+		}
+	}
+	results->writes[section] = k;
+	exit ( 0 );
+}
+
+void
+reader(int r )
+{
+	struct readerStats *rs = &results->readers[r];
+	struct cardiac cardiac;
+	struct auscultation auscultation;
+	struct pulse pulse;
+
+	while ( ! results->stop )
+	{
+		if ( unlocked )
+		{
+			memcpy(&cardiac, (void *)&shmData->cardiac, sizeof(cardiac ) );
+			memcpy(&auscultation, (void *)&shmData->auscultation, sizeof(auscultation ) );
+			memcpy(&pulse, (void *)&shmData->pulse, sizeof(pulse ) );
+		}
+		else
+		{
+			shmSnapshot(SHM_SECTION_CARDIAC, &cardiac );
+			shmSnapshot(SHM_SECTION_AUSCULTATION, &auscultation );
+			shmSnapshot(SHM_SECTION_PULSE, &pulse );
+		}
+		rs->reads[SHM_SECTION_CARDIAC]++;
+		rs->reads[SHM_SECTION_AUSCULTATION]++;
+		rs->reads[SHM_SECTION_PULSE]++;
+		if ( ! checkCardiac(&cardiac ) )
+		{
+			rs->tears[SHM_SECTION_CARDIAC]++;
+		}
+		if ( ! checkAuscultation(&auscultation ) )
+		{
+			rs->tears[SHM_SECTION_AUSCULTATION]++;
+		}
+		if ( ! checkPulse(&pulse ) )
+		{
+			rs->tears[SHM_SECTION_PULSE]++;
+		}
+	}
+	rs->nsec = cpuNsec();
+	exit ( 0 );
+}
+
+void
+notifyWaiter(int count )
+{
+	struct shmChangeReader reader;
+	unsigned int masks[SHM_SECTIONS];
+	long long latency;
+	long long start;
+	int i;
+
+	memset(&reader, 0, sizeof(reader ) );
+	shmChangeCheck(&reader, masks );
+	results->stop = 1;		// Ready
+	for ( i = 0 ; i < count ; i++ )
+	{
+		if ( shmChangeWait(&reader, ( 1 << SHM_SECTION_CARDIAC ), masks, 1000 ) == 0 ||
+			 ! ( masks[SHM_SECTION_CARDIAC] & CHG_CARDIAC_RATE ) )
+		{
+			results->missed++;
+			continue;
+		}
+		latency = nowNsec() - results->published;
+		results->latencySum += latency;
+		if ( latency > results->latencyMax )
+		{
+			results->latencyMax = latency;
+		}
+		results->woken++;
+	}
+	
+	// Nothing more is published to cpr
+	start = nowNsec();
+	if ( shmChangeWait(&reader, ( 1 << SHM_SECTION_CPR ), masks, NOTIFY_TIMEOUT_MS ) == 0 )
+	{
+		results->timeoutNsec = nowNsec() - start;
+	}
+	results->stop = 2;		// Done
+	exit ( 0 );
+}
+
+int
+notifyTest(int count )
+{
+	int i;
+	int fail = 0;
+
+	if ( fork() == 0 )
+	{
+		notifyWaiter(count );
+	}
+	while ( results->stop == 0 )
+	{
+		usleep(1000 );
+	}
+	usleep(10000 );
+	for ( i = 0 ; i < count ; i++ )
+	{
+		shmChangePublish(SHM_SECTION_PULSE, CHG_PULSE_PRESSURE );
+		usleep(1000 );
+		results->published = nowNsec();
+		shmChangePublish(SHM_SECTION_CARDIAC, CHG_CARDIAC_RATE );
+		usleep(2000 );
+	}
+	while ( results->stop != 2 )
+	{
+		shmChangePublish(SHM_SECTION_PULSE, CHG_PULSE_PRESSURE );
+		usleep(20000 );
+	}
+	wait(NULL );
+
+	printf("shmChangeWait: %d changes, %d woken, %d missed\n", count, results->woken, results->missed );
+	if ( results->woken )
+	{
+		printf("Publish to wake up: average %lld usec, max %lld usec\n",
+			results->latencySum / results->woken / 1000, results->latencyMax / 1000 );
+	}
+	printf("%d msec timeout, with other sections changing every 20 msec: %lld msec\n",
+		NOTIFY_TIMEOUT_MS, results->timeoutNsec / 1000000 );
+	if ( results->missed )
+	{
+		printf("FAIL: missed changes\n" );
+		fail = 1;
+	}
+	if ( results->timeoutNsec < NOTIFY_TIMEOUT_MS * 1000000LL || results->timeoutNsec > NOTIFY_TIMEOUT_MS * 1500000LL )
+	{
+		printf("FAIL: timeout\n" );
+		fail = 1;
+	}
+	return ( fail );
+}
+
+void
+ringWriter(void )
+{
+	int values[SENSOR_VALUES];
+	int k = 0;
+	int i;
+
+	while ( ! results->stop )
+	{
+		k++;
+		for ( i = 0 ; i < SENSOR_VALUES ; i++ )
+		{
+			values[i] = k;
+		}
+		sensorRingPut(&shmData->sensors.pulse, values, SENSOR_VALUES );
+		if ( writePause )
+		{
+			usleep(writePause );
+		}
+	}
+	results->samples = k;
+	exit ( 0 );
+}
+
+void
+ringReader(int r )
+{
+	struct sensorRingReader reader;
+	struct sensorSample samples[64];
+	int last = 0;
+	long long lastWhen = 0;
+	int count;
+	int i;
+	int v;
+
+	memset(&reader, 0, sizeof(reader ) );
+	while ( 1 )
+	{
+		count = sensorRingRead(&shmData->sensors.pulse, &reader, samples, 64 );
+		for ( i = 0 ; i < count ; i++ )
+		{
+			for ( v = 1 ; v < SENSOR_VALUES ; v++ )
+			{
+				if ( samples[i].values[v] != samples[i].values[0] )
+				{
+					results->ringBad[r]++;
+					break;
+				}
+			}
+			if ( samples[i].values[0] <= last || samples[i].when < lastWhen ||
+				 (unsigned int)samples[i].values[0] != samples[i].seq )
+			{
+				results->ringBad[r]++;
+			}
+			last = samples[i].values[0];
+			lastWhen = samples[i].when;
+		}
+		results->ringRead[r] += count;
+		if ( count == 0 )
+		{
+			if ( results->stop )
+			{
+				break;
+			}
+			sched_yield();
+		}
+	}
+	results->ringLost[r] = reader.lost;
+	exit ( 0 );
+}
+
+int
+ringTest(int seconds, int readers )
+{
+	long long bad = 0;
+	int r;
+
+	if ( fork() == 0 )
+	{
+		ringWriter();
+	}
+	for ( r = 0 ; r < readers ; r++ )
+	{
+		if ( fork() == 0 )
+		{
+			ringReader(r );
+		}
+	}
+	sleep(seconds );
+	results->stop = 1;
+	while ( wait(NULL ) > 0 )
+	{
+	}
+	printf("Sensor ring, %d readers, %d seconds: %lld samples written\n", readers, seconds, results->samples );
+	for ( r = 0 ; r < readers ; r++ )
+	{
+		printf("reader %d: %lld read, %lld lost, %lld bad\n", r, results->ringRead[r], results->ringLost[r], results->ringBad[r] );
+		bad += results->ringBad[r];
+	}
+	if ( bad )
+	{
+		printf("FAIL: bad ring samples\n" );
+		return ( 1 );
+	}
+	return ( 0 );
+}
+
+// The writes of one sensor daemon, as in pulse.c, cprScan.cpp, breathSense.c and rfidScan.cpp
+void
+benchWriter(int which )
+{
+	int values[SENSOR_VALUES];
+	int k = 0;
+	int i;
+
+	while ( ! results->stop )
+	{
+		k++;
+		for ( i = 0 ; i < SENSOR_VALUES ; i++ )
+		{
+			values[i] = k + i;
+		}
+		switch ( which )
+		{
+			case 0:
+				shmWriteBegin(SHM_SECTION_PULSE );
+				for ( i = 1 ; i < PULSE_POINTS_MAX ; i++ )
+				{
+					shmData->pulse.ain[i] = k;
+					shmData->pulse.base[i] = k;
+				}
+				shmWriteEnd(SHM_SECTION_PULSE );
+				sensorRingPut(&shmData->sensors.pulse, values, 4 );
+				break;
+			case 1:
+				shmWriteBegin(SHM_SECTION_CPR );
+				shmData->cpr.x = k;
+				shmData->cpr.y = k;
+				shmData->cpr.z = k;
+				shmWriteEnd(SHM_SECTION_CPR );
+				sensorRingPut(&shmData->sensors.cpr, values, 3 );
+				break;
+			case 2:
+				shmData->manual_breath_ain = k;
+				sensorRingPut(&shmData->sensors.breath, values, 1 );
+				break;
+			case 3:
+				writeAuscultation(k );
+				shmChangePublish(SHM_SECTION_AUSCULTATION, CHG_AUSC_POSITION );
+				break;
+		}
+		if ( which == 3 )
+		{
+			// A tag is read far less often
+			usleep(writePause * 100 );
+		}
+		else
+		{
+			usleep(writePause );
+		}
+	}
+	__sync_fetch_and_add(&results->benchWrites, k );
+	exit ( 0 );
+}
+
+// One pass of the soundSense main loop, as far as shmData is concerned
+long long
+benchPasses(int seconds )
+{
+	struct shmChangeReader reader;
+	unsigned int masks[SHM_SECTIONS];
+	struct cardiac cardiac;
+	struct respiration respiration;
+	struct auscultation auscultation;
+	struct pulse pulse;
+	long long start;
+	long long end;
+	long long passes = 0;
+	volatile int sink = 0;
+
+	memset(&reader, 0, sizeof(reader ) );
+	start = nowNsec();
+	end = start + seconds * 1000000000LL;
+	do
+	{
+		for ( int i = 0 ; i < 1000 ; i++ )
+		{
+			shmChangeCheck(&reader, masks );
+			shmSnapshot(SHM_SECTION_CARDIAC, &cardiac );
+			shmSnapshot(SHM_SECTION_RESPIRATION, &respiration );
+			shmSnapshot(SHM_SECTION_AUSCULTATION, &auscultation );
+			shmSnapshot(SHM_SECTION_PULSE, &pulse );
+			sink += cardiac.rate + respiration.rate + auscultation.side + pulse.right_dorsal + shmData->sync.comm.up;
+		}
+		passes += 1000;
+	} while ( nowNsec() < end );
+	return ( ( nowNsec() - start ) / passes );
+}
+
+/*
+ * A writer that exits between shmWriteBegin() and shmWriteEnd(), as a daemon killed
+ * mid-write would. The next read should wait SHM_WRITER_STALE_MS and go on, later
+ * reads should not wait, and the writer's next instance should carry on from it.
+*/
+int
+abandonTest(void )
+{
+	struct cardiac cardiac;
+	struct shmSeqlock *lock = &shmData->seqlock[SHM_SECTION_CARDIAC];
+	struct shmSeqlockReaders *readers = &shmData->seqlockReaders[SHM_SECTION_CARDIAC];
+	long long first;
+	long long second;
+	int fail = 0;
+
+	if ( fork() == 0 )
+	{
+		shmWriteBegin(SHM_SECTION_CARDIAC );
+		shmData->cardiac.rate = -1;
+		_exit ( 0 );
+	}
+	wait(NULL );
+	first = nowNsec();
+	shmSnapshot(SHM_SECTION_CARDIAC, &cardiac );
+	first = nowNsec() - first;
+	second = nowNsec();
+	shmSnapshot(SHM_SECTION_CARDIAC, &cardiac );
+	second = nowNsec() - second;
+	shmWriteBegin(SHM_SECTION_CARDIAC );
+	writeCardiac(1 );
+	shmWriteEnd(SHM_SECTION_CARDIAC );
+	shmSnapshot(SHM_SECTION_CARDIAC, &cardiac );
+
+	printf("Abandoned write: first read %lld usec, next %lld usec, %u abandoned, seq %s after the next write\n",
+		first / 1000, second / 1000, readers->abandoned, ( lock->seq & 1 ) ? "odd" : "even" );
+	if ( first > ( SHM_WRITER_STALE_MS + 100 ) * 1000000LL || second > 1000000 ||
+		 readers->abandoned != 1 || ( lock->seq & 1 ) || ! checkCardiac(&cardiac ) || cardiac.rate != 1 )
+	{
+		printf("FAIL: abandoned write not recovered\n" );
+		fail = 1;
+	}
+	return ( fail );
+}
+
+int
+benchTest(int seconds )
+{
+	long long alone;
+	long long busy;
+	int i;
+
+	alone = benchPasses(seconds );
+	for ( i = 0 ; i < 4 ; i++ )
+	{
+		if ( fork() == 0 )
+		{
+			benchWriter(i );
+		}
+	}
+	usleep(100000 );
+	busy = benchPasses(seconds );
+	results->stop = 1;
+	while ( wait(NULL ) > 0 )
+	{
+	}
+	printf("shmData %d bytes, cardiac at %d, pulse at %d, cpr at %d, manual_breath_ain at %d\n",
+		(int)sizeof(struct shmData ), (int)offsetof(struct shmData, cardiac ), (int)offsetof(struct shmData, pulse ),
+		(int)offsetof(struct shmData, cpr ), (int)offsetof(struct shmData, manual_breath_ain ) );
+	printf("Reader pass: %lld nsec alone, %lld nsec with %lld sensor writes (every %d usec per writer)\n",
+		alone, busy, results->benchWrites, writePause );
+	return ( 0 );
+}
+
+int
+main(int argc, char *argv[] )
+{
+	int c;
+	int i;
+	int r;
+	int seconds = 5;
+	int readers = 2;
+	int sections[] = { SHM_SECTION_CARDIAC, SHM_SECTION_AUSCULTATION, SHM_SECTION_PULSE };
+	const char *names[] = { "cardiac", "auscultation", "pulse" };
+	long long reads;
+	long long tears;
+	long long totalTears = 0;
+	long long nsec = 0;
+	long long calls = 0;
+	int notify = 0;
+	int ring = 0;
+	int bench = 0;
+
+	while (( c = getopt(argc, argv, "t:r:w:un:sb" ) ) != -1 )
+	{
+		switch ( c )
+		{
+			case 't':
+				seconds = atoi(optarg );
+				break;
+			case 'r':
+				readers = atoi(optarg );
+				if ( readers < 1 || readers > READERS_MAX )
+				{
+					readers = 2;
+				}
+				break;
+			case 'w':
+				writePause = atoi(optarg );
+				break;
+			case 'u':
+				unlocked = 1;
+				break;
+			case 'n':
+				notify = atoi(optarg );
+				break;
+			case 's':
+				ring = 1;
+				break;
+			case 'b':
+				bench = 1;
+				break;
+			default:
+				printf("Usage: %s [-t seconds] [-r readers] [-w usec] [-u] [-n changes] [-s] [-b]\n", argv[0] );
+				exit ( 0 );
+		}
+	}
+	shmData = (struct shmData *)mmap(NULL, sizeof(struct shmData ), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+	results = (struct stressResults *)mmap(NULL, sizeof(struct stressResults ), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+	if ( shmData == MAP_FAILED || results == MAP_FAILED )
+	{
+		perror("mmap" );
+		exit ( 1 );
+	}
+	if ( writePause < 0 )
+	{
+		// The daemons pause between writes. -w 0 shows writers that never do.
+		writePause = bench ? 1000 : ( ring || notify ) ? 0 : 100;
+	}
+	memset(shmData, 0, sizeof(struct shmData ) );
+	memset(results, 0, sizeof(struct stressResults ) );
+	writeCardiac(0 );
+	writeAuscultation(0 );
+	writePulse(0 );
+	if ( notify > 0 )
+	{
+		return ( notifyTest(notify ) );
+	}
+	if ( ring )
+	{
+		return ( ringTest(seconds, readers ) );
+	}
+	if ( bench )
+	{
+		return ( benchTest(seconds ) );
+	}
+
+	for ( i = 0 ; i < 3 ; i++ )
+	{
+		if ( fork() == 0 )
+		{
+			writer(sections[i] );
+		}
+	}
+	for ( r = 0 ; r < readers ; r++ )
+	{
+		if ( fork() == 0 )
+		{
+			reader(r );
+		}
+	}
+	sleep(seconds );
+	results->stop = 1;
+	while ( wait(NULL ) > 0 )
+	{
+	}
+
+	printf("%s, %d writers, %d readers, %d seconds, writers pause %d usec\n", unlocked ? "Unlocked" : "Seqlock",
+		3, readers, seconds, writePause );
+	for ( i = 0 ; i < 3 ; i++ )
+	{
+		reads = 0;
+		tears = 0;
+		for ( r = 0 ; r < readers ; r++ )
+		{
+			reads += results->readers[r].reads[sections[i]];
+			tears += results->readers[r].tears[sections[i]];
+		}
+		totalTears += tears;
+		printf("%-13s writes %10lld  reads %10lld  retries %9u  torn %lld\n",
+			names[i], results->writes[sections[i]], reads, shmData->seqlockReaders[sections[i]].retries, tears );
+	}
+	for ( r = 0 ; r < readers ; r++ )
+	{
+		nsec += results->readers[r].nsec;
+		calls += results->readers[r].reads[SHM_SECTION_CARDIAC];
+	}
+	if ( calls )
+	{
+		printf("Reader CPU per read of the three sections: %lld nsec\n", nsec / calls );
+	}
+	if ( totalTears && ! unlocked )
+	{
+		printf("FAIL: torn reads with the seqlock\n" );
+		return ( 1 );
+	}
+	if ( ! unlocked )
+	{
+		return ( abandonTest() );
+	}
+	return ( 0 );
+}
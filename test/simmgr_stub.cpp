@@ -0,0 +1,840 @@
+/*
+ * simmgr_stub.cpp
+ *
+ * This file is part of the sim-ctl distribution (https://github.com/OpenVetSimDevelopers/sim-ctl).
+ * 
+ * Copyright (c) 2019 VetSim, Cornell University College of Veterinary Medicine Ithaca, NY
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Local stand-in for the sim-mgr, used to run and benchmark simController (and the
+ * sync clients) on a development machine.
+ *
+ * Serves /cgi-bin/simstatus.cgi on the HTTP port:
+ *		simctrldata=1			Status document (cardiac and respiration sections)
+ *		simctrlsubscribe=1		Status subscription: a chunked response carrying a new
+ *								status document on every change
+ *		date=1					Current date, in the format used by the date command
+ *		set:section:field=val	Set a value. Several may be joined with '&'
+ *
+ * and sends "pulse" and "breath" syncs on SYNC_PORT at the current rates, as binary frames
+ * to clients that send SYNC_HELLO (unless -a, to behave as an older sim-mgr). Discovery
+ * queries on DISCOVER_PORT are answered with the HTTP and sync ports.
+ *
+ * With -c, the cardiac rate is changed every <ms> milliseconds. For every change, the
+ * time until the new value was delivered to simController (by a poll response or a
+ * subscription push) is measured and a summary is printed every 20 changes.
+*/
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "../comm/simCtlComm.h"
+
+#define MAX_CLIENTS		32
+#define IN_BUF_MAX		8192
+#define OUT_BUF_MAX		16384
+#define VALUE_MAX		64
+#define MAX_VALUES		64
+#define KEEPALIVE_MS	5000
+
+#define CLIENT_FREE		0
+#define CLIENT_HTTP		1
+#define CLIENT_SYNC		2
+
+struct client
+{
+	int type;
+	int fd;
+	int subscribed;
+	char in[IN_BUF_MAX+1];
+	int inLen;
+	long long lastSend;
+	int binary;				// Sync client that asked for binary frames
+	unsigned short seq;
+};
+
+struct value
+{
+	char section[VALUE_MAX];
+	char name[VALUE_MAX];
+	char value[VALUE_MAX];
+};
+
+struct client clients[MAX_CLIENTS];
+struct value values[MAX_VALUES];
+int valueCount = 0;
+
+int verbose = 0;
+int httpPort = 80;
+int changeInterval = 0;		// ms between generated rate changes, 0 for none
+int asciiOnly = 0;			// Ignore SYNC_HELLO, as an older sim-mgr does
+int loseEvery = 0;			// Drop every Nth binary frame, 0 for none
+int noSync = 0;				// Leave SYNC_PORT to syncReplay
+
+// Change delivery measurement
+long long changeTime = 0;	// Time of the last undelivered change, 0 when delivered
+unsigned int changes = 0;
+unsigned int delivered = 0;
+long long latencySum = 0;
+long long latencyMax = 0;
+unsigned int pollRequests = 0;
+unsigned int pushes = 0;
+
+long long
+nowMs(void )
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts );
+	return ( (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000 );
+}
+
+long long
+nowUs(void )
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts );
+	return ( (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 );
+}
+
+struct value *
+findValue(const char *section, const char *name )
+{
+	int i;
+
+	for ( i = 0 ; i < valueCount ; i++ )
+	{
+		if ( strcmp(values[i].section, section ) == 0 && strcmp(values[i].name, name ) == 0 )
+		{
+			return ( &values[i] );
+		}
+	}
+	return ( NULL );
+}
+
+void
+setValue(const char *section, const char *name, const char *value )
+{
+	struct value *v = findValue(section, name );
+
+	if ( ! v )
+	{
+		if ( valueCount >= MAX_VALUES )
+		{
+			return;
+		}
+		v = &values[valueCount++];
+		snprintf(v->section, VALUE_MAX, "%s", section );
+		snprintf(v->name, VALUE_MAX, "%s", name );
+	}
+	snprintf(v->value, VALUE_MAX, "%s", value );
+}
+
+int
+getIntValue(const char *section, const char *name, int def )
+{
+	struct value *v = findValue(section, name );
+
+	return ( v ? atoi(v->value ) : def );
+}
+
+void
+initValues(void )
+{
+	setValue("cardiac", "rhythm", "sinus" );
+	setValue("cardiac", "vpc", "none" );
+	setValue("cardiac", "vpc_freq", "0" );
+	setValue("cardiac", "vfib_amplitude", "high" );
+	setValue("cardiac", "pea", "0" );
+	setValue("cardiac", "rate", "80" );
+	setValue("cardiac", "pwave", "none" );
+	setValue("cardiac", "pr_interval", "140" );
+	setValue("cardiac", "qrs_interval", "85" );
+	setValue("cardiac", "bps_sys", "105" );
+	setValue("cardiac", "bps_dia", "70" );
+	setValue("cardiac", "nibp_rate", "80" );
+	setValue("cardiac", "nibp_read", "-1" );
+	setValue("cardiac", "nibp_freq", "0" );
+	setValue("cardiac", "right_dorsal_pulse_strength", "medium" );
+	setValue("cardiac", "right_femoral_pulse_strength", "medium" );
+	setValue("cardiac", "left_dorsal_pulse_strength", "medium" );
+	setValue("cardiac", "left_femoral_pulse_strength", "medium" );
+	setValue("cardiac", "heart_sound", "normal" );
+	setValue("cardiac", "heart_sound_volume", "10" );
+	setValue("cardiac", "heart_sound_mute", "0" );
+
+	setValue("respiration", "left_lung_sound", "normal" );
+	setValue("respiration", "left_lung_sound_volume", "10" );
+	setValue("respiration", "left_lung_sound_mute", "0" );
+	setValue("respiration", "right_lung_sound", "normal" );
+	setValue("respiration", "right_lung_sound_volume", "10" );
+	setValue("respiration", "right_lung_sound_mute", "0" );
+	setValue("respiration", "inhalation_duration", "1350" );
+	setValue("respiration", "exhalation_duration", "1050" );
+	setValue("respiration", "rate", "20" );
+	setValue("respiration", "awRR", "20" );
+	setValue("respiration", "chest_movement", "1" );
+}
+
+// Status document, one key per line as sent by the sim-mgr
+int
+makeStatus(char *buf, int bufLen )
+{
+	const char *sections[] = { "cardiac", "respiration" };
+	int len = 0;
+	int s;
+	int i;
+	int first;
+
+	len += snprintf(&buf[len], bufLen - len, "{\n" );
+	for ( s = 0 ; s < 2 ; s++ )
+	{
+		len += snprintf(&buf[len], bufLen - len, " \"%s\" : {\n", sections[s] );
+		first = 1;
+		for ( i = 0 ; i < valueCount ; i++ )
+		{
+			if ( strcmp(values[i].section, sections[s] ) == 0 )
+			{
+				len += snprintf(&buf[len], bufLen - len, "%s  \"%s\" : \"%s\"",
+					first ? "" : ",\n", values[i].name, values[i].value );
+				first = 0;
+			}
+		}
+		len += snprintf(&buf[len], bufLen - len, "\n }%s\n", ( s == 0 ) ? "," : "" );
+	}
+	len += snprintf(&buf[len], bufLen - len, "}\n" );
+	return ( len );
+}
+
+int
+sendAll(int fd, const char *buf, int len )
+{
+	int sent = 0;
+	int sts;
+
+	while ( sent < len )
+	{
+		sts = write(fd, &buf[sent], len - sent );
+		if ( sts <= 0 )
+		{
+			return ( -1 );
+		}
+		sent += sts;
+	}
+	return ( 0 );
+}
+
+void
+closeClient(struct client *cl )
+{
+	close(cl->fd );
+	cl->type = CLIENT_FREE;
+	cl->fd = -1;
+}
+
+void
+noteDelivery(void )
+{
+	long long latency;
+
+	if ( changeTime == 0 )
+	{
+		return;
+	}
+	latency = nowUs() - changeTime;
+	changeTime = 0;
+	delivered++;
+	latencySum += latency;
+	if ( latency > latencyMax )
+	{
+		latencyMax = latency;
+	}
+	if ( ( delivered % 20 ) == 0 )
+	{
+		printf("changes %u delivered %u: latency avg %lld max %lld usec (polls %u, pushes %u)\n",
+			changes, delivered, latencySum / delivered, latencyMax, pollRequests, pushes );
+	}
+}
+
+void
+sendResponse(struct client *cl, const char *body, int len )
+{
+	char hdr[256];
+	int hlen;
+
+	hlen = snprintf(hdr, sizeof(hdr),
+		"HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: %d\r\n\r\n", len );
+	if ( sendAll(cl->fd, hdr, hlen ) || sendAll(cl->fd, body, len ) )
+	{
+		closeClient(cl );
+	}
+}
+
+// Send one chunk of a chunked (subscription) response
+int
+sendChunk(struct client *cl, const char *body, int len )
+{
+	char hdr[32];
+	int hlen;
+
+	hlen = snprintf(hdr, sizeof(hdr), "%x\r\n", len );
+	if ( sendAll(cl->fd, hdr, hlen ) || sendAll(cl->fd, body, len ) || sendAll(cl->fd, "\r\n", 2 ) )
+	{
+		closeClient(cl );
+		return ( -1 );
+	}
+	cl->lastSend = nowMs();
+	return ( 0 );
+}
+
+void
+pushStatus(void )
+{
+	char body[OUT_BUF_MAX];
+	int len;
+	int i;
+	int sent = 0;
+
+	len = makeStatus(body, OUT_BUF_MAX );
+	for ( i = 0 ; i < MAX_CLIENTS ; i++ )
+	{
+		if ( clients[i].type == CLIENT_HTTP && clients[i].subscribed )
+		{
+			if ( sendChunk(&clients[i], body, len ) == 0 )
+			{
+				sent++;
+			}
+		}
+	}
+	if ( sent )
+	{
+		pushes++;
+		noteDelivery();
+	}
+}
+
+void
+handleQuery(struct client *cl, char *query )
+{
+	char body[OUT_BUF_MAX];
+	int len = 0;
+	char *param;
+	char *save;
+	char *field;
+	char *eq;
+	char *colon;
+	time_t now;
+	struct tm tm;
+	const char *hdr;
+	int changed = 0;
+
+	for ( param = strtok_r(query, "&", &save ) ; param ; param = strtok_r(NULL, "&", &save ) )
+	{
+		if ( strncmp(param, "set:", 4 ) == 0 )
+		{
+			field = param + 4;
+			eq = strchr(field, '=' );
+			colon = strchr(field, ':' );
+			if ( eq && colon && colon < eq )
+			{
+				*eq = 0;
+				*colon = 0;
+				setValue(field, colon + 1, eq + 1 );
+				if ( verbose )
+				{
+					printf("set %s:%s = %s\n", field, colon + 1, eq + 1 );
+				}
+				if ( strcmp(field, "cardiac" ) == 0 || strcmp(field, "respiration" ) == 0 )
+				{
+					changed = 1;
+				}
+			}
+			len = snprintf(body, OUT_BUF_MAX, "{\n \"status\" : \"ok\"\n}\n" );
+		}
+		else if ( strcmp(param, "simctrldata=1" ) == 0 )
+		{
+			len = makeStatus(body, OUT_BUF_MAX );
+			pollRequests++;
+			noteDelivery();
+		}
+		else if ( strcmp(param, "date=1" ) == 0 )
+		{
+			now = time(NULL );
+			localtime_r(&now, &tm );
+			len = snprintf(body, OUT_BUF_MAX, "{\n \"date\" : \"%02d%02d%02d%02d%04d.%02d\"\n}\n",
+				tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_year + 1900, tm.tm_sec );
+		}
+		else if ( strcmp(param, "simctrlsubscribe=1" ) == 0 )
+		{
+			hdr = "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nTransfer-Encoding: chunked\r\n\r\n";
+			if ( sendAll(cl->fd, hdr, strlen(hdr ) ) )
+			{
+				closeClient(cl );
+				return;
+			}
+			cl->subscribed = 1;
+			len = makeStatus(body, OUT_BUF_MAX );
+			sendChunk(cl, body, len );
+			if ( verbose )
+			{
+				printf("subscriber on fd %d\n", cl->fd );
+			}
+			return;
+		}
+	}
+	if ( len == 0 )
+	{
+		len = snprintf(body, OUT_BUF_MAX, "{\n \"status\" : \"unknown request\"\n}\n" );
+	}
+	sendResponse(cl, body, len );
+	if ( changed )
+	{
+		changeTime = nowUs();
+		changes++;
+		pushStatus();
+	}
+}
+
+void
+handleHttp(struct client *cl )
+{
+	char *end;
+	char *query;
+	char *sp;
+	int used;
+
+	while ( cl->type == CLIENT_HTTP && ! cl->subscribed && ( end = strstr(cl->in, "\r\n\r\n" ) ) != NULL )
+	{
+		used = ( end - cl->in ) + 4;
+		*end = 0;
+		// Request line: GET /cgi-bin/simstatus.cgi?query HTTP/1.1
+		sp = strchr(cl->in, ' ' );
+		query = sp ? strchr(sp, '?' ) : NULL;
+		if ( query )
+		{
+			query++;
+			sp = strchr(query, ' ' );
+			if ( sp )
+			{
+				*sp = 0;
+			}
+			handleQuery(cl, query );
+		}
+		else
+		{
+			sendResponse(cl, "{}\n", 3 );
+		}
+		if ( cl->type == CLIENT_FREE )
+		{
+			return;
+		}
+		memmove(cl->in, &cl->in[used], cl->inLen - used + 1 );
+		cl->inLen -= used;
+	}
+}
+
+int
+openServer(int port )
+{
+	int fd;
+	int on = 1;
+	struct sockaddr_in addr;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0 );
+	if ( fd < 0 )
+	{
+		perror("socket" );
+		exit ( -1 );
+	}
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on) );
+	memset(&addr, 0, sizeof(addr) );
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port );
+	addr.sin_addr.s_addr = htonl(INADDR_ANY );
+	if ( bind(fd, (struct sockaddr *)&addr, sizeof(addr) ) < 0 || listen(fd, 8 ) < 0 )
+	{
+		fprintf(stderr, "port %d: %s\n", port, strerror(errno ) );
+		exit ( -1 );
+	}
+	return ( fd );
+}
+
+int
+openDiscover(void )
+{
+	int fd;
+	int on = 1;
+	struct sockaddr_in addr;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0 );
+	if ( fd < 0 )
+	{
+		perror("socket" );
+		exit ( -1 );
+	}
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on) );
+	memset(&addr, 0, sizeof(addr) );
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(DISCOVER_PORT );
+	addr.sin_addr.s_addr = htonl(INADDR_ANY );
+	if ( bind(fd, (struct sockaddr *)&addr, sizeof(addr) ) < 0 )
+	{
+		fprintf(stderr, "port %d: %s\n", DISCOVER_PORT, strerror(errno ) );
+		exit ( -1 );
+	}
+	return ( fd );
+}
+
+// Reply to a discovery query. The client takes our address from the reply.
+void
+answerDiscover(int fd )
+{
+	struct sockaddr_in from;
+	socklen_t fromLen = sizeof(from);
+	char buf[128];
+	int len;
+
+	len = recvfrom(fd, buf, sizeof(buf) - 1, 0, (struct sockaddr *)&from, &fromLen );
+	if ( len <= 0 )
+	{
+		return;
+	}
+	buf[len] = 0;
+	if ( strncmp(buf, DISCOVER_QUERY, strlen(DISCOVER_QUERY ) ) != 0 )
+	{
+		return;
+	}
+	len = snprintf(buf, sizeof(buf), "%s - %d %d\n", DISCOVER_REPLY, httpPort, SYNC_PORT );
+	sendto(fd, buf, len, 0, (struct sockaddr *)&from, fromLen );
+	if ( verbose )
+	{
+		printf("discovery query from %s\n", inet_ntoa(from.sin_addr ) );
+	}
+}
+
+void
+acceptClient(int lfd, int type )
+{
+	int fd;
+	int i;
+	int on = 1;
+
+	fd = accept(lfd, NULL, NULL );
+	if ( fd < 0 )
+	{
+		return;
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on) );
+	for ( i = 0 ; i < MAX_CLIENTS ; i++ )
+	{
+		if ( clients[i].type == CLIENT_FREE )
+		{
+			memset(&clients[i], 0, sizeof(struct client ) );
+			clients[i].type = type;
+			clients[i].fd = fd;
+			clients[i].lastSend = nowMs();
+			if ( verbose )
+			{
+				printf("%s client on fd %d\n", ( type == CLIENT_SYNC ) ? "sync" : "http", fd );
+			}
+			return;
+		}
+	}
+	close(fd );
+}
+
+void
+sendSync(int type, const char *msg )
+{
+	struct syncFrame frame;
+	struct timespec ts;
+	int sts;
+	int i;
+
+	clock_gettime(CLOCK_REALTIME, &ts );
+	for ( i = 0 ; i < MAX_CLIENTS ; i++ )
+	{
+		if ( clients[i].type != CLIENT_SYNC )
+		{
+			continue;
+		}
+		if ( clients[i].binary )
+		{
+			frame.magic = SYNC_FRAME_MAGIC;
+			frame.type = type;
+			frame.seq = htons(clients[i].seq );
+			frame.sent = htonl((unsigned int)( (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 ) );
+			clients[i].seq++;
+			if ( loseEvery && ( clients[i].seq % loseEvery ) == 0 )
+			{
+				continue;
+			}
+			sts = sendAll(clients[i].fd, (const char *)&frame, sizeof(frame) );
+		}
+		else
+		{
+			sts = sendAll(clients[i].fd, msg, strlen(msg ) );
+		}
+		if ( sts )
+		{
+			closeClient(&clients[i] );
+		}
+	}
+}
+
+// A sync client sent SYNC_HELLO. Answer it, and send frames from now on.
+void
+syncHello(struct client *cl, int len )
+{
+	const char *reply = SYNC_HELLO "\n";
+
+	cl->inLen += len;
+	cl->in[cl->inLen] = 0;
+	if ( ! asciiOnly && ! cl->binary && strstr(cl->in, SYNC_HELLO ) )
+	{
+		if ( sendAll(cl->fd, reply, strlen(reply ) ) == 0 )
+		{
+			cl->binary = 1;
+			if ( verbose )
+			{
+				printf("sync client on fd %d uses binary frames\n", cl->fd );
+			}
+		}
+	}
+	if ( cl->inLen >= IN_BUF_MAX / 2 )
+	{
+		cl->inLen = 0;
+	}
+}
+
+long long
+periodMs(const char *section )
+{
+	int rate = getIntValue(section, "rate", 0 );
+
+	return ( rate > 0 ? 60000 / rate : 1000 );
+}
+
+void
+usage(const char *name )
+{
+	printf("Usage: %s [-v] [-a] [-n] [-p port] [-c ms] [-l n]\n", name );
+	printf("\t-v : Verbose\n" );
+	printf("\t-a : ASCII syncs only, as an older sim-mgr\n" );
+	printf("\t-p : HTTP port (default 80)\n" );
+	printf("\t-c : Change the cardiac rate every <ms> and report delivery latency\n" );
+	printf("\t-l : Drop every <n>th binary sync frame\n" );
+	printf("\t-n : No syncs; leave the sync port to syncReplay\n" );
+}
+
+int
+main(int argc, char *argv[] )
+{
+	int c;
+	int i;
+	int n;
+	int sts;
+	int httpFd;
+	int syncFd;
+	int discoverFd;
+	struct pollfd pfd[MAX_CLIENTS+3];
+	int pidx[MAX_CLIENTS+3];
+	long long now;
+	long long nextPulse;
+	long long nextBreath;
+	long long nextChange;
+	long long next;
+	char buf[64];
+	int rateHigh = 0;
+
+	while (( c = getopt(argc, argv, "vanp:c:l:h" ) ) != -1 )
+	{
+		switch ( c )
+		{
+			case 'v':
+				verbose = 1;
+				break;
+			case 'a':
+				asciiOnly = 1;
+				break;
+			case 'l':
+				loseEvery = atoi(optarg );
+				break;
+			case 'n':
+				noSync = 1;
+				break;
+			case 'p':
+				httpPort = atoi(optarg );
+				break;
+			case 'c':
+				changeInterval = atoi(optarg );
+				break;
+			default:
+				usage(argv[0] );
+				exit ( 0 );
+		}
+	}
+	signal(SIGPIPE, SIG_IGN );
+	initValues();
+	for ( i = 0 ; i < MAX_CLIENTS ; i++ )
+	{
+		clients[i].type = CLIENT_FREE;
+		clients[i].fd = -1;
+	}
+	httpFd = openServer(httpPort );
+	syncFd = noSync ? -1 : openServer(SYNC_PORT );
+	discoverFd = openDiscover();
+	printf("simmgr_stub: HTTP port %d, sync port %d, discovery port %d\n", httpPort, SYNC_PORT, DISCOVER_PORT );
+
+	now = nowMs();
+	nextPulse = now + periodMs("cardiac" );
+	nextBreath = now + periodMs("respiration" );
+	nextChange = changeInterval ? now + changeInterval : 0;
+
+	while ( 1 )
+	{
+		now = nowMs();
+		if ( noSync )
+		{
+			nextPulse = nextBreath = now + 1000;
+		}
+		if ( now >= nextPulse )
+		{
+			sendSync(SYNC_PULSE, "pulse" );
+			nextPulse += periodMs("cardiac" );
+			if ( nextPulse < now )
+			{
+				nextPulse = now + periodMs("cardiac" );
+			}
+		}
+		if ( now >= nextBreath )
+		{
+			sendSync(SYNC_BREATH, "breath" );
+			nextBreath += periodMs("respiration" );
+			if ( nextBreath < now )
+			{
+				nextBreath = now + periodMs("respiration" );
+			}
+		}
+		if ( nextChange && now >= nextChange )
+		{
+			rateHigh = ! rateHigh;
+			snprintf(buf, sizeof(buf), "%d", rateHigh ? 100 : 80 );
+			setValue("cardiac", "rate", buf );
+			changeTime = nowUs();
+			changes++;
+			nextChange += changeInterval;
+			pushStatus();
+		}
+		for ( i = 0 ; i < MAX_CLIENTS ; i++ )
+		{
+			if ( clients[i].type == CLIENT_HTTP && clients[i].subscribed &&
+				 now - clients[i].lastSend >= KEEPALIVE_MS )
+			{
+				sendChunk(&clients[i], "\n", 1 );
+			}
+		}
+
+		next = nextPulse < nextBreath ? nextPulse : nextBreath;
+		if ( nextChange && nextChange < next )
+		{
+			next = nextChange;
+		}
+		n = 0;
+		pfd[n].fd = httpFd;
+		pfd[n].events = POLLIN;
+		pidx[n++] = -1;
+		pfd[n].fd = syncFd;
+		pfd[n].events = POLLIN;
+		pidx[n++] = -2;
+		pfd[n].fd = discoverFd;
+		pfd[n].events = POLLIN;
+		pidx[n++] = -3;
+		for ( i = 0 ; i < MAX_CLIENTS ; i++ )
+		{
+			if ( clients[i].type != CLIENT_FREE )
+			{
+				pfd[n].fd = clients[i].fd;
+				pfd[n].events = POLLIN;
+				pidx[n++] = i;
+			}
+		}
+		sts = poll(pfd, n, ( next > now ) ? (int)( next - now ) : 0 );
+		if ( sts <= 0 )
+		{
+			continue;
+		}
+		for ( i = 0 ; i < n ; i++ )
+		{
+			if ( ! pfd[i].revents )
+			{
+				continue;
+			}
+			if ( pidx[i] == -1 )
+			{
+				acceptClient(httpFd, CLIENT_HTTP );
+			}
+			else if ( pidx[i] == -2 )
+			{
+				acceptClient(syncFd, CLIENT_SYNC );
+			}
+			else if ( pidx[i] == -3 )
+			{
+				answerDiscover(discoverFd );
+			}
+			else
+			{
+				struct client *cl = &clients[pidx[i]];
+
+				sts = read(cl->fd, &cl->in[cl->inLen], IN_BUF_MAX - cl->inLen );
+				if ( sts <= 0 )
+				{
+					if ( verbose )
+					{
+						printf("close fd %d\n", cl->fd );
+					}
+					closeClient(cl );
+					continue;
+				}
+				if ( cl->type == CLIENT_SYNC )
+				{
+					syncHello(cl, sts );
+					continue;
+				}
+				cl->inLen += sts;
+				cl->in[cl->inLen] = 0;
+				handleHttp(cl );
+				if ( cl->type != CLIENT_FREE && cl->inLen >= IN_BUF_MAX )
+				{
+					closeClient(cl );
+				}
+			}
+		}
+	}
+	return ( 0 );
+}
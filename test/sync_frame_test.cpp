@@ -0,0 +1,285 @@
+/*
+ * sync_frame_test.cpp
+ *
+ * This file is part of the sim-ctl distribution (https://github.com/OpenVetSimDevelopers/sim-ctl).
+ * 
+ * Copyright (c) 2019 VetSim, Cornell University College of Veterinary Medicine Ithaca, NY
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Sync framing test
+ *
+ * Feeds sync streams through a socketpair to simCtlComm::wait() and checks that every
+ * message comes back, in order: several messages in one write, messages split across
+ * writes (down to a byte at a time), words with no separator and garbage between
+ * messages. The writer runs in a thread and pauses between fragments so that each
+ * fragment is a separate read.
+ *
+ * Then the same for binary frames after the hello answer: frames split across writes,
+ * gaps and wrap in the sequence numbers, and garbage between frames.
+ *
+ * Usage: sync_frame_test [-v]
+*/
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "../comm/simCtlComm.h"
+#include "../comm/simUtil.h"
+#include "../comm/shmData.h"
+
+struct shmData *shmData;
+int debug = 0;
+char msgbuf[4096];
+
+struct frameCase
+{
+	const char *name;
+	const char *fragments[8];	// Written one at a time, NULL terminated
+	int expect[8];				// SYNC_ types, 0 terminated
+	unsigned int malformed;
+	unsigned int coalesced;
+};
+
+struct frameCase cases[] =
+{
+	{ "one per write",		{ "pulse\n", "breath\n", "pulseVPC\n", NULL },
+							{ SYNC_PULSE, SYNC_BREATH, SYNC_PULSE_VPC, 0 }, 0, 0 },
+	{ "merged",				{ "pulse\nbreath\npulse\n", NULL },
+							{ SYNC_PULSE, SYNC_BREATH, SYNC_PULSE, 0 }, 0, 2 },
+	{ "split",				{ "pu", "lse\nbre", "ath\n", NULL },
+							{ SYNC_PULSE, SYNC_BREATH, 0 }, 0, 0 },
+	{ "split prefix",		{ "breath\n", "pulse", "VPC\n", "pulse", "\n", NULL },
+							{ SYNC_BREATH, SYNC_PULSE_VPC, SYNC_PULSE, 0 }, 0, 0 },
+	{ "byte at a time",		{ "b", "r", "e", "a", "t", "h", "\n", NULL },
+							{ SYNC_BREATH, 0 }, 0, 0 },
+	{ "no separator",		{ "pulsebreathpulseVPC", NULL },
+							{ SYNC_PULSE, SYNC_BREATH, SYNC_PULSE_VPC, 0 }, 0, 2 },
+	{ "unterminated",		{ "pulse", NULL },
+							{ SYNC_PULSE, 0 }, 0, 0 },
+	{ "garbage",			{ "pulse\nxyzzy\r\nbreath\n", NULL },
+							{ SYNC_PULSE, SYNC_BREATH, 0 }, 1, 1 },
+	{ NULL, { NULL }, { 0 }, 0, 0 }
+};
+
+struct binaryCase
+{
+	const char *name;
+	const char *lead;			// ASCII before the frames, including the hello answer
+	int types[8];				// Frames sent, 0 terminated
+	unsigned short seq[8];
+	int chunk;					// Bytes per write, 0 for all at once
+	int garbageAfter;			// Garbage is written after this many frames, -1 for none
+	int expect[12];				// SYNC_ types, 0 terminated
+	unsigned int lost;
+	unsigned int malformed;
+};
+
+struct binaryCase binaryCases[] =
+{
+	{ "hello answer",		"pulse\n" SYNC_HELLO "\n",
+							{ SYNC_PULSE, SYNC_BREATH, SYNC_PULSE_VPC, 0 }, { 1, 2, 3 }, 0, -1,
+							{ SYNC_PULSE, SYNC_PULSE, SYNC_BREATH, SYNC_PULSE_VPC, 0 }, 0, 0 },
+	{ "frames split",		SYNC_HELLO "\n",
+							{ SYNC_PULSE, SYNC_BREATH, SYNC_PULSE, 0 }, { 7, 8, 9 }, 3, -1,
+							{ SYNC_PULSE, SYNC_BREATH, SYNC_PULSE, 0 }, 0, 0 },
+	{ "frames lost",		SYNC_HELLO "\n",
+							{ SYNC_PULSE, SYNC_PULSE, SYNC_PULSE, SYNC_BREATH, 0 }, { 1, 2, 5, 6 }, 0, -1,
+							{ SYNC_PULSE, SYNC_PULSE, SYNC_PULSE, SYNC_BREATH, 0 }, 2, 0 },
+	{ "sequence wrap",		SYNC_HELLO "\n",
+							{ SYNC_PULSE, SYNC_PULSE, SYNC_PULSE, 0 }, { 65534, 65535, 0 }, 0, -1,
+							{ SYNC_PULSE, SYNC_PULSE, SYNC_PULSE, 0 }, 0, 0 },
+	{ "frame garbage",		SYNC_HELLO "\n",
+							{ SYNC_PULSE, SYNC_BREATH, 0 }, { 1, 2 }, 0, 1,
+							{ SYNC_PULSE, SYNC_BREATH, 0 }, 0, 1 },
+	{ NULL, NULL, { 0 }, { 0 }, 0, 0, { 0 }, 0, 0 }
+};
+
+struct frameCase *current;
+struct binaryCase *currentBinary;
+int writeFd;
+
+void *
+writer(void *arg )
+{
+	int i;
+
+	for ( i = 0 ; current->fragments[i] ; i++ )
+	{
+		if ( write(writeFd, current->fragments[i], strlen(current->fragments[i] ) ) < 0 )
+		{
+			perror("write" );
+		}
+		usleep(5000 );
+	}
+	return ( NULL );
+}
+
+void *
+binaryWriter(void *arg )
+{
+	unsigned char buf[256];
+	struct syncFrame frame;
+	struct timespec ts;
+	int len;
+	int sent;
+	int n;
+	int i;
+
+	len = strlen(currentBinary->lead );
+	memcpy(buf, currentBinary->lead, len );
+	for ( i = 0 ; currentBinary->types[i] ; i++ )
+	{
+		clock_gettime(CLOCK_REALTIME, &ts );
+		frame.magic = SYNC_FRAME_MAGIC;
+		frame.type = currentBinary->types[i];
+		frame.seq = htons(currentBinary->seq[i] );
+		frame.sent = htonl((unsigned int)( (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 ) );
+		memcpy(&buf[len], &frame, sizeof(frame) );
+		len += sizeof(frame);
+		if ( i + 1 == currentBinary->garbageAfter )
+		{
+			memcpy(&buf[len], "\x01\xA5\x7f", 3 );	// Includes a false magic byte
+			len += 3;
+		}
+	}
+	for ( sent = 0 ; sent < len ; sent += n )
+	{
+		n = currentBinary->chunk ? currentBinary->chunk : len;
+		if ( n > len - sent )
+		{
+			n = len - sent;
+		}
+		if ( write(writeFd, &buf[sent], n ) < 0 )
+		{
+			perror("write" );
+		}
+		usleep(5000 );
+	}
+	return ( NULL );
+}
+
+int
+main(int argc, char *argv[] )
+{
+	int sv[2];
+	int i;
+	int n;
+	int type;
+	int fails = 0;
+	int bad;
+	pthread_t tid;
+
+	if ( argc > 1 && strcmp(argv[1], "-v" ) == 0 )
+	{
+		debug = 2;
+	}
+	for ( current = cases ; current->name ; current++ )
+	{
+		simCtlComm comm(SYNC_PORT );
+
+		if ( socketpair(AF_UNIX, SOCK_STREAM, 0, sv ) < 0 )
+		{
+			perror("socketpair" );
+			exit ( -1 );
+		}
+		writeFd = sv[1];
+		comm.attach(sv[0] );
+		pthread_create(&tid, NULL, writer, NULL );
+		bad = 0;
+		for ( n = 0 ; current->expect[n] ; n++ )
+		{
+			type = comm.wait("" );
+			if ( type != current->expect[n] )
+			{
+				printf("FAIL: %s: message %d is %s, expected %s\n", current->name, n,
+					simCtlComm::syncName(type ), simCtlComm::syncName(current->expect[n] ) );
+				bad = 1;
+			}
+		}
+		pthread_join(tid, NULL );
+		if ( comm.stats.messages != (unsigned int)n ||
+			 comm.stats.malformed != current->malformed ||
+			 comm.stats.coalesced != current->coalesced )
+		{
+			printf("FAIL: %s: %u messages %u malformed %u coalesced, expected %d %u %u\n", current->name,
+				comm.stats.messages, comm.stats.malformed, comm.stats.coalesced,
+				n, current->malformed, current->coalesced );
+			bad = 1;
+		}
+		if ( debug )
+		{
+			printf("%s: %u reads %u messages\n", current->name, comm.stats.reads, comm.stats.messages );
+		}
+		fails += bad;
+		comm.attach(0 );
+		close(sv[0] );
+		close(sv[1] );
+	}
+	i = current - cases;
+	
+	for ( currentBinary = binaryCases ; currentBinary->name ; currentBinary++ )
+	{
+		simCtlComm comm(SYNC_PORT );
+
+		if ( socketpair(AF_UNIX, SOCK_STREAM, 0, sv ) < 0 )
+		{
+			perror("socketpair" );
+			exit ( -1 );
+		}
+		writeFd = sv[1];
+		comm.attach(sv[0] );
+		pthread_create(&tid, NULL, binaryWriter, NULL );
+		bad = 0;
+		for ( n = 0 ; currentBinary->expect[n] ; n++ )
+		{
+			type = comm.wait("" );
+			if ( type != currentBinary->expect[n] )
+			{
+				printf("FAIL: %s: message %d is %s, expected %s\n", currentBinary->name, n,
+					simCtlComm::syncName(type ), simCtlComm::syncName(currentBinary->expect[n] ) );
+				bad = 1;
+			}
+		}
+		pthread_join(tid, NULL );
+		if ( ! comm.stats.binary ||
+			 comm.stats.lost != currentBinary->lost ||
+			 comm.stats.malformed != currentBinary->malformed ||
+			 comm.stats.maxLatency > 1000000 )
+		{
+			printf("FAIL: %s: binary %d, %u lost %u malformed, latency max %d usec, expected %u %u\n",
+				currentBinary->name, comm.stats.binary, comm.stats.lost, comm.stats.malformed,
+				comm.stats.maxLatency, currentBinary->lost, currentBinary->malformed );
+			bad = 1;
+		}
+		if ( debug )
+		{
+			printf("%s: %u reads %u messages, latency avg %d usec\n", currentBinary->name,
+				comm.stats.reads, comm.stats.messages, comm.stats.avgLatency );
+		}
+		fails += bad;
+		comm.attach(0 );
+		close(sv[0] );
+		close(sv[1] );
+		i++;
+	}
+	printf("%d cases, %d failed\n", i, fails );
+	return ( fails ? -1 : 0 );
+}
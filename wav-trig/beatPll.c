@@ -0,0 +1,170 @@
+/*
+ * beatPll.c
+ *
+ * This file is part of the sim-ctl distribution (https://github.com/OpenVetSimDevelopers/sim-ctl).
+ * 
+ * Copyright (c) 2019 VetSim, Cornell University College of Veterinary Medicine Ithaca, NY
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "beatPll.h"
+
+static long long
+nominalPeriod(int rate )
+{
+	return ( ( rate > 0 ) ? 60000000LL / rate : 0 );
+}
+
+void
+beatPllInit(struct beatPll *pll, long long delay )
+{
+	memset(pll, 0, sizeof(struct beatPll ) );
+	pll->delay = delay;
+}
+
+static void
+unlock(struct beatPll *pll )
+{
+	if ( pll->locked )
+	{
+		pll->unlocks++;
+		pll->locked = 0;
+		pll->consistent = 0;
+	}
+}
+
+void
+beatPllSync(struct beatPll *pll, long long when, int vpc, int rate )
+{
+	long long nominal = nominalPeriod(rate );
+	long long error;
+	long long late;
+	long long interval;
+	long long limit;
+	
+	pll->syncs++;
+	interval = pll->lastSync ? when - pll->lastSync : 0;
+	pll->lastSync = when;
+	
+	if ( pll->locked && ! vpc && rate == pll->rate )
+	{
+		// Compare with the predicted beat, or with the one before if it has already played
+		error = when - pll->next;
+		late = when - ( pll->next - pll->period );
+		if ( llabs(late ) < llabs(error ) )
+		{
+			error = late;
+		}
+		if ( llabs(error ) < pll->period / 4 )
+		{
+			pll->phaseError = error;
+			pll->next += error >> PLL_KP_SHIFT;
+			pll->period += error >> PLL_KI_SHIFT;
+			limit = nominal / PLL_PERIOD_RANGE;
+			if ( pll->period > nominal + limit )
+			{
+				pll->period = nominal + limit;
+			}
+			else if ( pll->period < nominal - limit )
+			{
+				pll->period = nominal - limit;
+			}
+			return;
+		}
+	}
+	
+	// Not locked, or this sync does not fit: the beat follows the sync
+	unlock(pll );
+	pll->pending = when + pll->delay;
+	if ( vpc || nominal == 0 || rate != pll->rate ||
+		 ! interval || llabs(interval - nominal ) >= nominal / 4 )
+	{
+		pll->rate = rate;
+		pll->consistent = 0;
+	}
+	else
+	{
+		if ( ++pll->consistent >= PLL_LOCK_SYNCS )
+		{
+			pll->locked = 1;
+			pll->locks++;
+			pll->period = nominal;
+			pll->next = when + nominal;
+		}
+	}
+}
+
+long long
+beatPllDeadline(struct beatPll *pll, long long now, int rate )
+{
+	long long beat;
+	
+	if ( pll->locked )
+	{
+		if ( rate != pll->rate ||
+			 ( ! pll->holdover &&
+			   now > pll->lastSync + ( PLL_FREERUN_BEATS + 1 ) * pll->period - pll->period / 2 ) )
+		{
+			// Rate changed, or the syncs have stopped
+			unlock(pll );
+		}
+	}
+	if ( ! pll->locked )
+	{
+		return ( pll->pending );
+	}
+	beat = pll->next + pll->delay;
+	if ( pll->pending && pll->pending < beat )
+	{
+		return ( pll->pending );
+	}
+	return ( beat );
+}
+
+void
+beatPllPlayed(struct beatPll *pll, long long deadline )
+{
+	if ( pll->pending && pll->pending <= deadline )
+	{
+		// The beat for the sync that locked the loop, or one played while unlocked
+		if ( pll->locked && pll->next + pll->delay <= pll->pending + pll->period / 2 )
+		{
+			pll->next += pll->period;
+		}
+		pll->pending = 0;
+		return;
+	}
+	if ( pll->locked )
+	{
+		if ( pll->lastSync < pll->next - pll->period / 2 )
+		{
+			pll->freeRun++;
+		}
+		pll->next += pll->period;
+	}
+}
+
+void
+beatPllHoldover(struct beatPll *pll, int on, long long now )
+{
+	if ( pll->holdover && ! on && pll->locked )
+	{
+		// Allow the usual free running beats for the syncs to resume
+		pll->lastSync = now;
+	}
+	pll->holdover = on;
+}
@@ -0,0 +1,75 @@
+/*
+ * beatPll.h
+ *
+ * This file is part of the sim-ctl distribution (https://github.com/OpenVetSimDevelopers/sim-ctl).
+ * 
+ * Copyright (c) 2019 VetSim, Cornell University College of Veterinary Medicine Ithaca, NY
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BEATPLL_H_
+#define BEATPLL_H_
+
+/*
+ * Phase locked beat scheduler
+ *
+ * Learns the period and phase of the heart beat from the pulse syncs and cardiac.rate,
+ * and predicts when each beat is due so it can be played from a local timer. Syncs are
+ * used only to correct the phase. Until it has locked (and after a VPC, a rate change,
+ * or a sync too far from the prediction) each beat simply follows its sync, as before.
+ * When syncs stop, PLL_FREERUN_BEATS beats are played free running before it unlocks,
+ * or for as long as the sync connection is down (see beatPllHoldover()).
+ *
+ * All times are usec of CLOCK_MONOTONIC.
+*/
+#define PLL_LOCK_SYNCS		3		// Consecutive syncs at the expected interval needed to lock
+#define PLL_FREERUN_BEATS	2		// Beats played with no sync before unlocking
+#define PLL_KP_SHIFT		2		// Phase correction: 1/4 of the phase error
+#define PLL_KI_SHIFT		5		// Period correction: 1/32 of the phase error
+#define PLL_PERIOD_RANGE	20		// Period may be corrected to within 1/20 (5%) of nominal
+
+struct beatPll
+{
+	int locked;
+	int rate;					// cardiac.rate the period was set from
+	long long delay;			// Beat plays this long after its sync
+	long long period;
+	long long next;				// Predicted sync time of the next beat to play
+	long long lastSync;
+	int consistent;				// Syncs at the expected interval, while unlocked
+	long long pending;			// Play time of a beat following its sync, 0 if none
+	int holdover;				// Sync connection down; keep free running
+	
+	unsigned int syncs;
+	unsigned int locks;
+	unsigned int unlocks;
+	unsigned int freeRun;		// Beats played with no sync for them
+	long long phaseError;		// Last phase error
+};
+
+void beatPllInit(struct beatPll *pll, long long delay );
+
+// A pulse sync arrived at 'when'. vpc is set for SYNC_PULSE_VPC.
+void beatPllSync(struct beatPll *pll, long long when, int vpc, int rate );
+
+// Time the next beat is to be played, or 0 if none is due
+long long beatPllDeadline(struct beatPll *pll, long long now, int rate );
+
+// The beat at the deadline has been played
+void beatPllPlayed(struct beatPll *pll, long long deadline );
+
+// The sync connection has gone down (on) or come back (off) at 'now'
+void beatPllHoldover(struct beatPll *pll, int on, long long now );
+
+#endif /* BEATPLL_H_ */
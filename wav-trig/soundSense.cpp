@@ -34,6 +34,9 @@
 #include <stdbool.h>
 #include <signal.h>
 #include <stdint.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #include <iomanip>
 #include <iostream>
@@ -55,6 +58,7 @@
 #endif
 
 #include "wavTrigger.h"
+#include "beatPll.h"
 #include "../cardiac/rfidScan.h"
 
 #include "../comm/simCtlComm.h"
@@ -62,7 +66,6 @@
 #include "../comm/shmData.h"
 
 wavTrigger wav;
-simCtlComm comm(SYNC_PORT );
 
 struct shmData *shmData;
 
@@ -83,6 +86,8 @@ pthread_t threadInfo3;
 
 /* prototype for thread routines */
 void *sync_thread ( void *ptr );
+void *beat_thread ( void *ptr );
+void *change_thread ( void *ptr );
 void runHeart(void );
 void runLung(void );
 void initialize_timers(void );
@@ -111,7 +116,34 @@ int ldebug = 0;
 int monitor = 0;
 int soundTest = 0;
 
+// Phase locked beat scheduling (-p). beat_thread plays each heart beat from a local
+// timer at the time predicted by the PLL, and wakes the main loop to play it.
+#define BEAT_POLL_USEC	20000
+
+int pllMode = 0;
+struct beatPll pll;
+pthread_mutex_t pllMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// The main loop sleeps until it has work: a beat or breath (sync_thread, beat_thread),
+// a heart or breath timer (delay_handler), or a change in shmData (change_thread).
+// Otherwise it runs every LOOP_IDLE_MS for the tank and the volume refresh.
+#define LOOP_IDLE_MS	100
+
+// The parts of shmData used (see initSHMRegions)
+#define SOUND_REGIONS	( ( 1 << SHM_REGION_CARDIAC ) | ( 1 << SHM_REGION_RESPIRATION ) | ( 1 << SHM_REGION_AUSCULTATION ) | \
+						  ( 1 << SHM_REGION_PULSE ) | ( 1 << SHM_REGION_BREATH ) | ( 1 << SHM_REGION_STATS ) | ( 1 << SHM_REGION_CHANGE ) | \
+						  ( 1 << SHM_REGION_METRICS ) )
+#define MAIN_SECTIONS	( ( 1 << SHM_SECTION_CARDIAC ) | ( 1 << SHM_SECTION_RESPIRATION ) | ( 1 << SHM_SECTION_AUSCULTATION ) )
+
+unsigned int mainWake = 0;
+void wakeMain(void );
+
+// wav counts already passed to the metrics
+unsigned int commandsSeen = 0;
+unsigned int failuresSeen = 0;
+
 void runMonitor(void );
+void takeSnapshot(void );
 
 int
 setTermios(int fd, int speed )
@@ -196,6 +228,25 @@ struct current
 
 struct current current;
 
+// Consistent copies of the shmData sections read by the main loop, taken once per pass
+// (see takeSnapshot()). The sync and beat threads read cardiac.rate from shmData.
+struct snapshot
+{
+	struct cardiac cardiac;
+	struct respiration respiration;
+	struct auscultation auscultation;
+	struct pulse pulse;
+};
+struct snapshot snap;
+
+// Change tracking. chg[] holds the fields changed since the previous pass of the main loop.
+struct shmChangeReader changes;
+unsigned int chg[SHM_SECTIONS];
+
+#define VOLUME_REFRESH_MS	1000	// While listening, re-send the track gains about once a second
+int volumeForce = 0;	// Re-send the track gains on this pass
+long long volumeLast = 0;
+
 int lubdub = 0;
 int inhL = 0;
 int inhR = 0;
@@ -459,8 +510,8 @@ showSounds(void )
 void
 getFiles(void )
 {
-	int breathRate = shmData->respiration.rate;
-	int hr = shmData->cardiac.rate;
+	int breathRate = snap.respiration.rate;
+	int hr = snap.cardiac.rate;
 	int i;
 	int new_inhL = -1;
 	int new_inhR = -1;
@@ -497,7 +548,7 @@ getFiles(void )
 
 	if ( new_lubdub == -1 )
 	{
-		sprintf(msgbuf, "No lubdub file for %s %d", current.heart_sound, shmData->cardiac.rate );
+		sprintf(msgbuf, "No lubdub file for %s %d", current.heart_sound, snap.cardiac.rate );
 		log_message("", msgbuf);
 	}
 	else
@@ -506,7 +557,7 @@ getFiles(void )
 	}
 	if ( new_inhL == -1 )
 	{
-		sprintf(msgbuf, "No inhL file for %s %d", current.left_lung_sound, shmData->respiration.rate );
+		sprintf(msgbuf, "No inhL file for %s %d", current.left_lung_sound, snap.respiration.rate );
 		log_message("", msgbuf);
 	}
 	else
@@ -515,7 +566,7 @@ getFiles(void )
 	}
 	if ( new_inhR == -1 )
 	{
-		sprintf(msgbuf, "No inhR file for %s %d", current.right_lung_sound, shmData->respiration.rate );
+		sprintf(msgbuf, "No inhR file for %s %d", current.right_lung_sound, snap.respiration.rate );
 		log_message("", msgbuf);
 	}
 	else
@@ -712,11 +763,11 @@ main(int argc, char *argv[] )
 	if ( argc < 2 )
 	{
 		cout << "Usage:\n";
-		cout << argv[ 0 ] << " [-d] [-m][-t] <tty port>\n";
+		cout << argv[ 0 ] << " [-d] [-m][-t][-p] <tty port>\n";
 		cout << "eg: " << argv[ 0 ] << " tty1\n";
 		return (-1 );
 	}
-	while (( c = getopt(argc, argv, "mdt" ) ) != -1 )
+	while (( c = getopt(argc, argv, "mdtp" ) ) != -1 )
 	{
 		switch ( c )
 		{
@@ -731,6 +782,9 @@ main(int argc, char *argv[] )
 				monitor = 1;
 				debug = 2;
 				break;
+			case 'p':
+				pllMode = 1;
+				break;
 		}
 	}
 	
@@ -743,7 +797,7 @@ main(int argc, char *argv[] )
 		else
 		{
 			cout << "Usage:\n";
-			cout << argv[ 0 ] << " [-d] [-m] <tty port>\n";
+			cout << argv[ 0 ] << " [-d] [-m] [-p] <tty port>\n";
 			cout << "eg: " << argv[ 0 ] << " tty1\n";
 			return (-1 );
 		}
@@ -751,7 +805,7 @@ main(int argc, char *argv[] )
 	printf("Debug %d, Monitor %d, sio '%s'\n", debug, monitor, sioName );
 	if ( monitor )
 	{
-		sts = initSHM(SHM_OPEN );
+		sts = initSHMRegions(SHM_OPEN, SOUND_REGIONS );
 		if ( sts  )
 		{
 			perror("initSHM" );
@@ -812,7 +866,7 @@ main(int argc, char *argv[] )
 	
 	if ( !ldebug )
 	{
-		sts = initSHM(SHM_OPEN );
+		sts = initSHMRegions(SHM_OPEN, SOUND_REGIONS );
 		if ( sts  )
 		{
 			perror("initSHM");
@@ -1022,15 +1076,19 @@ main(int argc, char *argv[] )
 	current.heartGain = -65;
 	
 	wav.trackGain(PULSE_TRACK, MAX_MAX_VOLUME );
-	sts = comm.openListen(LISTEN_INACTIVE );
-	if ( sts )
-	{
-		perror("comm.openListen()" );
-		allAirOff();
-		exit ( -2 );
-	}
 
-	pthread_create (&threadInfo1, NULL, &sync_thread,(void *) NULL );
+	beatPllInit(&pll, LUB_DELAY / 1000 );
+	
+	metricsInit(METRIC_SOUND, 0 );
+	rtMemoryInit();
+	pthread_create (&threadInfo1, rtThreadAttr(), &sync_thread,(void *) NULL );
+	pthread_create (&threadInfo3, rtThreadAttr(), &change_thread,(void *) NULL );
+	if ( pllMode )
+	{
+		pthread_create (&threadInfo2, rtThreadAttr(), &beat_thread,(void *) NULL );
+		sprintf(msgbuf, "Phase locked beat scheduling" );
+		log_message("", msgbuf);
+	}
 	
 	// Main loop monitors the volumes and keeps them set
 	// Also gets the track info updated
@@ -1056,6 +1114,23 @@ main(int argc, char *argv[] )
 	
 	while ( 1 )
 	{
+		struct timespec ts;
+		long long now;
+		unsigned int wake;
+		unsigned int count;
+		
+		// Taken first, so a wake up during the pass is not missed
+		wake = mainWake;
+		__sync_synchronize();
+		metricsLoopStart();
+		clock_gettime(CLOCK_MONOTONIC, &ts );
+		now = (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+		
+		// Find what changed in shmData since the last pass. Usually nothing. The copies
+		// are taken after the check, so they hold at least the changes it reports.
+		shmChangeCheck(&changes, chg );
+		takeSnapshot();
+		
 		// Master off based on active auscultation
 		if ( soundTest )
 		{
@@ -1064,16 +1139,18 @@ main(int argc, char *argv[] )
 				wav.channelGain(0, MAX_VOLUME);
 				current.masterGain = MAX_VOLUME;
 			}
-			shmData->auscultation.col  = 1;
-			shmData->auscultation.row  = 1;
-			shmData->auscultation.side = 1;
-			shmData->auscultation.heartStrength = 10;
-			shmData->auscultation.leftLungStrength = 10;
-			shmData->auscultation.rightLungStrength = 0;
+			// Listen as if at the left chest. Set in this process's copy only; rfidScan is
+			// the one writer of auscultation in shmData.
+			snap.auscultation.col  = 1;
+			snap.auscultation.row  = 1;
+			snap.auscultation.side = 1;
+			snap.auscultation.heartStrength = 10;
+			snap.auscultation.leftLungStrength = 10;
+			snap.auscultation.rightLungStrength = 0;
 		}
 		else
 		{
-		if ( ( shmData->auscultation.side == 0 ) && ( current.masterGain != MIN_VOLUME ) )
+		if ( ( snap.auscultation.side == 0 ) && ( current.masterGain != MIN_VOLUME ) )
 		{
 			wav.channelGain(0, MIN_VOLUME);
 			current.masterGain = MIN_VOLUME;
@@ -1085,7 +1162,7 @@ main(int argc, char *argv[] )
 				current.heartCount, current.breathCount, current.heartGain, current.rightLungGain, current.leftLungGain, current.masterGain );
 			log_message("", msgbuf);
 		}
-		else if ( ( shmData->auscultation.side != 0 ) && ( current.masterGain != MAX_VOLUME ) )
+		else if ( ( snap.auscultation.side != 0 ) && ( current.masterGain != MAX_VOLUME ) )
 		{
 			wav.channelGain(0, MAX_VOLUME);
 			current.masterGain = MAX_VOLUME;
@@ -1094,7 +1171,7 @@ main(int argc, char *argv[] )
 				printf("Master On\n" );
 			}
 			sprintf(msgbuf, "Set On: %d, %d, Heart Gain %d, Lung Gains %d / %d (%d), Master Gain %d", 
-				current.heartCount, current.breathCount, current.heartGain, current.rightLungGain, current.leftLungGain, shmData->respiration.left_lung_sound_volume, current.masterGain );
+				current.heartCount, current.breathCount, current.heartGain, current.rightLungGain, current.leftLungGain, snap.respiration.left_lung_sound_volume, current.masterGain );
 			log_message("", msgbuf);
 		}
 		}
@@ -1102,90 +1179,206 @@ main(int argc, char *argv[] )
 		checkTank();
 		changed = 0;
 		
+		volumeForce = 0;
+		if ( chg[SHM_SECTION_AUSCULTATION] & CHG_AUSC_POSITION )
+		{
+			volumeForce = 1;
+		}
+		if ( snap.auscultation.side != 0 && now - volumeLast >= VOLUME_REFRESH_MS )
+		{
+			volumeForce = 1;
+		}
+		if ( volumeForce )
+		{
+			volumeLast = now;
+		}
+		
 		// Check for heart/lung changes
-		if ( ( current.heart_rate != shmData->cardiac.rate ) || 
-			 ( strcmp(current.heart_sound, shmData->cardiac.heart_sound) != 0 ) )
+		if ( chg[SHM_SECTION_CARDIAC] & ( CHG_CARDIAC_RATE | CHG_CARDIAC_HEART_SOUND ) )
 		{
 			sprintf(msgbuf, "Cardiac %d:%d, %s, %s", 
-				 current.heart_rate, shmData->cardiac.rate,
-				 current.heart_sound, shmData->cardiac.heart_sound	 );
+				 current.heart_rate, snap.cardiac.rate,
+				 current.heart_sound, snap.cardiac.heart_sound	 );
 			log_message("", msgbuf);		
-			current.heart_rate = shmData->cardiac.rate;
-			memcpy(current.heart_sound, shmData->cardiac.heart_sound, 32 );
+			current.heart_rate = snap.cardiac.rate;
+			memcpy(current.heart_sound, snap.cardiac.heart_sound, 32 );
 			changed = 1;
 		}
-		if ( ( current.respiration_rate != shmData->respiration.rate ) ||
-			 ( strcmp(current.left_lung_sound, shmData->respiration.left_lung_sound) != 0 ) ||
-			 ( strcmp(current.right_lung_sound, shmData->respiration.right_lung_sound) != 0 ) )
+		if ( chg[SHM_SECTION_RESPIRATION] & ( CHG_RESP_RATE | CHG_RESP_LEFT_SOUND | CHG_RESP_RIGHT_SOUND ) )
 		{
 			sprintf(msgbuf, "Resp %d:%d, %s, %s, %s, %s", 
-				 current.respiration_rate, shmData->respiration.rate,
-				 current.left_lung_sound, shmData->respiration.left_lung_sound,
-				 current.right_lung_sound, shmData->respiration.right_lung_sound );
+				 current.respiration_rate, snap.respiration.rate,
+				 current.left_lung_sound, snap.respiration.left_lung_sound,
+				 current.right_lung_sound, snap.respiration.right_lung_sound );
 			log_message("", msgbuf);
-			current.respiration_rate = shmData->respiration.rate;
-			memcpy(current.left_lung_sound, shmData->respiration.left_lung_sound, 32 );
-			memcpy(current.right_lung_sound, shmData->respiration.right_lung_sound, 32 );
+			current.respiration_rate = snap.respiration.rate;
+			memcpy(current.left_lung_sound, snap.respiration.left_lung_sound, 32 );
+			memcpy(current.right_lung_sound, snap.respiration.right_lung_sound, 32 );
 			changed = 1;
 		}
 		if ( changed )
 		{
 			getFiles();
 			doReport();
+			volumeForce = 1;	// The tracks may have changed
 		}
 	
 		runLung();
 		runHeart();
-		usleep(10000 );
+		
+		// WAV Trigger commands, including those sent by the other threads
+		count = wav.commands;
+		metricsIo(count - commandsSeen );
+		commandsSeen = count;
+		count = wav.writeFailures;
+		if ( count != failuresSeen )
+		{
+			metricsError(wav.writeErrno, "WAV Trigger write failed" );
+			failuresSeen = count;
+		}
+		metricsLoopEnd();
+		
+		// Sleep until woken, or LOOP_IDLE_MS
+		ts.tv_sec = LOOP_IDLE_MS / 1000;
+		ts.tv_nsec = ( LOOP_IDLE_MS % 1000 ) * 1000000;
+		syscall(SYS_futex, &mainWake, FUTEX_WAIT_PRIVATE, wake, &ts, NULL, 0 );
 	}
 }
 
+/*
+ * Wake the main loop for another pass. Safe to call from a signal handler.
+*/
+void
+wakeMain(void )
+{
+	int saveErrno = errno;
+	
+	__sync_fetch_and_add(&mainWake, 1 );
+	syscall(SYS_futex, &mainWake, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0 );
+	errno = saveErrno;
+}
+
+/*
+ * Wake the main loop when simController or rfidScan change a section it uses, so a
+ * change from the instructor is acted on at once.
+*/
 void *
-sync_thread ( void *ptr )
+change_thread ( void *ptr )
 {
-	int sts;
+	struct shmChangeReader reader;
+	unsigned int masks[SHM_SECTIONS];
 	
-	sts = comm.openListen(LISTEN_ACTIVE );
-	if ( sts != 0 )
+	memset(&reader, 0, sizeof(reader) );
+	while ( 1 )
 	{
-		perror("comm.openListen" );
-#ifdef USE_BBBGPIO
-		gp->setValue(tankPin, TURN_OFF );
-#else
-		gpioPinSet(tankPin, TURN_OFF );
-#endif
-		exit ( -4 );
+		if ( shmChangeWait(&reader, MAIN_SECTIONS, masks, -1 ) )
+		{
+			wakeMain();
+		}
 	}
+}
+
+/*
+ * Count the beats and breaths. simController holds the sync connection to the sim-mgr
+ * and posts each message to shared memory.
+*/
+void *
+sync_thread ( void *ptr )
+{
+	struct syncEventReader reader;
+	struct syncArrival event;
+	int sts;
+	
+	memset(&reader, 0, sizeof(reader) );
 	while ( 1 )
 	{
-		sts = comm.wait("" );
+		sts = syncEventWait(&reader, &event, -1 );
 		switch ( sts )
 		{
 			case SYNC_PULSE:
 			case SYNC_PULSE_VPC:
-				current.heartCount += 1;
+				if ( pllMode )
+				{
+					pthread_mutex_lock(&pllMutex );
+					beatPllSync(&pll, event.when, sts == SYNC_PULSE_VPC, shmData->cardiac.rate );
+					pthread_mutex_unlock(&pllMutex );
+				}
+				else
+				{
+					current.heartCount += 1;
+					wakeMain();
+				}
 				break;
 			case SYNC_BREATH:
 				current.breathCount += 1;
+				wakeMain();
 				break;
 		}
 	}
 }
+
+/*
+ * Play the heart beats at the deadlines from the PLL. The deadline is checked at least
+ * every BEAT_POLL_USEC, as a sync may move it or start a new beat.
+*/
+void *
+beat_thread ( void *ptr )
+{
+	struct timespec ts;
+	long long now;
+	long long deadline;
+	long long wake;
+	
+	while ( 1 )
+	{
+		clock_gettime(CLOCK_MONOTONIC, &ts );
+		now = (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+		pthread_mutex_lock(&pllMutex );
+		if ( pll.holdover == shmData->sync.comm.up )
+		{
+			// Keep the beat going while simController reconnects to the sim-mgr
+			beatPllHoldover(&pll, ! shmData->sync.comm.up, now );
+		}
+		deadline = beatPllDeadline(&pll, now, shmData->cardiac.rate );
+		if ( deadline && deadline <= now )
+		{
+			beatPllPlayed(&pll, deadline );
+			current.heartCount += 1;
+			if ( heartState == 0 )
+			{
+				heartState = 1;
+			}
+			pthread_mutex_unlock(&pllMutex );
+			wakeMain();
+			continue;
+		}
+		pthread_mutex_unlock(&pllMutex );
+		
+		wake = now + BEAT_POLL_USEC;
+		if ( deadline && deadline < wake )
+		{
+			wake = deadline;
+		}
+		ts.tv_sec = wake / 1000000;
+		ts.tv_nsec = ( wake % 1000000 ) * 1000;
+		while ( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL ) == EINTR )
+		{
+		}
+	}
+}
 void
 setHeartVolume(int force )
 {
 	int gain = current.heartGain;
 	
 	if ( force ||
-		 ( current.heart_sound_mute != shmData->cardiac.heart_sound_mute ) ||
-		 ( current.heart_sound_volume != shmData->cardiac.heart_sound_volume ) ||
-		 ( current.heartStrength != shmData->auscultation.heartStrength ) ||
-		 ( current.pea != shmData->cardiac.pea ) )
-	{
-		current.heart_sound_mute = shmData->cardiac.heart_sound_mute;
-		current.heart_sound_volume = shmData->cardiac.heart_sound_volume;
-		current.heartStrength  = shmData->auscultation.heartStrength;
-		current.pea = shmData->cardiac.pea;
+		 ( chg[SHM_SECTION_CARDIAC] & ( CHG_CARDIAC_HEART_VOLUME | CHG_CARDIAC_PEA ) ) ||
+		 ( chg[SHM_SECTION_AUSCULTATION] & CHG_AUSC_STRENGTH ) )
+	{
+		current.heart_sound_mute = snap.cardiac.heart_sound_mute;
+		current.heart_sound_volume = snap.cardiac.heart_sound_volume;
+		current.heartStrength  = snap.auscultation.heartStrength;
+		current.pea = snap.cardiac.pea;
 		//if ( current.heart_sound_mute )
 		//{
 		//	current.heartGain = MIN_VOLUME;
@@ -1213,13 +1406,12 @@ setLeftLungVolume(int force )
 	int gain = current.leftLungGain;
 	
 	if ( force ||
-		 ( current.left_lung_sound_mute != shmData->respiration.left_lung_sound_mute ) ||
-		 ( current.left_lung_sound_volume != shmData->respiration.left_lung_sound_volume ) ||
-		 ( current.leftLungStrength != shmData->auscultation.leftLungStrength ) )
+		 ( chg[SHM_SECTION_RESPIRATION] & CHG_RESP_LEFT_VOLUME ) ||
+		 ( chg[SHM_SECTION_AUSCULTATION] & CHG_AUSC_STRENGTH ) )
 	{
-		current.left_lung_sound_mute = shmData->respiration.left_lung_sound_mute;
-		current.left_lung_sound_volume = shmData->respiration.left_lung_sound_volume;
-		current.leftLungStrength = shmData->auscultation.leftLungStrength;
+		current.left_lung_sound_mute = snap.respiration.left_lung_sound_mute;
+		current.left_lung_sound_volume = snap.respiration.left_lung_sound_volume;
+		current.leftLungStrength = snap.auscultation.leftLungStrength;
 		//if ( current.left_lung_sound_mute )
 		//{
 		//	current.leftLungGain = MIN_VOLUME;
@@ -1232,7 +1424,7 @@ setLeftLungVolume(int force )
 	
 	if ( force || ( gain != current.leftLungGain ) )
 	{
-		if ( shmData->auscultation.side != 2 )
+		if ( snap.auscultation.side != 2 )
 		{
 			wav.trackGain(inhL, current.leftLungGain );
 		}
@@ -1244,13 +1436,12 @@ setRightLungVolume(int force )
 	int gain = current.rightLungGain;
 	
 	if ( force ||
-		 ( current.right_lung_sound_mute != shmData->respiration.right_lung_sound_mute ) ||
-		 ( current.right_lung_sound_volume != shmData->respiration.right_lung_sound_volume ) ||
-		 ( current.rightLungStrength != shmData->auscultation.rightLungStrength ) )
+		 ( chg[SHM_SECTION_RESPIRATION] & CHG_RESP_RIGHT_VOLUME ) ||
+		 ( chg[SHM_SECTION_AUSCULTATION] & CHG_AUSC_STRENGTH ) )
 	{
-		current.left_lung_sound_mute = shmData->respiration.left_lung_sound_mute;
-		current.right_lung_sound_volume = shmData->respiration.right_lung_sound_volume;
-		current.rightLungStrength = shmData->auscultation.rightLungStrength;
+		current.right_lung_sound_mute = snap.respiration.right_lung_sound_mute;
+		current.right_lung_sound_volume = snap.respiration.right_lung_sound_volume;
+		current.rightLungStrength = snap.auscultation.rightLungStrength;
 		//if ( current.right_lung_sound_mute )
 		//{
 		//	current.rightLungGain = MIN_VOLUME;
@@ -1262,7 +1453,7 @@ setRightLungVolume(int force )
 	}
 	if ( force || ( gain != current.rightLungGain ) )
 	{
-		if ( shmData->auscultation.side != 1 )
+		if ( snap.auscultation.side != 1 )
 		{
 			wav.trackGain(inhR, current.rightLungGain );
 		}
@@ -1274,18 +1465,16 @@ runHeart ( void )
 {
 	struct itimerspec its;
 	
-	if ( shmData->auscultation.side != 0 && shmData->cardiac.pea == 0 )
-	{
-		setHeartVolume(1 );	// Force volume setting as the track may have changed
-	}
-	else
-	{
-		setHeartVolume(1 );	// Set volume only if a change occurred
-	}
+	setHeartVolume(volumeForce );	// Set volume if a change occurred, or forced as the track may have changed
 	switch ( heartState )
 	{
 		case 0:
-			if ( heartLast != current.heartCount )
+			if ( pllMode )
+			{
+				// beat_thread moves to state 1 when the beat is due
+				heartLast = current.heartCount;
+			}
+			else if ( heartLast != current.heartCount )
 			{
 				heartLast = current.heartCount;
 #ifdef USE_BBBGPIO
@@ -1293,7 +1482,7 @@ runHeart ( void )
 #else
 //				gpioPinSet(pulsePin, TURN_ON );
 #endif
-				//if ( shmData->auscultation.side != 0 )
+				//if ( snap.auscultation.side != 0 )
 				//{
 					its.it_interval.tv_sec = 0;
 					its.it_interval.tv_nsec = 0;
@@ -1317,9 +1506,9 @@ runHeart ( void )
 			}
 			break;
 		case 1:
-			if ( shmData->cardiac.pea == 0 )
+			if ( snap.cardiac.pea == 0 )
 			{
-				//if ( shmData->auscultation.side != 0 )
+				//if ( snap.auscultation.side != 0 )
 				//{
 #ifdef USE_BBBGPIO
 //					gp->setValue(pulsePin, TURN_OFF );
@@ -1368,10 +1557,15 @@ delay_handler(int sig, siginfo_t *si, void *uc)
 		{
 			lungState = 1;
 		}
-	}	
+	}
+	wakeMain();
 }
-#define EXH_LIMIT 400
-int exhLimit = EXH_LIMIT;
+// With the respiration rate at 0, the valves are turned off EXH_LIMIT_MS after the
+// last rise. Timed, not counted in main loop passes, as those are now as much as
+// LOOP_IDLE_MS apart. The rise timer sets exhRestart; runLung() keeps the deadline.
+#define EXH_LIMIT_MS	4000
+volatile sig_atomic_t exhRestart = 1;
+long long exhDeadline = 0;		// 0 to start timing, -1 once hit
 
 static void
 rise_handler(int sig, siginfo_t *si, void *uc)
@@ -1409,7 +1603,7 @@ rise_handler(int sig, siginfo_t *si, void *uc)
 		riseOnOff = 0;
 		fallOnOff = 0;
 	}
-	exhLimit = EXH_LIMIT;
+	exhRestart = 1;
 }
 
 void
@@ -1618,27 +1812,24 @@ void
 runLung( void )
 {
 	struct itimerspec its;
+	struct timespec ts;
+	long long now;
 	long int delayTime;	// Delay in ns
 	double periodSeconds;
 	double fractional;
 	double integer;
 	
-	if ( ! shmData->respiration.chest_movement )
+	if ( ! snap.respiration.chest_movement )
 	{
 		allAirOff();
 	}
 
-	if ( shmData->auscultation.side != 0  )
-	{
-		current.respiration_rate = shmData->respiration.rate;
-		setLeftLungVolume(1 );	// Force volume setting as the track may have changed
-		setRightLungVolume(1 );	// Force volume setting as the track may have changed
-	}
-	else
+	if ( snap.auscultation.side != 0  )
 	{
-		setLeftLungVolume(0 );	// Set volume only if a change occurred
-		setRightLungVolume(0 );	// Set volume only if a change occurred
+		current.respiration_rate = snap.respiration.rate;
 	}
+	setLeftLungVolume(volumeForce );	// Set volume if a change occurred, or forced as the track may have changed
+	setRightLungVolume(volumeForce );
 	switch ( lungState )
 	{
 		case 0:
@@ -1671,7 +1862,7 @@ runLung( void )
 				gp->setValue(fallPin, TURN_OFF );
 				fallOnOff = 0;
 				usleep(10000);
-				if ( shmData->respiration.chest_movement )
+				if ( snap.respiration.chest_movement )
 				{
 					if ( debug ) printf("ON\n" );
 					gp->setValue(riseLPin, TURN_ON );
@@ -1681,7 +1872,7 @@ runLung( void )
 				gpioPinSet(fallPin, TURN_OFF );
 				fallOnOff = 0;
 				usleep(10000);
-				if ( shmData->respiration.chest_movement )
+				if ( snap.respiration.chest_movement )
 				{
 					if ( debug ) printf("ON\n" );
 					gpioPinSet(riseLPin, TURN_ON );
@@ -1696,11 +1887,11 @@ runLung( void )
 				
 				// The duration should be 30% of the respiration period
 #define INH_PERCENT		(0.30)
-				periodSeconds = ( 1 / (double)shmData->respiration.rate ) * 60;
+				periodSeconds = ( 1 / (double)snap.respiration.rate ) * 60;
 				periodSeconds *= INH_PERCENT;
 				if ( periodSeconds < 0 )
 				{
-					sprintf(msgbuf, "runLung: rise periodSeconds is negative period %f rate %d", periodSeconds, shmData->respiration.rate );
+					sprintf(msgbuf, "runLung: rise periodSeconds is negative period %f rate %d", periodSeconds, snap.respiration.rate );
 					periodSeconds = 1;
 					log_message("", msgbuf );
 				}
@@ -1710,7 +1901,7 @@ runLung( void )
 
 				if ( delayTime < 0 )
 				{
-					sprintf(msgbuf, "runLung: rise delayTime is negative for period %f rate %d", periodSeconds, shmData->respiration.rate );
+					sprintf(msgbuf, "runLung: rise delayTime is negative for period %f rate %d", periodSeconds, snap.respiration.rate );
 					delayTime = 0;
 					log_message("", msgbuf );
 				}
@@ -1721,7 +1912,7 @@ runLung( void )
 
 				if ( riseTime < 0 )
 				{
-					sprintf(msgbuf, "runLung: rise riseTime is negative for period %f rate %d", periodSeconds, shmData->respiration.rate );
+					sprintf(msgbuf, "runLung: rise riseTime is negative for period %f rate %d", periodSeconds, snap.respiration.rate );
 					riseTime = 0;
 					log_message("", msgbuf );
 				}
@@ -1743,8 +1934,20 @@ runLung( void )
 			}
 			else if ( current.respiration_rate == 0 )
 			{
-				if ( exhLimit-- == 0 )
+				clock_gettime(CLOCK_MONOTONIC, &ts );
+				now = (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+				if ( exhRestart )
+				{
+					exhRestart = 0;
+					exhDeadline = 0;
+				}
+				if ( exhDeadline == 0 )
 				{
+					exhDeadline = now + EXH_LIMIT_MS;
+				}
+				else if ( exhDeadline > 0 && now >= exhDeadline )
+				{
+					exhDeadline = -1;
 					if ( debug ) printf("OFF\n" );
 #ifdef USE_BBBGPIO
 					gp->setValue(fallPin, TURN_OFF );
@@ -1763,9 +1966,9 @@ runLung( void )
 			}
 			break;
 		case 1:
-			if ( shmData->auscultation.side != 0 )
+			if ( snap.auscultation.side != 0 )
 			{
-				if ( shmData->auscultation.side == 1 )
+				if ( snap.auscultation.side == 1 )
 				{
 					wav.trackPlayPoly(0, inhL);
 				}
@@ -1789,7 +1992,7 @@ runLung( void )
 			break;
 #if 0
 		case 2: // No longer used
-			if ( shmData->auscultation.side == 0 )
+			if ( snap.auscultation.side == 0 )
 			{
 				wav.trackStop(inh );
 				lungState = 0;
@@ -1857,14 +2060,14 @@ void doPulse(void )
 {
 	int pulseVolume;
 	
-	if ( shmData->cardiac.pea )
+	if ( snap.cardiac.pea )
 	{
 		return;
 	}
 	
-	if ( shmData->pulse.right_dorsal && shmData->cardiac.right_dorsal_pulse_strength > 0 )
+	if ( snap.pulse.right_dorsal && snap.cardiac.right_dorsal_pulse_strength > 0 )
 	{
-			pulseVolume = getPulseVolume(shmData->pulse.right_dorsal, shmData->cardiac.right_dorsal_pulse_strength );
+			pulseVolume = getPulseVolume(snap.pulse.right_dorsal, snap.cardiac.right_dorsal_pulse_strength );
 			pulseVolume = pulseVolume - 25;
 			shmData->pulse.volume[PULSE_RIGHT_DORSAL] = pulseVolume;
 			wav.channelGain(5, pulseVolume );
@@ -1875,9 +2078,9 @@ void doPulse(void )
 		wav.channelGain(5, PULSE_VOLUME_OFF );
 		shmData->pulse.volume[PULSE_RIGHT_DORSAL] = PULSE_VOLUME_OFF;
 	}
-	if ( shmData->pulse.left_dorsal && shmData->cardiac.left_dorsal_pulse_strength > 0 )
+	if ( snap.pulse.left_dorsal && snap.cardiac.left_dorsal_pulse_strength > 0 )
 	{
-			pulseVolume = getPulseVolume(shmData->pulse.left_dorsal, shmData->cardiac.left_dorsal_pulse_strength );
+			pulseVolume = getPulseVolume(snap.pulse.left_dorsal, snap.cardiac.left_dorsal_pulse_strength );
 			pulseVolume = pulseVolume - 25;
 			shmData->pulse.volume[PULSE_LEFT_DORSAL] = pulseVolume;
 			wav.channelGain(4, pulseVolume );
@@ -1888,9 +2091,9 @@ void doPulse(void )
 		wav.channelGain(4, PULSE_VOLUME_OFF );
 		shmData->pulse.volume[PULSE_LEFT_DORSAL] = PULSE_VOLUME_OFF;
 	}
-	if ( shmData->pulse.right_femoral && shmData->cardiac.right_femoral_pulse_strength > 0 )
+	if ( snap.pulse.right_femoral && snap.cardiac.right_femoral_pulse_strength > 0 )
 	{
-			pulseVolume = getPulseVolume(shmData->pulse.right_femoral, shmData->cardiac.right_femoral_pulse_strength );
+			pulseVolume = getPulseVolume(snap.pulse.right_femoral, snap.cardiac.right_femoral_pulse_strength );
 			pulseVolume = pulseVolume - 25;
 			shmData->pulse.volume[PULSE_RIGHT_FEMORAL] = pulseVolume;
 			wav.channelGain(3, pulseVolume );
@@ -1901,9 +2104,9 @@ void doPulse(void )
 		wav.channelGain(3, PULSE_VOLUME_OFF );
 		shmData->pulse.volume[PULSE_RIGHT_FEMORAL] = PULSE_VOLUME_OFF;
 	}
-	if ( shmData->pulse.left_femoral && shmData->cardiac.left_femoral_pulse_strength > 0 )
+	if ( snap.pulse.left_femoral && snap.cardiac.left_femoral_pulse_strength > 0 )
 	{
-			pulseVolume = getPulseVolume(shmData->pulse.left_femoral, shmData->cardiac.left_femoral_pulse_strength );
+			pulseVolume = getPulseVolume(snap.pulse.left_femoral, snap.cardiac.left_femoral_pulse_strength );
 			pulseVolume = pulseVolume - 25;
 			shmData->pulse.volume[PULSE_LEFT_FEMORAL] = pulseVolume;
 			wav.channelGain(2, pulseVolume );
@@ -2007,30 +2210,48 @@ void doPulse(void )
 
 char lastTag[STR_SIZE];
 
+void
+takeSnapshot(void )
+{
+	shmSnapshot(SHM_SECTION_CARDIAC, &snap.cardiac );
+	shmSnapshot(SHM_SECTION_RESPIRATION, &snap.respiration );
+	shmSnapshot(SHM_SECTION_AUSCULTATION, &snap.auscultation );
+	shmSnapshot(SHM_SECTION_PULSE, &snap.pulse );
+}
+
 void
 runMonitor(void )
 {
+	struct shmChangeReader reader;
+	unsigned int masks[SHM_SECTIONS];
 	
+	memset(&reader, 0, sizeof(reader) );
 	while ( 1 )
 	{
 		if ( debug > 1 )
 		{
-			if ( strcmp(shmData->auscultation.tag, lastTag ) != 0 )
+			// Only the tag is shown, so sleep until rfidScan changes it
+			shmChangeWait(&reader, ( 1 << SHM_SECTION_AUSCULTATION ), masks, -1 );
+		}
+		takeSnapshot();
+		if ( debug > 1 )
+		{
+			if ( strcmp(snap.auscultation.tag, lastTag ) != 0 )
 			{
-				memcpy(lastTag, shmData->auscultation.tag, STR_SIZE );
+				memcpy(lastTag, snap.auscultation.tag, STR_SIZE );
 				printf("Tag %s\n", lastTag );
 			}
 		}
 		else
 		{
 			printf( "sense %d:%d:%d:%d  %d:%d:%d:%d  %d:%d:%d:%d  %d:%d:%d:%d  Tag: '%s', %d/%d %s\n", 
-					shmData->pulse.base[1], shmData->pulse.ain[1], shmData->pulse.touch[1], shmData->pulse.volume[1],
-					shmData->pulse.base[2], shmData->pulse.ain[2], shmData->pulse.touch[2], shmData->pulse.volume[2],
-					shmData->pulse.base[3], shmData->pulse.ain[3], shmData->pulse.touch[3], shmData->pulse.volume[3],
-					shmData->pulse.base[4], shmData->pulse.ain[4], shmData->pulse.touch[4], shmData->pulse.volume[4], 
-					shmData->auscultation.tag, 
-					shmData->manual_breath_ain, shmData->manual_breath_baseline, shmData->respiration.manual_breath ? " - Breath" : "" );
-		}
-		usleep(500000 );
+					snap.pulse.base[1], snap.pulse.ain[1], snap.pulse.touch[1], snap.pulse.volume[1],
+					snap.pulse.base[2], snap.pulse.ain[2], snap.pulse.touch[2], snap.pulse.volume[2],
+					snap.pulse.base[3], snap.pulse.ain[3], snap.pulse.touch[3], snap.pulse.volume[3],
+					snap.pulse.base[4], snap.pulse.ain[4], snap.pulse.touch[4], snap.pulse.volume[4], 
+					snap.auscultation.tag, 
+					shmData->manual_breath_ain, shmData->manual_breath_baseline, snap.respiration.manual_breath ? " - Breath" : "" );
+			usleep(500000 );
+		}
 	}
 }
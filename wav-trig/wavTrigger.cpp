@@ -37,12 +37,16 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 #include "wavTrigger.h"
 
 #include <syslog.h>
 
 wavTrigger::wavTrigger(void)
 {
+	commands = 0;
+	writeFailures = 0;
+	writeErrno = 0;
 }
 
 // **************************************************************
@@ -51,6 +55,18 @@ void wavTrigger::start(int port ) {
   boardType = BOARD_UNKNOWN;
 }
 
+// **************************************************************
+// Send a command, counting it for the caller's statistics. The counts
+// are atomic, as soundSense sends from more than one thread.
+void wavTrigger::sioWrite(char *txbuf, int len) {
+
+  __sync_fetch_and_add(&commands, 1);
+  if ( write(sioPort, txbuf, len) != len ) {
+    writeErrno = errno;
+    __sync_fetch_and_add(&writeFailures, 1);
+  }
+}
+
 // **************************************************************
 // For Tsunami, this will set the Volume for Channel 0
 void wavTrigger::masterGain(int gain) {
@@ -69,7 +85,7 @@ int len;
   txbuf[6] = 0x55;
   len = 7;
   
-  write(sioPort, txbuf, len );
+  sioWrite(txbuf, len);
 }
 
 // **************************************************************
@@ -92,7 +108,7 @@ int len;
   txbuf[7] = 0x55;
   len = 8;
   
-  write(sioPort, txbuf, len );
+  sioWrite(txbuf, len);
 }
 // **************************************************************
 void wavTrigger::trackPlaySolo(int chan, int trk) {
@@ -181,7 +197,7 @@ int i;
 	}
 	printf("\n" );
 	
-  write(sioPort, txbuf, len);
+  sioWrite(txbuf, len);
 }
 
 // **************************************************************
@@ -194,7 +210,7 @@ char txbuf[10];
   txbuf[2] = 0x05;
   txbuf[3] = CMD_STOP_ALL;
   txbuf[4] = 0x55;
-  write(sioPort, txbuf, 5);
+  sioWrite(txbuf, 5);
 }
 
 // **************************************************************
@@ -207,7 +223,7 @@ char txbuf[10];
   txbuf[2] = 0x05;
   txbuf[3] = CMD_RESUME_ALL_SYNC;
   txbuf[4] = 0x55;
-  write(sioPort, txbuf, 5);
+  sioWrite(txbuf, 5);
 }
 
 // **************************************************************
@@ -226,7 +242,7 @@ unsigned short vol;
   txbuf[6] = (char)vol;
   txbuf[7] = (char)(vol >> 8);
   txbuf[8] = 0x55;
-  write(sioPort, txbuf, 9);
+  sioWrite(txbuf, 9);
 }
 
 // **************************************************************
@@ -248,7 +264,7 @@ unsigned short vol;
   txbuf[9] = (char)(time >> 8);
   txbuf[10] = stopFlag;
   txbuf[11] = 0x55;
-  write(sioPort, txbuf, 12);
+  sioWrite(txbuf, 12);
 }
 
 // **************************************************************
@@ -275,7 +291,7 @@ unsigned short vol;
   txbuf[9] = (char)(time >> 8);
   txbuf[10] = 0x00;
   txbuf[11] = 0x55;
-  write(sioPort, txbuf, 12);
+  sioWrite(txbuf, 12);
 
   // Start a fade-out on the From track
   txbuf[0] = 0xf0;
@@ -291,7 +307,7 @@ unsigned short vol;
   txbuf[9] = (char)(time >> 8);
   txbuf[10] = 0x01;
   txbuf[11] = 0x55;
-  write(sioPort, txbuf, 12);
+  sioWrite(txbuf, 12);
 }
 
 // **************************************************************
@@ -308,7 +324,7 @@ unsigned short off;
   txbuf[4] = (char)off;
   txbuf[5] = (char)(off >> 8);
   txbuf[6] = 0x55;
-  write(sioPort, txbuf, 7);
+  sioWrite(txbuf, 7);
 }
 
 // **************************************************************
@@ -323,7 +339,7 @@ unsigned short off;
   txbuf[3] = CMD_AMP_POWER;
   txbuf[4] = on;
   txbuf[5] = 0x55;
-  write(sioPort, txbuf, 6);
+  sioWrite(txbuf, 6);
 }
 
 // **************************************************************
@@ -339,7 +355,7 @@ char cc;
   txbuf[2] = 0x05;
   txbuf[3] = CMD_GET_VERSION;
   txbuf[4] = 0x55;
-  write(sioPort, txbuf, 6);
+  sioWrite(txbuf, 6);
   len = getReturnData(buf, maxLen );
   if ( buf[0] == 0x19 )
   {
@@ -378,7 +394,7 @@ unsigned short off;
   txbuf[2] = 0x05;
   txbuf[3] = CMD_GET_SYS_INFO;
   txbuf[4] = 0x55;
-  write(sioPort, txbuf, 6);
+  sioWrite(txbuf, 6);
   return(getReturnData(buf, maxLen ) );
 }
 
@@ -392,7 +408,7 @@ unsigned short off;
   txbuf[2] = 0x05;
   txbuf[3] = CMD_GET_STATUS;
   txbuf[4] = 0x55;
-  write(sioPort, txbuf, 6);
+  sioWrite(txbuf, 6);
   return(getReturnData(buf, maxLen ) );
 }
 
@@ -140,9 +140,13 @@ public:
 	int boardType;
 	char boardFWVersion[32];
 	int tsunamiMode;
+	unsigned int commands;		// Commands sent
+	unsigned int writeFailures;	// Commands not fully written
+	int writeErrno;				// errno of the last failure
 	
 private:
 	void trackControl(int chan, int trk, int code);
+	void sioWrite(char *txbuf, int len);
 	int getReturnData(char *buf, int maxLen );
 	int	sioPort;	// The current port
 